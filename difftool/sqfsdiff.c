@@ -10,7 +10,8 @@ static int open_sfqs(sqfs_state_t *state, const char *path)
 {
 	int ret;
 
-	state->file = sqfs_open_file(path, SQFS_FILE_OPEN_READ_ONLY);
+	state->file = sqfs_open_file(path, SQFS_FILE_OPEN_READ_ONLY |
+				     SQFS_FILE_OPEN_MMAP);
 	if (state->file == NULL) {
 		perror(path);
 		return -1;
@@ -44,8 +44,76 @@ typedef struct {
 	size_t frag_dup;
 	sqfs_u64 bytes_written;
 	sqfs_u64 bytes_read;
+	size_t max_block_buffers;
+	size_t incompressible_blocks;
+	size_t duplicate_files;
+	size_t peak_memory;
+
+	/* pipeline stage timing in nanoseconds */
+	size_t blocks_processed;
+	sqfs_u64 start_time;
+	sqfs_u64 pack_time;
+	sqfs_u64 wait_time;
+	sqfs_u64 compress_time;
+	sqfs_u64 max_worker_time;
+	sqfs_u64 queue_time;
+	sqfs_u64 reorder_time;
+	sqfs_u64 write_time;
 } data_writer_stats_t;
 
+/*
+  A rule that applies data writer flags and compressor options to all
+  regular files that match a pattern.
+ */
+typedef struct file_policy_t {
+	struct file_policy_t *next;
+
+	/* SQFS_BLK_* flags for matching files */
+	int blk_flags;
+
+	/* compressor options for matching files or NULL for the defaults */
+	char *comp_extra;
+
+	/* created on demand when the first matching file is packed */
+	sqfs_compressor_t *cmp;
+
+	/* fnmatch() pattern, matched against the file name only
+	   if it contains no '/', otherwise against the full path */
+	char pattern[];
+} file_policy_t;
+
+typedef struct file_hash_t {
+	struct file_hash_t *next;
+	sqfs_u64 size;
+	sqfs_u64 hash;
+	int flags;
+
+	/* input path, used to compare the contents on a hash match */
+	const char *filename;
+	sqfs_inode_generic_t *inode;
+
+	/* for duplicates, the inode of the earlier file with the same data */
+	const sqfs_inode_generic_t *orig;
+} file_hash_t;
+
+typedef struct {
+	/* hash table of packed files, keyed by content hash */
+	file_hash_t **buckets;
+	size_t num_buckets;
+	size_t num_files;
+
+	/* files that were not packed, resolved by sqfs_writer_finish */
+	file_hash_t *duplicates;
+} file_dedup_t;
+
+/* Writes the data writer trace events to a file in trace-event JSON format */
+typedef struct {
+	FILE *fp;
+	const char *filename;
+	sqfs_u64 start;
+	size_t count;
+} trace_writer_t;
+
 typedef struct {
 	sqfs_data_writer_t *data;
 	sqfs_compressor_t *cmp;
@@ -55,15 +123,22 @@ typedef struct {
 	fstree_t fs;
 	data_writer_stats_t stats;
 	sqfs_xattr_writer_t *xwr;
+	sqfs_compressor_config_t cmp_cfg;
+	file_policy_t *policy;
+	file_dedup_t dedup;
+	trace_writer_t trace;
 } sqfs_writer_t;
 
 typedef struct {
 	const char *filename;
+	const char *trace_file;
 	char *fs_defaults;
 	char *comp_extra;
 	size_t block_size;
 	size_t devblksize;
 	size_t max_backlog;
+	size_t dedup_buffer;
+	size_t memory_limit;
 	size_t num_jobs;
 
 	int outmode;
@@ -72,6 +147,10 @@ typedef struct {
 	bool exportable;
 	bool no_xattr;
 	bool quiet;
+	bool skip_incompressible;
+
+	/* passed on to the sqfs_writer_t by sqfs_writer_init */
+	file_policy_t *policy;
 } sqfs_writer_cfg_t;
 
 /*
@@ -122,12 +201,69 @@ int sqfs_data_reader_dump(const char *name, sqfs_data_reader_t *data,
 
 sqfs_file_t *sqfs_get_stdin_file(const sparse_map_t *map, sqfs_u64 size);
 
-void register_stat_hooks(sqfs_data_writer_t *data, data_writer_stats_t *stats);
+/* Copy the block and resource usage statistics of the data writer */
+void collect_writer_stats(sqfs_data_writer_t *data,
+			  data_writer_stats_t *stats);
 
 int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
 			 sqfs_inode_generic_t *inode,
 			 sqfs_file_t *file, int flags);
 
+/*
+  Pack the data of a regular file, reading it directly from a file descriptor.
+  The input is memory mapped if possible, otherwise it is read in block sized
+  chunks. Holes reported by the file system are packed as sparse blocks
+  without reading them.
+ */
+int write_data_from_fd(const char *filename, sqfs_data_writer_t *data,
+		       sqfs_inode_generic_t *inode, int fd, int flags);
+
+/*
+  Append a file policy rule to a list. The options are a comma separated list
+  of data writer flags and compressor options.
+ */
+int file_policy_add(file_policy_t **list, const char *pattern,
+		    const char *options);
+
+/* Same as file_policy_add, but takes a "<pattern>:<options>" string */
+int file_policy_add_rule(file_policy_t **list, const char *rule);
+
+void file_policy_free(file_policy_t *list);
+
+/*
+  Hash the contents of a regular file and compare it against the files seen
+  so far. If an earlier file with identical contents and the same data writer
+  flags exists, the inode is recorded as a duplicate and 1 is returned. The
+  caller must then not submit any data for it, the block list and fragment
+  location are copied over from the earlier inode in sqfs_writer_finish.
+
+  Returns 0 if the file is not a duplicate and -1 on failure.
+ */
+int file_dedup_check(sqfs_writer_t *sqfs, const char *filename, int fd,
+		     sqfs_u64 size, int flags, sqfs_inode_generic_t *inode);
+
+void file_dedup_resolve(sqfs_writer_t *sqfs);
+
+void file_dedup_cleanup(sqfs_writer_t *sqfs);
+
+/*
+  Open a trace file and register hooks with the data writer that write all
+  pipeline events to it. Returns 0 on success, prints an error message to
+  stderr and returns -1 on failure.
+ */
+int trace_writer_init(trace_writer_t *trace, const char *filename,
+		      sqfs_data_writer_t *data, unsigned int num_jobs);
+
+/* Finish and close the trace file. Returns -1 if writing it failed. */
+int trace_writer_finish(trace_writer_t *trace);
+
+/*
+  Get the data writer flags for a file from the first matching policy rule.
+  Alternative compressors are created and registered on first use.
+ */
+int sqfs_writer_file_flags(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg,
+			   const char *path, int *flags);
+
 void sqfs_writer_cfg_init(sqfs_writer_cfg_t *cfg);
 
 int sqfs_writer_init(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *wrcfg);
@@ -160,4 +296,17 @@ int popd(void);
 /* A common implementation of the '--version' command line flag. */
 void print_version(const char *progname);
 
+/* Upper bound for worker thread counts accepted on the command line. */
+#define MAX_NUM_JOBS (1024)
+
+/*
+  Parse a numeric command line argument. The whole string must be an
+  unsigned number in the range [min, max], in decimal, octal or hex.
+
+  Returns 0 on success. On failure, prints an error message to stderr that
+  refers to the value as 'what'.
+*/
+int parse_size(const char *what, size_t *out, const char *str,
+	       size_t min, size_t max);
+
 #endif /* COMMON_H */
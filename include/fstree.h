@@ -22,6 +22,9 @@ typedef struct file_info_t file_info_t;
 typedef struct dir_info_t dir_info_t;
 typedef struct fstree_t fstree_t;
 
+typedef int (*fstree_policy_cb_t)(void *user, const char *pattern,
+				  const char *options);
+
 /* Additional meta data stored in a tree_node_t for regular files. */
 struct file_info_t {
 	/* Linked list pointer for files in fstree_t */
@@ -150,12 +153,16 @@ tree_node_t *fstree_add_generic(fstree_t *fs, const char *path,
   Data is read from the given file pointer. The filename is only used for
   producing error messages.
 
+  Lines of the form "policy <pattern> <options>" are passed on to the
+  policy callback. If it is NULL, they are treated as an error.
+
   On failure, an error report with filename and line number is written
   to stderr.
 
   Returns 0 on success.
  */
-int fstree_from_file(fstree_t *fs, const char *filename, FILE *fp);
+int fstree_from_file(fstree_t *fs, const char *filename, FILE *fp,
+		     fstree_policy_cb_t policy_cb, void *user);
 
 /* Returns 0 on success. Prints to stderr on failure */
 int fstree_gen_inode_table(fstree_t *fs);
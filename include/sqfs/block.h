@@ -35,6 +35,13 @@
 #define SQFS_ON_DISK_BLOCK_SIZE(size) ((size) & ((1 << 24) - 1))
 #define SQFS_IS_SPARSE_BLOCK(size) (SQFS_ON_DISK_BLOCK_SIZE(size) == 0)
 
+#define SQFS_BLK_COMPRESSOR(index) \
+	(((sqfs_u32)(index) << 4) & SQFS_BLK_COMPRESSOR_MASK)
+#define SQFS_BLK_GET_COMPRESSOR(flags) \
+	(((flags) & SQFS_BLK_COMPRESSOR_MASK) >> 4)
+
+#define SQFS_MAX_DATA_COMPRESSORS 16
+
 /**
  * @struct sqfs_fragment_t
  *
@@ -89,6 +96,30 @@ typedef enum {
 	 */
 	SQFS_BLK_DONT_FRAGMENT = 0x0004,
 
+	/**
+	 * @brief Check if a block looks compressible before compressing it.
+	 *
+	 * If set, the @ref sqfs_data_writer_t estimates the entropy of a
+	 * sample of each block. Blocks that look incompressible (e.g. because
+	 * they contain already compressed data) are not passed to the
+	 * compressor and get the @ref SQFS_BLK_DONT_COMPRESS flag set.
+	 */
+	SQFS_BLK_ESTIMATE_ENTROPY = 0x0008,
+
+	/**
+	 * @brief Selects the compressor used for the blocks of a file.
+	 *
+	 * Zero selects the default compressor of the
+	 * @ref sqfs_data_writer_t, other values are indices returned by
+	 * @ref sqfs_data_writer_add_compressor. Use the
+	 * @ref SQFS_BLK_COMPRESSOR macro to generate the flag bits from an
+	 * index.
+	 *
+	 * Tail ends packed into fragment blocks always use the default
+	 * compressor.
+	 */
+	SQFS_BLK_COMPRESSOR_MASK = 0x00F0,
+
 	/**
 	 * @brief Set by the @ref sqfs_data_writer_t on the first
 	 *        block of a file.
@@ -122,7 +153,7 @@ typedef enum {
 	/**
 	 * @brief The combination of all flags that are user settable.
 	 */
-	SQFS_BLK_USER_SETTABLE_FLAGS = 0x0007,
+	SQFS_BLK_USER_SETTABLE_FLAGS = 0x00FF,
 } E_SQFS_BLK_FLAGS;
 
 /**
@@ -45,8 +45,61 @@
  *
  * The data reader abstracts all of this away in a simple interface that allows
  * reading file data through an inode description and a location in the file.
+ *
+ * Uncompressed data and fragment blocks are kept in a least recently used
+ * cache, so random or interleaved reads do not have to read and uncompress
+ * the same blocks over and over again.
+ *
+ * For sequential extraction of many files, the data reader can decompress
+ * the upcoming blocks of a list of files on a pool of worker threads, see
+ * @ref sqfs_data_reader_set_readahead.
+ *
+ * A data reader must not be used by multiple threads at once. Instead, each
+ * thread can be given its own data reader that shares the fragment table and
+ * block cache with the others, see @ref sqfs_data_reader_share.
  */
 
+/**
+ * @struct sqfs_data_reader_stats_t
+ *
+ * @brief Block cache statistics of a data reader.
+ *
+ * This structure can be filled in by @ref sqfs_data_reader_get_stats.
+ */
+struct sqfs_data_reader_stats_t {
+	/**
+	 * @brief Set this to the size of the struct.
+	 *
+	 * This is required for future expandabillity while maintaining ABI
+	 * compatibillity. The implementation of
+	 * @ref sqfs_data_reader_get_stats rejects any struct where this
+	 * isn't the exact size.
+	 */
+	size_t size;
+
+	/**
+	 * @brief The number of block lookups that were served from the cache.
+	 */
+	sqfs_u64 cache_hits;
+
+	/**
+	 * @brief The number of block lookups that had to read a block
+	 *        from disk.
+	 */
+	sqfs_u64 cache_misses;
+
+	/**
+	 * @brief The number of blocks currently in the cache.
+	 */
+	size_t cached_blocks;
+
+	/**
+	 * @brief The size of the cache in bytes, rounded down to a whole
+	 *        number of blocks.
+	 */
+	size_t cache_size;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -68,15 +121,133 @@ SQFS_API sqfs_data_reader_t *sqfs_data_reader_create(sqfs_file_t *file,
 						     size_t block_size,
 						     sqfs_compressor_t *cmp);
 
+/**
+ * @brief Create a data reader that shares the fragment table and block
+ *        cache of an existing one.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * The new data reader gets its own copy of the compressor (see
+ * @ref sqfs_compressor_t::create_copy) and its own scratch buffers, so the
+ * two can be used concurrently from different threads. Cache lookups are
+ * serialized, but blocks are read and decompressed in parallel. The fragment
+ * table, the cache size and the statistics are common to all data readers
+ * sharing a cache, read-ahead is not.
+ *
+ * The underlying file is accessed concurrently, so its read_at function must
+ * be safe to call from multiple threads at once. This is the case for the
+ * file implementation returned by @ref sqfs_open_file.
+ *
+ * If libsquashfs was built without thread support, the data readers still
+ * share state, but must not be used concurrently.
+ *
+ * @param data A pointer to a data reader object.
+ *
+ * @return A pointer to a new data reader object. NULL means
+ *         allocation failure.
+ */
+SQFS_API sqfs_data_reader_t *sqfs_data_reader_share(sqfs_data_reader_t *data);
+
 /**
  * @brief Destroy a data reader instance and free all memory used by it.
  *
  * @memberof sqfs_data_reader_t
  *
+ * The shared fragment table and block cache are freed along with the last
+ * data reader using them. Data readers sharing them can be destroyed in any
+ * order.
+ *
  * @param data A pointer to a data reader object.
  */
 SQFS_API void sqfs_data_reader_destroy(sqfs_data_reader_t *data);
 
+/**
+ * @brief Change the amount of memory used for caching blocks.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * The cache is used by @ref sqfs_data_reader_read and
+ * @ref sqfs_data_reader_get_fragment. It holds uncompressed data and fragment
+ * blocks, keyed by their location in the image. If it is full, the least
+ * recently used block is dropped. By default, 8 blocks are cached.
+ *
+ * @param data A pointer to a data reader object.
+ * @param size The maximum number of bytes to use for cached blocks. This is
+ *             rounded down to a multiple of the block size, but at least one
+ *             block is always cached.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_reader_set_cache_size(sqfs_data_reader_t *data,
+					     size_t size);
+
+/**
+ * @brief Get the block cache statistics of a data reader.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * @param data A pointer to a data reader object.
+ * @param stats A pointer to a statistics structure. The size field must be
+ *              set to the size of the struct.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if the size field of
+ *         the statistics structure does not match.
+ */
+SQFS_API int sqfs_data_reader_get_stats(const sqfs_data_reader_t *data,
+					sqfs_data_reader_stats_t *stats);
+
+/**
+ * @brief Enable or disable decompression of upcoming blocks in the
+ *        background.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * Files queued with @ref sqfs_data_reader_queue_file are read ahead and
+ * decompressed on a pool of worker threads. Consecutive compressed blocks
+ * of a file are fetched from the underlying file with a single read, up to
+ * half of the blocks in flight at a time. If
+ * @ref sqfs_data_reader_get_block is then called for the queued blocks in
+ * order, it returns the already uncompressed blocks. Blocks that are skipped
+ * by the caller are dropped. Requests for blocks that are not queued are
+ * served directly, as if read-ahead was disabled.
+ *
+ * Reconfiguring read-ahead drops all queued files and blocks. If libsquashfs
+ * was compiled without thread support, this does nothing.
+ *
+ * @param data A pointer to a data reader object.
+ * @param num_workers The number of worker threads to use for decompressing
+ *                    blocks. Zero disables read-ahead.
+ * @param max_blocks The maximum number of blocks in flight. If zero, a
+ *                   default of four blocks per worker is used.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_reader_set_readahead(sqfs_data_reader_t *data,
+					    unsigned int num_workers,
+					    size_t max_blocks);
+
+/**
+ * @brief Queue a file for read-ahead.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * The data blocks of queued files are read and decompressed in the order in
+ * which the files were queued, see @ref sqfs_data_reader_set_readahead.
+ * Blocks are matched by inode pointer, so @ref sqfs_data_reader_get_block
+ * must be called with the same pointer. The inode must remain valid until
+ * all its blocks have been retrieved, read-ahead is reconfigured or the
+ * data reader is destroyed.
+ *
+ * If read-ahead is disabled, this does nothing.
+ *
+ * @param data A pointer to a data reader object.
+ * @param inode A pointer to the inode describing the file.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_reader_queue_file(sqfs_data_reader_t *data,
+					 const sqfs_inode_generic_t *inode);
+
 /**
  * @brief Read and decode the fragment table from disk.
  *
@@ -121,14 +292,85 @@ SQFS_API int sqfs_data_reader_get_block(sqfs_data_reader_t *data,
 					const sqfs_inode_generic_t *inode,
 					size_t index, sqfs_block_t **out);
 
+/**
+ * @brief Get a read-only reference to a data block of a file, without
+ *        copying it.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * Unlike @ref sqfs_data_reader_get_block, this returns a pointer into the
+ * block cache of the data reader (see @ref sqfs_data_reader_set_cache_size).
+ * The referenced block is kept in the cache until the reference is released
+ * through @ref sqfs_data_reader_release_ref. If all cached blocks are
+ * referenced, the cache grows beyond its configured size until references
+ * are released.
+ *
+ * Blocks delivered through read-ahead (see
+ * @ref sqfs_data_reader_set_readahead) are moved into the cache. If the
+ * image file is memory mapped (see @ref SQFS_FILE_OPEN_MMAP), uncompressed
+ * blocks are referenced in place, without going through the cache.
+ *
+ * @param data A pointer to a data reader object.
+ * @param inode A pointer to the inode describing the file.
+ * @param index The block index in the inodes block list.
+ * @param out Returns a pointer to the uncompressed data.
+ * @param size Returns the number of bytes of uncompressed data.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_reader_get_block_ref(sqfs_data_reader_t *data,
+					    const sqfs_inode_generic_t *inode,
+					    size_t index, const sqfs_u8 **out,
+					    size_t *size);
+
+/**
+ * @brief Get a read-only reference to the tail end of a file, without
+ *        copying it.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * This works like @ref sqfs_data_reader_get_block_ref, but returns a pointer
+ * to the tail end of the file inside its cached fragment block. If the file
+ * has no tail end in a fragment block, NULL and a size of zero is returned.
+ *
+ * @param data A pointer to a data reader object.
+ * @param inode A pointer to the inode describing the file.
+ * @param out Returns a pointer to the uncompressed data.
+ * @param size Returns the number of bytes of uncompressed data.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API
+int sqfs_data_reader_get_fragment_ref(sqfs_data_reader_t *data,
+				      const sqfs_inode_generic_t *inode,
+				      const sqfs_u8 **out, size_t *size);
+
+/**
+ * @brief Release a reference obtained through
+ *        @ref sqfs_data_reader_get_block_ref or
+ *        @ref sqfs_data_reader_get_fragment_ref.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * The data must not be accessed after the last reference to it has been
+ * released. A reference can also be released through another data reader
+ * sharing the cache, see @ref sqfs_data_reader_share. Destroying the last
+ * data reader using the cache implicitly drops all references.
+ *
+ * @param data A pointer to a data reader object.
+ * @param ptr The data pointer returned by the get function. NULL is ignored.
+ */
+SQFS_API void sqfs_data_reader_release_ref(sqfs_data_reader_t *data,
+					   const sqfs_u8 *ptr);
+
 /**
  * @brief A simple UNIX-read-like function to read data from a file.
  *
  * @memberof sqfs_data_reader_t
  *
  * This function acts like the read system call in a Unix-like OS. It takes
- * care of reading accross data blocks and fragment internally, using a
- * data and fragment block cache.
+ * care of reading accross data blocks and fragment internally, using the
+ * block cache (see @ref sqfs_data_reader_set_cache_size).
  *
  * @param data A pointer to a data reader object.
  * @param inode A pointer to the inode describing the file.
@@ -42,6 +42,62 @@
  * and finally writing it to disk.
  */
 
+/**
+ * @enum E_SQFS_TRACE_EVENT
+ *
+ * @brief Pipeline events reported through
+ *        @ref sqfs_block_hooks_t::trace_event.
+ */
+typedef enum {
+	/**
+	 * @brief A block was added to the compressor queue. The argument is
+	 *        the sequence number of the block.
+	 */
+	SQFS_TRACE_ENQUEUE = 0,
+
+	/**
+	 * @brief A worker started processing a block. The argument is the
+	 *        sequence number of the block.
+	 */
+	SQFS_TRACE_COMPRESS_BEGIN,
+
+	/**
+	 * @brief A worker finished processing a block. The argument is the
+	 *        sequence number of the block.
+	 */
+	SQFS_TRACE_COMPRESS_END,
+
+	/**
+	 * @brief A processed block was taken off the completion queue in
+	 *        order. The argument is the sequence number of the block.
+	 */
+	SQFS_TRACE_DEQUEUE,
+
+	/**
+	 * @brief Writing to the output file started. The argument is the
+	 *        number of bytes that are written.
+	 */
+	SQFS_TRACE_WRITE_BEGIN,
+
+	/**
+	 * @brief Writing to the output file is done. The argument is the
+	 *        number of bytes that were written.
+	 */
+	SQFS_TRACE_WRITE_END,
+
+	/**
+	 * @brief Submitting a block is blocked because too many blocks are
+	 *        in flight. The argument is the number of blocks in flight.
+	 */
+	SQFS_TRACE_WAIT_BEGIN,
+
+	/**
+	 * @brief Submitting a block can continue. The argument is the number
+	 *        of blocks in flight.
+	 */
+	SQFS_TRACE_WAIT_END,
+} E_SQFS_TRACE_EVENT;
+
 /**
  * @struct sqfs_block_hooks_t
  *
@@ -56,17 +112,26 @@
  * writtien.
  *
  * The callbacks can be individually set to NULL to disable them.
+ *
+ * If the data writer uses worker threads, the callbacks are invoked from a
+ * dedicated writer thread and not from the thread that submits the data.
+ * Block writes are collected in an internal buffer and merged into larger
+ * writes. The buffer is flushed before calling the block write hooks, so
+ * those may still append data to the file. Setting them disables most of
+ * the write coalescing, as well as the deduplication buffer set with
+ * @ref sqfs_data_writer_set_dedup_buffer.
  */
 struct sqfs_block_hooks_t {
 	/**
 	 * @brief Set this to the size of the struct.
 	 *
 	 * This is required for future expandabillity while maintaining ABI
-	 * compatibillity. At the current time, the implementation of
-	 * @ref sqfs_data_writer_set_hooks rejects any hook struct where this
-	 * isn't the exact size. If new hooks are added in the future, the
-	 * struct grows and the future implementation can tell by the size
-	 * whether the application uses the new version or the old one.
+	 * compatibillity. If new hooks are added, the struct grows and the
+	 * implementation can tell by the size whether the application uses
+	 * the new version or an older one. @ref sqfs_data_writer_set_hooks
+	 * accepts any size that covers at least all hooks up to, but not
+	 * including @ref sqfs_block_hooks_t::trace_event. Hooks that lie
+	 * beyond the given size are treated as NULL.
 	 */
 	size_t size;
 
@@ -146,6 +211,153 @@ struct sqfs_block_hooks_t {
 	 * @param count The number of padding bytes in the block.
 	 */
 	void (*prepare_padding)(void *user, sqfs_u8 *block, size_t count);
+
+	/**
+	 * @brief Gets called for every event in the block pipeline.
+	 *
+	 * If this is not NULL, it receives a timeline of what happens to the
+	 * blocks, e.g. to find out where a slow build spends its time.
+	 *
+	 * Unlike the other hooks, this is called from all threads of the
+	 * data writer, but never concurrently. The function should return
+	 * quickly, because it holds up the thread that generated the event.
+	 *
+	 * @param user A user pointer.
+	 * @param event The @ref E_SQFS_TRACE_EVENT that happened.
+	 * @param thread The thread that generated the event. 0 for the
+	 *               thread that submits the data, 1 for the thread that
+	 *               writes the output and 2 and above for the compressor
+	 *               worker threads. Without worker threads, everything
+	 *               happens on thread 0.
+	 * @param timestamp A monotonic time stamp in nanoseconds.
+	 * @param arg An event specific argument.
+	 */
+	void (*trace_event)(void *user, int event, unsigned int thread,
+			    sqfs_u64 timestamp, sqfs_u64 arg);
+};
+
+/**
+ * @struct sqfs_data_writer_stats_t
+ *
+ * @brief Internal resource usage statistics of a data writer.
+ *
+ * This structure can be filled in by @ref sqfs_data_writer_get_stats.
+ */
+struct sqfs_data_writer_stats_t {
+	/**
+	 * @brief Set this to the size of the struct.
+	 *
+	 * Serves the same purpose as @ref sqfs_block_hooks_t::size. The
+	 * implementation of @ref sqfs_data_writer_get_stats rejects any
+	 * struct where this isn't the exact size.
+	 */
+	size_t size;
+
+	/**
+	 * @brief The largest number of block buffers that the data writer
+	 *        had allocated at the same time.
+	 *
+	 * Block buffers are recycled internally, so this is the high-water
+	 * mark of the block pool.
+	 */
+	size_t max_block_buffers;
+
+	/**
+	 * @brief The number of all-zero blocks that were stored as
+	 *        sparse blocks instead of being written to disk.
+	 */
+	size_t sparse_blocks;
+
+	/**
+	 * @brief The number of blocks that were stored uncompressed because
+	 *        the entropy check of @ref SQFS_BLK_ESTIMATE_ENTROPY judged
+	 *        them incompressible.
+	 */
+	size_t incompressible_blocks;
+
+	/**
+	 * @brief The number of data blocks that were written to disk,
+	 *        excluding blocks that were later removed by deduplication.
+	 */
+	size_t blocks_written;
+
+	/**
+	 * @brief The number of fragment blocks that were written to disk.
+	 */
+	size_t frag_blocks_written;
+
+	/**
+	 * @brief The number of data blocks that were removed again because
+	 *        deduplication found an identical sequence of blocks.
+	 */
+	size_t duplicate_blocks;
+
+	/**
+	 * @brief The number of tail end fragments stored in fragment blocks.
+	 */
+	size_t fragments_stored;
+
+	/**
+	 * @brief The number of tail end fragments that were dropped because
+	 *        an identical fragment was already stored.
+	 */
+	size_t fragments_discarded;
+
+	/**
+	 * @brief The number of data and fragment block bytes written to disk,
+	 *        excluding data removed by deduplication.
+	 */
+	sqfs_u64 bytes_written;
+
+	/**
+	 * @brief The largest amount of memory in bytes that was used for block
+	 *        buffers, the output buffer and the completion queue at the
+	 *        same time.
+	 */
+	size_t peak_memory;
+
+	/**
+	 * @brief The number of blocks, including fragment blocks, that
+	 *        went through the compression stage.
+	 */
+	size_t blocks_processed;
+
+	/**
+	 * @brief Total time in nanoseconds that submitting data was blocked,
+	 *        because too many blocks were in flight.
+	 *
+	 * This is the back pressure from the compression and write stages.
+	 */
+	sqfs_u64 wait_time;
+
+	/**
+	 * @brief Time in nanoseconds spent compressing blocks, summed up
+	 *        over all worker threads.
+	 */
+	sqfs_u64 compress_time;
+
+	/**
+	 * @brief The compression time in nanoseconds of the worker thread
+	 *        that was busy the longest.
+	 */
+	sqfs_u64 max_worker_time;
+
+	/**
+	 * @brief Time in nanoseconds that blocks spent waiting for a worker
+	 *        thread to pick them up, summed up over all blocks.
+	 */
+	sqfs_u64 queue_time;
+
+	/**
+	 * @brief Time in nanoseconds that compressed blocks spent waiting for
+	 *        the blocks before them to finish, summed up over all blocks.
+	 */
+	sqfs_u64 reorder_time;
+
+	/**
+	 * @brief Time in nanoseconds spent writing to the output file.
+	 */
+	sqfs_u64 write_time;
 };
 
 #ifdef __cplusplus
@@ -190,6 +402,35 @@ sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
  */
 SQFS_API void sqfs_data_writer_destroy(sqfs_data_writer_t *proc);
 
+/**
+ * @brief Register an alternative compressor for file data blocks.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * This allows using different compressor settings (e.g. a different
+ * compression level or filter) for individual files. The blocks of a file
+ * are compressed with the registered compressor if the index returned by
+ * this function is passed to @ref sqfs_data_writer_begin_file via the
+ * @ref SQFS_BLK_COMPRESSOR macro.
+ *
+ * The compressor must have the same compressor ID and block size as the
+ * default compressor and must not require options that differ from the
+ * ones stored in the image (e.g. a larger XZ dictionary). Like the default
+ * compressor, it must remain valid until the data writer is destroyed.
+ * Internally, a copy is created for every worker thread.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param cmp A pointer to the compressor to add.
+ *
+ * @return A positive compressor index on success, a negative
+ *         @ref E_SQFS_ERROR value on failure.
+ *         @ref SQFS_ERROR_OUT_OF_BOUNDS is returned if
+ *         @ref SQFS_MAX_DATA_COMPRESSORS compressors (including the
+ *         default one) have already been registered.
+ */
+SQFS_API int sqfs_data_writer_add_compressor(sqfs_data_writer_t *proc,
+					     sqfs_compressor_t *cmp);
+
 /**
  * @brief Start writing a file.
  *
@@ -237,6 +478,65 @@ SQFS_API int sqfs_data_writer_begin_file(sqfs_data_writer_t *proc,
 SQFS_API int sqfs_data_writer_append(sqfs_data_writer_t *proc,
 				     const void *data, size_t size);
 
+/**
+ * @brief Get direct access to the unused part of the current data block.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * This can be used instead of @ref sqfs_data_writer_append to read or
+ * decode data for the current file directly into the internal block
+ * buffer, avoiding an extra copy. After filling in the data, call
+ * @ref sqfs_data_writer_commit to tell the data writer how many bytes
+ * were actually written.
+ *
+ * The returned pointer is only valid until the next call to a function that
+ * modifies the data writer.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param ptr Returns a pointer to the free space in the current block.
+ * @param size Returns the number of bytes available at that location.
+ *             This is always at least one byte.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_reserve(sqfs_data_writer_t *proc, void **ptr,
+				      size_t *size);
+
+/**
+ * @brief Append data that was written to a reserved area.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * The counter part to @ref sqfs_data_writer_reserve. Once the current data
+ * block is full, it is handed off for processing and the next call to
+ * @ref sqfs_data_writer_reserve returns a new one.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param size The number of bytes written to the reserved area. Must not
+ *             exceed the size returned by @ref sqfs_data_writer_reserve.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_commit(sqfs_data_writer_t *proc, size_t size);
+
+/**
+ * @brief Append a range of zero bytes to the current file.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * This has the same effect as calling @ref sqfs_data_writer_append with a
+ * buffer full of zeros, but blocks that are entirely covered by the range are
+ * recorded as sparse blocks directly, without filling and scanning a buffer.
+ * This is intended for packing holes in sparse input files.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param size The number of zero bytes to append.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_append_sparse(sqfs_data_writer_t *proc,
+					    sqfs_u64 size);
+
 /**
  * @brief Stop writing the current file and flush everything that is
  *        buffered internally.
@@ -261,6 +561,10 @@ SQFS_API int sqfs_data_writer_end_file(sqfs_data_writer_t *proc);
  *
  * @memberof sqfs_data_writer_t
  *
+ * This also flushes the internal output buffer. Before this function has
+ * returned successfully, the output file may not contain all of the blocks
+ * reported as written through the hooks.
+ *
  * @param proc A pointer to a block processor object.
  *
  * @return Zero on success, an @ref E_SQFS_ERROR value on failure. The failure
@@ -294,7 +598,8 @@ int sqfs_data_writer_write_fragment_table(sqfs_data_writer_t *proc,
  *
  * @param proc A pointer to a data writer object.
  * @param user_ptr A user pointer to pass to the callbacks.
- * @param hooks A structure containing the hooks.
+ * @param hooks A structure containing the hooks. The structure is copied,
+ *              it does not have to outlive the call.
  *
  * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if the size field of
  *         the hooks doesn't match any size knwon to the library.
@@ -303,6 +608,80 @@ SQFS_API
 int sqfs_data_writer_set_hooks(sqfs_data_writer_t *proc, void *user_ptr,
 			       const sqfs_block_hooks_t *hooks);
 
+/**
+ * @brief Hold back the blocks of a file until it is known whether the file
+ *        is a duplicate.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * By default, the blocks of a file are written out as they are completed. If
+ * block deduplication finds that the entire file already exists, the output
+ * file is truncated again. With a deduplication buffer, the compressed blocks
+ * of a file are kept in memory until the last block has been processed, as
+ * long as they fit into the given budget, so duplicate files are never
+ * written at all. Files that exceed the budget are written out as usual.
+ *
+ * The block write hooks may append to the file themselves, so the held back
+ * data is flushed before calling them. If @ref sqfs_block_hooks_t has a
+ * pre_block_write or post_block_write hook set, files are never held back
+ * and the deduplication buffer has no effect.
+ *
+ * This must be called before adding the first file.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param size The maximum number of compressed bytes to hold back for a
+ *             single file. Zero disables the deduplication buffer.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_set_dedup_buffer(sqfs_data_writer_t *proc,
+					       size_t size);
+
+/**
+ * @brief Limit the amount of memory used for block buffers.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * The backlog passed to @ref sqfs_data_writer_create counts blocks, so the
+ * memory it takes up depends on the block size and number of workers. This
+ * function instead derives the backlog from a memory budget. The budget
+ * covers all block buffers in the work queues, in the completion queue,
+ * the fragment block, the per worker scratch buffers and the output
+ * buffer. The backlog passed to @ref sqfs_data_writer_create is replaced
+ * with the largest value that fits, which can be larger or smaller than
+ * the original one.
+ *
+ * This must be called before adding the first file and after
+ * @ref sqfs_data_writer_set_dedup_buffer.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param limit The memory budget in bytes.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_OUT_OF_BOUNDS if the budget is too
+ *         small to keep more than one block per worker in flight,
+ *         @ref SQFS_ERROR_ALLOC if resizing the internal completion queue
+ *         failed, @ref SQFS_ERROR_INTERNAL if blocks have already been
+ *         submitted.
+ */
+SQFS_API int sqfs_data_writer_set_memory_limit(sqfs_data_writer_t *proc,
+					       size_t limit);
+
+/**
+ * @brief Get internal resource usage statistics from a data writer.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * @param proc A pointer to a data writer object.
+ * @param stats A pointer to a structure to fill in. The size field must be
+ *              set by the caller.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if the size field of
+ *         the stats struct doesn't match any size knwon to the library.
+ */
+SQFS_API
+int sqfs_data_writer_get_stats(const sqfs_data_writer_t *proc,
+			       sqfs_data_writer_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -54,7 +54,24 @@ typedef enum {
 	 */
 	SQFS_FILE_OPEN_OVERWRITE = 0x02,
 
-	SQFS_FILE_OPEN_ALL_FLAGS = 0x03,
+	/**
+	 * @brief If the read only flag is also set, try to memory map the
+	 *        file.
+	 *
+	 * The data structures in libsquashfs then access the data of the
+	 * file in place, instead of reading it into a buffer first. If the
+	 * file cannot be mapped, or the operating system does not support
+	 * it, the flag is ignored and the file is accessed through regular
+	 * reads.
+	 *
+	 * @note If the underlying file is truncated by someone else while it
+	 *       is mapped, accessing the data beyond the new end of the file
+	 *       raises a SIGBUS signal, instead of reporting an I/O error
+	 *       like regular reads would.
+	 */
+	SQFS_FILE_OPEN_MMAP = 0x04,
+
+	SQFS_FILE_OPEN_ALL_FLAGS = 0x07,
 } E_SQFS_FILE_OPEN_FLAGS;
 
 /**
@@ -80,7 +80,9 @@ typedef struct sqfs_xattr_reader_t sqfs_xattr_reader_t;
 typedef struct sqfs_file_t sqfs_file_t;
 typedef struct sqfs_tree_node_t sqfs_tree_node_t;
 typedef struct sqfs_data_reader_t sqfs_data_reader_t;
+typedef struct sqfs_data_reader_stats_t sqfs_data_reader_stats_t;
 typedef struct sqfs_block_hooks_t sqfs_block_hooks_t;
+typedef struct sqfs_data_writer_stats_t sqfs_data_writer_stats_t;
 typedef struct sqfs_xattr_writer_t sqfs_xattr_writer_t;
 
 typedef struct sqfs_fragment_t sqfs_fragment_t;
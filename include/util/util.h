@@ -67,4 +67,10 @@ void *alloc_array(size_t item_size, size_t nmemb);
 */
 SQFS_INTERNAL int canonicalize_name(char *filename);
 
+/*
+  Returns a monotonic time stamp in nanoseconds, only useful for measuring
+  durations. Returns 0 if no suitable clock is available.
+ */
+SQFS_INTERNAL sqfs_u64 get_time_ns(void);
+
 #endif /* UTIL_H */
@@ -12,10 +12,9 @@
 #include <stdio.h>
 #include <errno.h>
 
-static int append_block(FILE *fp, const sqfs_block_t *blk)
+static int append_block(FILE *fp, const sqfs_u8 *ptr, size_t size)
 {
-	const unsigned char *ptr = blk->data;
-	size_t ret, size = blk->size;
+	size_t ret;
 
 	while (size > 0) {
 		if (ferror(fp)) {
@@ -40,9 +39,9 @@ int sqfs_data_reader_dump(const char *name, sqfs_data_reader_t *data,
 			  const sqfs_inode_generic_t *inode,
 			  FILE *fp, size_t block_size, bool allow_sparse)
 {
-	sqfs_block_t *blk;
+	const sqfs_u8 *ptr;
+	size_t i, diff, size;
 	sqfs_u64 filesz;
-	size_t i, diff;
 	int err;
 
 	sqfs_inode_get_file_size(inode, &filesz);
@@ -66,14 +65,15 @@ int sqfs_data_reader_dump(const char *name, sqfs_data_reader_t *data,
 			if (fseek(fp, diff, SEEK_CUR) < 0)
 				goto fail_sparse;
 		} else {
-			err = sqfs_data_reader_get_block(data, inode, i, &blk);
+			err = sqfs_data_reader_get_block_ref(data, inode, i,
+							     &ptr, &size);
 			if (err) {
 				sqfs_perror(name, "reading data block", err);
 				return -1;
 			}
 
-			err = append_block(fp, blk);
-			free(blk);
+			err = append_block(fp, ptr, size);
+			sqfs_data_reader_release_ref(data, ptr);
 
 			if (err)
 				return -1;
@@ -83,18 +83,18 @@ int sqfs_data_reader_dump(const char *name, sqfs_data_reader_t *data,
 	}
 
 	if (filesz > 0) {
-		err = sqfs_data_reader_get_fragment(data, inode, &blk);
+		err = sqfs_data_reader_get_fragment_ref(data, inode,
+							&ptr, &size);
 		if (err) {
 			sqfs_perror(name, "reading fragment block", err);
 			return -1;
 		}
 
-		if (append_block(fp, blk)) {
-			free(blk);
-			return -1;
-		}
+		err = append_block(fp, ptr, size);
+		sqfs_data_reader_release_ref(data, ptr);
 
-		free(blk);
+		if (err)
+			return -1;
 	}
 
 	return 0;
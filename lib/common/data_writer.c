@@ -6,7 +6,8 @@
  */
 #include "common.h"
 
-static sqfs_u8 buffer[4096];
+#include <unistd.h>
+#include <errno.h>
 
 int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
 			 sqfs_inode_generic_t *inode, sqfs_file_t *file,
@@ -14,6 +15,7 @@ int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
 {
 	sqfs_u64 filesz, offset;
 	size_t diff;
+	void *ptr;
 	int ret;
 
 	ret = sqfs_data_writer_begin_file(data, inode, flags);
@@ -25,19 +27,22 @@ int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
 	sqfs_inode_get_file_size(inode, &filesz);
 
 	for (offset = 0; offset < filesz; offset += diff) {
-		if (filesz - offset > sizeof(buffer)) {
-			diff = sizeof(buffer);
-		} else {
-			diff = filesz - offset;
+		ret = sqfs_data_writer_reserve(data, &ptr, &diff);
+		if (ret) {
+			sqfs_perror(filename, "packing file data", ret);
+			return -1;
 		}
 
-		ret = file->read_at(file, offset, buffer, diff);
+		if (filesz - offset < (sqfs_u64)diff)
+			diff = filesz - offset;
+
+		ret = file->read_at(file, offset, ptr, diff);
 		if (ret) {
 			sqfs_perror(filename, "reading file range", ret);
 			return -1;
 		}
 
-		ret = sqfs_data_writer_append(data, buffer, diff);
+		ret = sqfs_data_writer_commit(data, diff);
 		if (ret) {
 			sqfs_perror(filename, "packing file data", ret);
 			return -1;
@@ -52,3 +57,133 @@ int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
 
 	return 0;
 }
+
+/*
+  Read a range of the input file straight into the block buffer of the data
+  writer, one block at a time, without copying it through a bounce buffer.
+ */
+static int pack_data_range(const char *filename, sqfs_data_writer_t *data,
+			   int fd, sqfs_u64 offset, sqfs_u64 end)
+{
+	size_t diff, count;
+	ssize_t ret;
+	void *ptr;
+	int err;
+
+	while (offset < end) {
+		err = sqfs_data_writer_reserve(data, &ptr, &diff);
+		if (err) {
+			sqfs_perror(filename, "packing file data", err);
+			return -1;
+		}
+
+		if (end - offset < (sqfs_u64)diff)
+			diff = end - offset;
+
+		for (count = 0; count < diff; count += ret) {
+			ret = pread(fd, (char *)ptr + count, diff - count,
+				    offset + count);
+
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+
+			if (ret < 0) {
+				perror(filename);
+				return -1;
+			}
+
+			if (ret == 0) {
+				fprintf(stderr, "%s: unexpected end of file\n",
+					filename);
+				return -1;
+			}
+		}
+
+		err = sqfs_data_writer_commit(data, diff);
+		if (err) {
+			sqfs_perror(filename, "packing file data", err);
+			return -1;
+		}
+
+		offset += diff;
+	}
+
+	return 0;
+}
+
+static int pack_hole(const char *filename, sqfs_data_writer_t *data,
+		     sqfs_u64 size)
+{
+	int ret = sqfs_data_writer_append_sparse(data, size);
+
+	if (ret) {
+		sqfs_perror(filename, "packing sparse region", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+static sqfs_u64 find_extent(int fd, sqfs_u64 offset, sqfs_u64 filesz,
+			    bool data)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off_t ret = lseek(fd, offset, data ? SEEK_DATA : SEEK_HOLE);
+
+	if (ret >= 0)
+		return (sqfs_u64)ret < filesz ? (sqfs_u64)ret : filesz;
+
+	/* no more data after the offset */
+	if (data && errno == ENXIO)
+		return filesz;
+#else
+	(void)fd;
+#endif
+	/* not supported, treat everything as data */
+	return data ? offset : filesz;
+}
+
+int write_data_from_fd(const char *filename, sqfs_data_writer_t *data,
+		       sqfs_inode_generic_t *inode, int fd, int flags)
+{
+	sqfs_u64 filesz, offset = 0, next;
+	int ret;
+
+	ret = sqfs_data_writer_begin_file(data, inode, flags);
+	if (ret) {
+		sqfs_perror(filename, "beginning file data blocks", ret);
+		return -1;
+	}
+
+	sqfs_inode_get_file_size(inode, &filesz);
+
+	while (offset < filesz) {
+		next = find_extent(fd, offset, filesz, true);
+
+		if (next > offset) {
+			if (pack_hole(filename, data, next - offset))
+				return -1;
+			offset = next;
+			continue;
+		}
+
+		next = find_extent(fd, offset, filesz, false);
+		if (next <= offset)
+			next = filesz;
+
+		if (pack_data_range(filename, data, fd, offset, next))
+			return -1;
+
+		offset = next;
+	}
+
+	ret = sqfs_data_writer_end_file(data);
+	if (ret) {
+		sqfs_perror(filename, "finishing file data", ret);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * file_dedup.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define HASH_CHUNK_SIZE (128 * 1024)
+
+#define INIT_BUCKET_COUNT (128)
+
+static int read_chunk(const char *filename, int fd, sqfs_u64 offset,
+		      sqfs_u8 *buffer, size_t size)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = pread(fd, buffer, size, offset);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(filename);
+			return -1;
+		}
+
+		if (ret == 0) {
+			fprintf(stderr, "%s: file changed while packing\n",
+				filename);
+			return -1;
+		}
+
+		buffer += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+  A simple multiply and rotate hash over 64 bit words. It does not need to be
+  particularly strong, as files with matching hashes are compared anyway.
+ */
+static sqfs_u64 hash_update(sqfs_u64 hash, const sqfs_u8 *data, size_t size)
+{
+	sqfs_u64 word;
+
+	while (size >= sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		hash ^= word * 0x9E3779B97F4A7C15ULL;
+		hash = ((hash << 31) | (hash >> 33)) * 0xC2B2AE3D27D4EB4FULL;
+
+		data += sizeof(word);
+		size -= sizeof(word);
+	}
+
+	while (size--)
+		hash = (hash ^ *(data++)) * 0x100000001B3ULL;
+
+	return hash;
+}
+
+static int hash_file(const char *filename, int fd, sqfs_u64 size,
+		     sqfs_u8 *buffer, sqfs_u64 *out)
+{
+	sqfs_u64 offset, hash = size;
+	size_t diff;
+
+	for (offset = 0; offset < size; offset += diff) {
+		diff = HASH_CHUNK_SIZE;
+		if ((sqfs_u64)diff > size - offset)
+			diff = size - offset;
+
+		if (read_chunk(filename, fd, offset, buffer, diff))
+			return -1;
+
+		hash = hash_update(hash, buffer, diff);
+	}
+
+	*out = hash;
+	return 0;
+}
+
+/* returns 0 if the contents are equal, 1 if not, -1 on failure */
+static int compare_files(const char *filename, int fd, const char *other,
+			 sqfs_u64 size, sqfs_u8 *buffer)
+{
+	sqfs_u8 *temp = buffer + HASH_CHUNK_SIZE;
+	sqfs_u64 offset;
+	int ret = 0, ofd;
+	size_t diff;
+
+	ofd = open(other, O_RDONLY);
+	if (ofd < 0) {
+		perror(other);
+		return -1;
+	}
+
+	for (offset = 0; offset < size && ret == 0; offset += diff) {
+		diff = HASH_CHUNK_SIZE;
+		if ((sqfs_u64)diff > size - offset)
+			diff = size - offset;
+
+		if (read_chunk(filename, fd, offset, buffer, diff) ||
+		    read_chunk(other, ofd, offset, temp, diff)) {
+			ret = -1;
+			break;
+		}
+
+		if (memcmp(buffer, temp, diff) != 0)
+			ret = 1;
+	}
+
+	close(ofd);
+	return ret;
+}
+
+static int grow_table(file_dedup_t *dedup)
+{
+	file_hash_t **buckets, *it;
+	size_t i, count, idx;
+
+	if (dedup->num_files < dedup->num_buckets)
+		return 0;
+
+	count = dedup->num_buckets ? dedup->num_buckets * 2 :
+		INIT_BUCKET_COUNT;
+
+	buckets = alloc_array(sizeof(buckets[0]), count);
+	if (buckets == NULL) {
+		perror("growing file hash table");
+		return -1;
+	}
+
+	memset(buckets, 0, sizeof(buckets[0]) * count);
+
+	for (i = 0; i < dedup->num_buckets; ++i) {
+		while (dedup->buckets[i] != NULL) {
+			it = dedup->buckets[i];
+			dedup->buckets[i] = it->next;
+
+			idx = it->hash % count;
+			it->next = buckets[idx];
+			buckets[idx] = it;
+		}
+	}
+
+	free(dedup->buckets);
+	dedup->buckets = buckets;
+	dedup->num_buckets = count;
+	return 0;
+}
+
+static file_hash_t *create_entry(const char *filename, sqfs_u64 size,
+				 sqfs_u64 hash, int flags,
+				 sqfs_inode_generic_t *inode)
+{
+	file_hash_t *ent = calloc(1, sizeof(*ent));
+
+	if (ent == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	ent->filename = filename;
+	ent->size = size;
+	ent->hash = hash;
+	ent->flags = flags;
+	ent->inode = inode;
+	return ent;
+}
+
+int file_dedup_check(sqfs_writer_t *sqfs, const char *filename, int fd,
+		     sqfs_u64 size, int flags, sqfs_inode_generic_t *inode)
+{
+	file_dedup_t *dedup = &sqfs->dedup;
+	file_hash_t *it, *ent;
+	sqfs_u8 *buffer;
+	sqfs_u64 hash;
+	int ret = -1;
+	size_t idx;
+
+	if (size == 0)
+		return 0;
+
+	buffer = malloc(2 * HASH_CHUNK_SIZE);
+	if (buffer == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	if (hash_file(filename, fd, size, buffer, &hash))
+		goto out;
+
+	if (dedup->num_buckets > 0) {
+		idx = hash % dedup->num_buckets;
+
+		for (it = dedup->buckets[idx]; it != NULL; it = it->next) {
+			if (it->size != size || it->hash != hash ||
+			    it->flags != flags) {
+				continue;
+			}
+
+			ret = compare_files(filename, fd, it->filename,
+					    size, buffer);
+			if (ret < 0)
+				goto out;
+			if (ret == 0)
+				break;
+		}
+
+		if (it != NULL) {
+			ent = create_entry(filename, size, hash, flags,
+					   inode);
+			if (ent == NULL) {
+				ret = -1;
+				goto out;
+			}
+
+			ent->orig = it->inode;
+			ent->next = dedup->duplicates;
+			dedup->duplicates = ent;
+
+			sqfs->stats.duplicate_files += 1;
+			ret = 1;
+			goto out;
+		}
+	}
+
+	ret = -1;
+	if (grow_table(dedup))
+		goto out;
+
+	ent = create_entry(filename, size, hash, flags, inode);
+	if (ent == NULL)
+		goto out;
+
+	idx = hash % dedup->num_buckets;
+	ent->next = dedup->buckets[idx];
+	dedup->buckets[idx] = ent;
+	dedup->num_files += 1;
+	ret = 0;
+out:
+	free(buffer);
+	return ret;
+}
+
+void file_dedup_resolve(sqfs_writer_t *sqfs)
+{
+	sqfs_inode_generic_t *inode;
+	file_hash_t *it;
+	size_t size;
+
+	for (it = sqfs->dedup.duplicates; it != NULL; it = it->next) {
+		inode = it->inode;
+
+		size = sizeof(*inode) +
+			it->orig->num_file_blocks * sizeof(sqfs_u32);
+
+		memcpy(inode, it->orig, size);
+		inode->block_sizes = (sqfs_u32 *)inode->extra;
+	}
+}
+
+static void free_list(file_hash_t *list)
+{
+	file_hash_t *it;
+
+	while (list != NULL) {
+		it = list;
+		list = list->next;
+		free(it);
+	}
+}
+
+void file_dedup_cleanup(sqfs_writer_t *sqfs)
+{
+	size_t i;
+
+	for (i = 0; i < sqfs->dedup.num_buckets; ++i)
+		free_list(sqfs->dedup.buckets[i]);
+
+	free_list(sqfs->dedup.duplicates);
+	free(sqfs->dedup.buckets);
+	memset(&sqfs->dedup, 0, sizeof(sqfs->dedup));
+}
@@ -0,0 +1,216 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * file_policy.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <fnmatch.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+static const struct {
+	const char *name;
+	int flag;
+} policy_flags[] = {
+	{ "dont-compress", SQFS_BLK_DONT_COMPRESS },
+	{ "dont-fragment", SQFS_BLK_DONT_FRAGMENT },
+	{ "align", SQFS_BLK_ALIGN },
+	{ "skip-incompressible", SQFS_BLK_ESTIMATE_ENTROPY },
+};
+
+static int find_flag(const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(policy_flags) / sizeof(policy_flags[0]); ++i) {
+		if (strlen(policy_flags[i].name) == len &&
+		    strncmp(policy_flags[i].name, name, len) == 0) {
+			return policy_flags[i].flag;
+		}
+	}
+
+	return 0;
+}
+
+int file_policy_add(file_policy_t **list, const char *pattern,
+		    const char *options)
+{
+	size_t plen = strlen(pattern), olen = strlen(options), len;
+	file_policy_t *policy, **it;
+	char *extra;
+	int flag;
+
+	if (plen == 0) {
+		fputs("file policy: empty pattern\n", stderr);
+		return -1;
+	}
+
+	policy = calloc(1, sizeof(*policy) + plen + 1 + olen + 1);
+	if (policy == NULL) {
+		perror("file policy");
+		return -1;
+	}
+
+	memcpy(policy->pattern, pattern, plen);
+	extra = policy->pattern + plen + 1;
+
+	while (*options != '\0') {
+		for (len = 0; options[len] != '\0' && options[len] != ','; ++len)
+			;
+
+		flag = find_flag(options, len);
+
+		if (flag != 0) {
+			policy->blk_flags |= flag;
+		} else if (len > 0) {
+			if (extra[0] != '\0')
+				strcat(extra, ",");
+			strncat(extra, options, len);
+		}
+
+		options += len;
+		if (*options == ',')
+			++options;
+	}
+
+	if (extra[0] != '\0')
+		policy->comp_extra = extra;
+
+	for (it = list; *it != NULL; it = &(*it)->next)
+		;
+
+	*it = policy;
+	return 0;
+}
+
+int file_policy_add_rule(file_policy_t **list, const char *rule)
+{
+	const char *sep = strrchr(rule, ':');
+	char *pattern;
+	int ret;
+
+	if (sep == NULL) {
+		fprintf(stderr, "%s: expected <pattern>:<options>\n", rule);
+		return -1;
+	}
+
+	pattern = strndup(rule, sep - rule);
+	if (pattern == NULL) {
+		perror(rule);
+		return -1;
+	}
+
+	ret = file_policy_add(list, pattern, sep + 1);
+	free(pattern);
+	return ret;
+}
+
+void file_policy_free(file_policy_t *list)
+{
+	file_policy_t *it;
+
+	while (list != NULL) {
+		it = list;
+		list = list->next;
+
+		if (it->cmp != NULL)
+			it->cmp->destroy(it->cmp);
+
+		free(it);
+	}
+}
+
+static bool policy_matches(const file_policy_t *policy, const char *path)
+{
+	const char *name;
+
+	while (*path == '/')
+		++path;
+
+	if (strchr(policy->pattern, '/') != NULL)
+		return fnmatch(policy->pattern, path, 0) == 0;
+
+	name = strrchr(path, '/');
+	name = (name == NULL) ? path : (name + 1);
+
+	return fnmatch(policy->pattern, name, 0) == 0;
+}
+
+static int create_policy_compressor(sqfs_writer_t *sqfs,
+				    const sqfs_writer_cfg_t *cfg,
+				    file_policy_t *policy)
+{
+	sqfs_compressor_config_t cmpcfg;
+	char *extra;
+	int ret;
+
+	extra = strdup(policy->comp_extra);
+	if (extra == NULL) {
+		perror(policy->pattern);
+		return -1;
+	}
+
+	ret = compressor_cfg_init_options(&cmpcfg, cfg->comp_id,
+					  cfg->block_size, extra);
+	free(extra);
+
+	if (ret)
+		return -1;
+
+	/* settings stored in the super block must be the same for all */
+	switch (cmpcfg.id) {
+	case SQFS_COMP_XZ:
+		cmpcfg.opt.xz.dict_size = sqfs->cmp_cfg.opt.xz.dict_size;
+		break;
+	case SQFS_COMP_GZIP:
+		cmpcfg.opt.gzip.window_size =
+			sqfs->cmp_cfg.opt.gzip.window_size;
+		break;
+	default:
+		break;
+	}
+
+	policy->cmp = sqfs_compressor_create(&cmpcfg);
+	if (policy->cmp == NULL) {
+		fprintf(stderr, "%s: error creating compressor\n",
+			policy->pattern);
+		return -1;
+	}
+
+	ret = sqfs_data_writer_add_compressor(sqfs->data, policy->cmp);
+	if (ret < 0) {
+		sqfs_perror(policy->pattern, "adding file policy compressor",
+			    ret);
+		return -1;
+	}
+
+	policy->blk_flags |= SQFS_BLK_COMPRESSOR(ret);
+	return 0;
+}
+
+int sqfs_writer_file_flags(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg,
+			   const char *path, int *flags)
+{
+	file_policy_t *it;
+
+	*flags = cfg->skip_incompressible ? SQFS_BLK_ESTIMATE_ENTROPY : 0;
+
+	for (it = sqfs->policy; it != NULL; it = it->next) {
+		if (policy_matches(it, path))
+			break;
+	}
+
+	if (it == NULL)
+		return 0;
+
+	if (it->comp_extra != NULL && it->cmp == NULL) {
+		if (create_policy_compressor(sqfs, cfg, it))
+			return -1;
+	}
+
+	*flags |= it->blk_flags;
+	return 0;
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * parse_size.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <errno.h>
+
+int parse_size(const char *what, size_t *out, const char *str,
+	       size_t min, size_t max)
+{
+	unsigned long long value;
+	char *end;
+
+	/* strtoull happily accepts a sign and negates the result */
+	if (!isdigit((unsigned char)str[0]))
+		goto fail;
+
+	errno = 0;
+	value = strtoull(str, &end, 0);
+
+	if (errno != 0 || *end != '\0')
+		goto fail;
+
+	if (value < min || value > max)
+		goto fail;
+
+	*out = value;
+	return 0;
+fail:
+	if (min == 0 && max == SIZE_MAX) {
+		fprintf(stderr, "%s must be an unsigned number.\n", what);
+	} else if (max == SIZE_MAX) {
+		fprintf(stderr, "%s must be a number of at least %zu.\n",
+			what, min);
+	} else {
+		fprintf(stderr, "%s must be a number between %zu and %zu.\n",
+			what, min, max);
+	}
+	return -1;
+}
@@ -6,62 +6,73 @@
  */
 #include "common.h"
 
+#include <string.h>
 #include <stdio.h>
 
-static void post_block_write(void *user, const sqfs_block_t *block,
-			     sqfs_file_t *file)
+void collect_writer_stats(sqfs_data_writer_t *data,
+			  data_writer_stats_t *stats)
 {
-	data_writer_stats_t *stats = user;
-	(void)file;
-
-	if (block->size == 0)
-		return;
-
-	if (block->flags & SQFS_BLK_FRAGMENT_BLOCK) {
-		stats->frag_blocks_written += 1;
-	} else {
-		stats->blocks_written += 1;
+	sqfs_data_writer_stats_t wrstats;
+
+	memset(&wrstats, 0, sizeof(wrstats));
+	wrstats.size = sizeof(wrstats);
+
+	if (sqfs_data_writer_get_stats(data, &wrstats) == 0) {
+		stats->max_block_buffers = wrstats.max_block_buffers;
+		stats->sparse_blocks = wrstats.sparse_blocks;
+		stats->incompressible_blocks = wrstats.incompressible_blocks;
+		stats->blocks_written = wrstats.blocks_written;
+		stats->frag_blocks_written = wrstats.frag_blocks_written;
+		stats->duplicate_blocks = wrstats.duplicate_blocks;
+		stats->frag_count = wrstats.fragments_stored;
+		stats->frag_dup = wrstats.fragments_discarded;
+		stats->bytes_written = wrstats.bytes_written;
+		stats->peak_memory = wrstats.peak_memory;
+		stats->blocks_processed = wrstats.blocks_processed;
+		stats->wait_time = wrstats.wait_time;
+		stats->compress_time = wrstats.compress_time;
+		stats->max_worker_time = wrstats.max_worker_time;
+		stats->queue_time = wrstats.queue_time;
+		stats->reorder_time = wrstats.reorder_time;
+		stats->write_time = wrstats.write_time;
 	}
 
-	stats->bytes_written += block->size;
-}
-
-static void pre_fragment_store(void *user, sqfs_block_t *block)
-{
-	data_writer_stats_t *stats = user;
-	(void)block;
-
-	stats->frag_count += 1;
+	stats->pack_time = get_time_ns() - stats->start_time;
 }
 
-static void notify_blocks_erased(void *user, size_t count, sqfs_u64 bytes)
+static double to_seconds(sqfs_u64 ns)
 {
-	data_writer_stats_t *stats = user;
-
-	stats->bytes_written -= bytes;
-	stats->blocks_written -= count;
-	stats->duplicate_blocks += count;
+	return (double)ns / 1000000000.0;
 }
 
-static void notify_fragment_discard(void *user, const sqfs_block_t *block)
+static double average_ms(sqfs_u64 ns, size_t count)
 {
-	data_writer_stats_t *stats = user;
-	(void)block;
-
-	stats->frag_dup += 1;
+	return count > 0 ? ((double)ns / count) / 1000000.0 : 0.0;
 }
 
-static const sqfs_block_hooks_t hooks = {
-	.size = sizeof(hooks),
-	.post_block_write = post_block_write,
-	.pre_fragment_store = pre_fragment_store,
-	.notify_blocks_erased = notify_blocks_erased,
-	.notify_fragment_discard = notify_fragment_discard,
-};
-
-void register_stat_hooks(sqfs_data_writer_t *data, data_writer_stats_t *stats)
+static void print_timing(const data_writer_stats_t *stats)
 {
-	sqfs_data_writer_set_hooks(data, stats, &hooks);
+	sqfs_u64 input_time = 0;
+
+	if (stats->pack_time > stats->wait_time)
+		input_time = stats->pack_time - stats->wait_time;
+
+	printf("Time spent packing data: %.3f s\n",
+	       to_seconds(stats->pack_time));
+	printf("    Reading input and submitting blocks: %.3f s\n",
+	       to_seconds(input_time));
+	printf("    Waiting for blocks in flight: %.3f s\n",
+	       to_seconds(stats->wait_time));
+	printf("Compression time, all workers: %.3f s\n",
+	       to_seconds(stats->compress_time));
+	printf("Compression time, busiest worker: %.3f s\n",
+	       to_seconds(stats->max_worker_time));
+	printf("Average time waiting for a worker: %.3f ms\n",
+	       average_ms(stats->queue_time, stats->blocks_processed));
+	printf("Average time waiting for previous blocks: %.3f ms\n",
+	       average_ms(stats->reorder_time, stats->blocks_processed));
+	printf("Time spent writing output: %.3f s\n",
+	       to_seconds(stats->write_time));
 }
 
 void sqfs_print_statistics(sqfs_super_t *super, data_writer_stats_t *stats)
@@ -79,10 +90,18 @@ void sqfs_print_statistics(sqfs_super_t *super, data_writer_stats_t *stats)
 	printf("Data blocks actually written: %zu\n", stats->blocks_written);
 	printf("Fragment blocks written: %zu\n", stats->frag_blocks_written);
 	printf("Duplicate data blocks omitted: %zu\n", stats->duplicate_blocks);
+	printf("Duplicate files omitted: %zu\n", stats->duplicate_files);
 	printf("Sparse blocks omitted: %zu\n", stats->sparse_blocks);
+	printf("Incompressible blocks stored uncompressed: %zu\n",
+	       stats->incompressible_blocks);
 	printf("Fragments actually written: %zu\n", stats->frag_count);
 	printf("Duplicated fragments omitted: %zu\n", stats->frag_dup);
 	printf("Total number of inodes: %u\n", super->inode_count);
 	printf("Number of unique group/user IDs: %u\n", super->id_count);
 	printf("Data compression ratio: %zu%%\n", ratio);
+	printf("Peak number of block buffers: %zu\n",
+	       stats->max_block_buffers);
+	printf("Peak data block memory: %zu KiB\n",
+	       stats->peak_memory / 1024);
+	print_timing(stats);
 }
@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * trace.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <stdio.h>
+
+static const struct {
+	const char *name;
+	const char *phase;
+	const char *arg;
+} trace_events[] = {
+	[SQFS_TRACE_ENQUEUE] = { "enqueue", "i", "block" },
+	[SQFS_TRACE_COMPRESS_BEGIN] = { "compress", "B", "block" },
+	[SQFS_TRACE_COMPRESS_END] = { "compress", "E", "block" },
+	[SQFS_TRACE_DEQUEUE] = { "dequeue", "i", "block" },
+	[SQFS_TRACE_WRITE_BEGIN] = { "write", "B", "bytes" },
+	[SQFS_TRACE_WRITE_END] = { "write", "E", "bytes" },
+	[SQFS_TRACE_WAIT_BEGIN] = { "wait", "B", "in_flight" },
+	[SQFS_TRACE_WAIT_END] = { "wait", "E", "in_flight" },
+};
+
+static void write_thread_name(trace_writer_t *trace, unsigned int tid,
+			      const char *name)
+{
+	fprintf(trace->fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+		"\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+		trace->count++ > 0 ? ",\n" : "", tid, name);
+}
+
+static void trace_event(void *user, int event, unsigned int thread,
+			sqfs_u64 timestamp, sqfs_u64 arg)
+{
+	trace_writer_t *trace = user;
+	sqfs_u64 ts;
+
+	if (trace->fp == NULL || event < 0 ||
+	    (size_t)event >= sizeof(trace_events) / sizeof(trace_events[0])) {
+		return;
+	}
+
+	ts = timestamp > trace->start ? timestamp - trace->start : 0;
+
+	fprintf(trace->fp, "%s{\"name\":\"%s\",\"ph\":\"%s\",%s"
+		"\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u,"
+		"\"args\":{\"%s\":%llu}}",
+		trace->count++ > 0 ? ",\n" : "",
+		trace_events[event].name, trace_events[event].phase,
+		trace_events[event].phase[0] == 'i' ? "\"s\":\"t\"," : "",
+		(unsigned long long)(ts / 1000), (unsigned int)(ts % 1000),
+		thread, trace_events[event].arg, (unsigned long long)arg);
+}
+
+static const sqfs_block_hooks_t trace_hooks = {
+	.size = sizeof(sqfs_block_hooks_t),
+	.trace_event = trace_event,
+};
+
+int trace_writer_init(trace_writer_t *trace, const char *filename,
+		      sqfs_data_writer_t *data, unsigned int num_jobs)
+{
+	char name[32];
+	unsigned int i;
+	int ret;
+
+	trace->filename = filename;
+	trace->count = 0;
+	trace->fp = fopen(filename, "w");
+
+	if (trace->fp == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	fputs("{\"traceEvents\":[\n", trace->fp);
+	write_thread_name(trace, 0, "main");
+	write_thread_name(trace, 1, "writer");
+
+	for (i = 0; i < num_jobs; ++i) {
+		snprintf(name, sizeof(name), "worker %u", i);
+		write_thread_name(trace, 2 + i, name);
+	}
+
+	trace->start = get_time_ns();
+
+	ret = sqfs_data_writer_set_hooks(data, trace, &trace_hooks);
+	if (ret) {
+		sqfs_perror(filename, "registering trace hooks", ret);
+		fclose(trace->fp);
+		trace->fp = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int trace_writer_finish(trace_writer_t *trace)
+{
+	FILE *fp = trace->fp;
+	int ret = 0;
+
+	if (fp == NULL)
+		return 0;
+
+	trace->fp = NULL;
+	fputs("\n],\"displayTimeUnit\":\"ms\"}\n", fp);
+
+	if (ferror(fp)) {
+		fprintf(stderr, "%s: error writing trace\n", trace->filename);
+		ret = -1;
+	}
+
+	if (fclose(fp) != 0) {
+		perror(trace->filename);
+		ret = -1;
+	}
+
+	return ret;
+}
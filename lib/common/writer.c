@@ -85,6 +85,7 @@ int sqfs_writer_init(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *wrcfg)
 	if (fstree_init(&sqfs->fs, wrcfg->fs_defaults))
 		goto fail_file;
 
+	sqfs->cmp_cfg = cfg;
 	sqfs->cmp = sqfs_compressor_create(&cfg);
 	if (sqfs->cmp == NULL) {
 		fputs("Error creating compressor\n", stderr);
@@ -123,8 +124,39 @@ int sqfs_writer_init(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *wrcfg)
 		goto fail_cmp;
 	}
 
+	memset(&sqfs->trace, 0, sizeof(sqfs->trace));
+
+	if (wrcfg->dedup_buffer > 0) {
+		ret = sqfs_data_writer_set_dedup_buffer(sqfs->data,
+							wrcfg->dedup_buffer);
+		if (ret) {
+			sqfs_perror(wrcfg->filename,
+				    "allocating deduplication buffer", ret);
+			goto fail_data;
+		}
+	}
+
+	if (wrcfg->memory_limit > 0) {
+		ret = sqfs_data_writer_set_memory_limit(sqfs->data,
+							wrcfg->memory_limit);
+		if (ret) {
+			sqfs_perror(wrcfg->filename,
+				    "memory limit too small for block size "
+				    "and number of jobs", ret);
+			goto fail_data;
+		}
+	}
+
+	if (wrcfg->trace_file != NULL) {
+		if (trace_writer_init(&sqfs->trace, wrcfg->trace_file,
+				      sqfs->data, wrcfg->num_jobs)) {
+			goto fail_data;
+		}
+	}
+
 	memset(&sqfs->stats, 0, sizeof(sqfs->stats));
-	register_stat_hooks(sqfs->data, &sqfs->stats);
+	memset(&sqfs->dedup, 0, sizeof(sqfs->dedup));
+	sqfs->stats.start_time = get_time_ns();
 
 	sqfs->idtbl = sqfs_id_table_create();
 	if (sqfs->idtbl == NULL) {
@@ -143,6 +175,7 @@ int sqfs_writer_init(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *wrcfg)
 		}
 	}
 
+	sqfs->policy = wrcfg->policy;
 	return 0;
 fail:
 	if (sqfs->xwr != NULL)
@@ -150,6 +183,7 @@ fail:
 	sqfs_id_table_destroy(sqfs->idtbl);
 fail_data:
 	sqfs_data_writer_destroy(sqfs->data);
+	trace_writer_finish(&sqfs->trace);
 fail_cmp:
 	sqfs->cmp->destroy(sqfs->cmp);
 fail_fs:
@@ -172,6 +206,12 @@ int sqfs_writer_finish(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg)
 		return -1;
 	}
 
+	file_dedup_resolve(sqfs);
+	collect_writer_stats(sqfs->data, &sqfs->stats);
+
+	if (trace_writer_finish(&sqfs->trace))
+		return -1;
+
 	if (!cfg->quiet)
 		fputs("Writing inodes and directories...\n", stdout);
 
@@ -252,6 +292,9 @@ void sqfs_writer_cleanup(sqfs_writer_t *sqfs)
 		sqfs_xattr_writer_destroy(sqfs->xwr);
 	sqfs_id_table_destroy(sqfs->idtbl);
 	sqfs_data_writer_destroy(sqfs->data);
+	trace_writer_finish(&sqfs->trace);
+	file_policy_free(sqfs->policy);
+	file_dedup_cleanup(sqfs);
 	sqfs->cmp->destroy(sqfs->cmp);
 	fstree_cleanup(&sqfs->fs);
 	sqfs->outfile->destroy(sqfs->outfile);
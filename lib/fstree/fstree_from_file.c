@@ -103,7 +103,8 @@ static void trim_line(char *line)
 }
 
 static int handle_line(fstree_t *fs, const char *filename,
-		       size_t line_num, char *line)
+		       size_t line_num, char *line,
+		       fstree_policy_cb_t policy_cb, void *user)
 {
 	const char *extra = NULL, *msg = NULL;
 	char keyword[16], *path, *ptr;
@@ -162,6 +163,18 @@ static int handle_line(fstree_t *fs, const char *filename,
 	while (isspace(line[i]))
 		++i;
 
+	if (strcmp(keyword, "policy") == 0 && policy_cb != NULL) {
+		if (*path == '\0' || line[i] == '\0')
+			goto fail_policy;
+
+		if (policy_cb(user, path, line + i)) {
+			fprintf(stderr, "%s: " PRI_SZ ": invalid file policy.\n",
+				filename, line_num);
+			return -1;
+		}
+		return 0;
+	}
+
 	if (canonicalize_name(path) || *path == '\0')
 		goto fail_ent;
 
@@ -247,6 +260,10 @@ fail_no_extra:
 	fprintf(stderr, "%s: " PRI_SZ ": missing argument for %s.\n",
 		filename, line_num, keyword);
 	return -1;
+fail_policy:
+	fprintf(stderr, "%s: " PRI_SZ ": expected: policy <pattern> "
+		"<options>\n", filename, line_num);
+	return -1;
 fail_uid_gid:
 	msg = "uid & gid must be decimal numbers";
 	goto out_desc;
@@ -266,7 +283,8 @@ out_desc:
 	return -1;
 }
 
-int fstree_from_file(fstree_t *fs, const char *filename, FILE *fp)
+int fstree_from_file(fstree_t *fs, const char *filename, FILE *fp,
+		     fstree_policy_cb_t policy_cb, void *user)
 {
 	size_t n, line_num = 0;
 	ssize_t ret;
@@ -297,8 +315,10 @@ int fstree_from_file(fstree_t *fs, const char *filename, FILE *fp)
 			continue;
 		}
 
-		if (handle_line(fs, filename, line_num, line))
+		if (handle_line(fs, filename, line_num, line,
+				policy_cb, user)) {
 			goto fail_line;
+		}
 
 		free(line);
 	}
@@ -0,0 +1,1043 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * common.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+int data_reader_unpack_block(sqfs_compressor_t *cmp, const sqfs_u8 *raw,
+			     sqfs_u32 size, sqfs_block_t *blk)
+{
+	sqfs_s32 ret;
+
+	ret = cmp->do_block(cmp, raw, size, blk->data, blk->size);
+	if (ret <= 0)
+		return ret < 0 ? ret : SQFS_ERROR_OVERFLOW;
+
+	/* cached block buffers are recycled, don't leak stale data */
+	memset(blk->data + ret, 0, blk->size - ret);
+	return 0;
+}
+
+int data_reader_read_block(sqfs_data_reader_t *data, sqfs_u64 off,
+			   sqfs_u32 size, sqfs_block_t *blk)
+{
+	const sqfs_u8 *raw = NULL;
+	sqfs_u32 on_disk_size;
+	int err;
+
+	if (SQFS_IS_SPARSE_BLOCK(size)) {
+		memset(blk->data, 0, blk->size);
+		return 0;
+	}
+
+	on_disk_size = SQFS_ON_DISK_BLOCK_SIZE(size);
+
+	if (on_disk_size > blk->size)
+		return SQFS_ERROR_OVERFLOW;
+
+	if (SQFS_IS_BLOCK_COMPRESSED(size)) {
+		raw = sqfs_file_get_pointer(data->file, off, on_disk_size);
+
+		if (raw == NULL) {
+			err = data->file->read_at(data->file, off,
+						  data->scratch, on_disk_size);
+			if (err)
+				return err;
+
+			raw = data->scratch;
+		}
+
+		return data_reader_unpack_block(data->cmp, raw,
+						on_disk_size, blk);
+	}
+
+	err = data->file->read_at(data->file, off, blk->data, on_disk_size);
+	if (err)
+		return err;
+
+	memset(blk->data + on_disk_size, 0, blk->size - on_disk_size);
+	return 0;
+}
+
+static int get_block(sqfs_data_reader_t *data, sqfs_u64 off, sqfs_u32 size,
+		     size_t unpacked_size, sqfs_block_t **out)
+{
+	sqfs_block_t *blk = alloc_flex(sizeof(*blk), 1, unpacked_size);
+	int err;
+
+	if (blk == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	blk->size = unpacked_size;
+
+	err = data_reader_read_block(data, off, size, blk);
+	if (err) {
+		free(blk);
+		return err;
+	}
+
+	*out = blk;
+	return 0;
+}
+
+static void cache_lock(data_reader_shared_t *shared)
+{
+#ifdef WITH_PTHREAD
+	pthread_mutex_lock(&shared->mtx);
+#else
+	(void)shared;
+#endif
+}
+
+static void cache_unlock(data_reader_shared_t *shared)
+{
+#ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&shared->mtx);
+#else
+	(void)shared;
+#endif
+}
+
+static size_t cache_hash(const data_reader_shared_t *shared,
+			 sqfs_u64 location)
+{
+	location *= 0x9E3779B97F4A7C15ULL;
+
+	return (location >> 32) & (shared->num_buckets - 1);
+}
+
+static void lru_unlink(data_reader_shared_t *shared, cache_entry_t *ent)
+{
+	if (ent->prev == NULL) {
+		shared->lru_first = ent->next;
+	} else {
+		ent->prev->next = ent->next;
+	}
+
+	if (ent->next == NULL) {
+		shared->lru_last = ent->prev;
+	} else {
+		ent->next->prev = ent->prev;
+	}
+
+	ent->prev = ent->next = NULL;
+}
+
+static void lru_push_front(data_reader_shared_t *shared, cache_entry_t *ent)
+{
+	ent->prev = NULL;
+	ent->next = shared->lru_first;
+
+	if (shared->lru_first == NULL) {
+		shared->lru_last = ent;
+	} else {
+		shared->lru_first->prev = ent;
+	}
+
+	shared->lru_first = ent;
+}
+
+static void hash_remove(data_reader_shared_t *shared, cache_entry_t *ent)
+{
+	cache_entry_t **it;
+
+	it = shared->buckets + cache_hash(shared, ent->location);
+
+	while (*it != ent)
+		it = &(*it)->hash_next;
+
+	*it = ent->hash_next;
+	ent->hash_next = NULL;
+}
+
+static void hash_insert(data_reader_shared_t *shared, cache_entry_t *ent)
+{
+	size_t idx = cache_hash(shared, ent->location);
+
+	ent->hash_next = shared->buckets[idx];
+	shared->buckets[idx] = ent;
+}
+
+static void free_entry(cache_entry_t *ent)
+{
+	free(ent->block);
+	free(ent);
+}
+
+static void cache_evict(data_reader_shared_t *shared, cache_entry_t *ent)
+{
+	lru_unlink(shared, ent);
+	hash_remove(shared, ent);
+	free_entry(ent);
+	shared->cache_count -= 1;
+}
+
+/* the least recently used entry that is not referenced by anyone */
+static cache_entry_t *lru_victim(data_reader_shared_t *shared)
+{
+	cache_entry_t *ent = shared->lru_last;
+
+	while (ent != NULL && ent->refcount > 0)
+		ent = ent->prev;
+
+	return ent;
+}
+
+/* drop entries the cache was allowed to grow by while they were referenced */
+static void cache_trim(data_reader_shared_t *shared)
+{
+	cache_entry_t *ent;
+
+	while (shared->cache_count > shared->cache_max) {
+		ent = lru_victim(shared);
+		if (ent == NULL)
+			break;
+
+		cache_evict(shared, ent);
+	}
+}
+
+static cache_entry_t *cache_find(data_reader_shared_t *shared,
+				 sqfs_u64 location)
+{
+	cache_entry_t *ent = shared->buckets[cache_hash(shared, location)];
+
+	while (ent != NULL && ent->location != location)
+		ent = ent->hash_next;
+
+	if (ent != NULL) {
+		lru_unlink(shared, ent);
+		lru_push_front(shared, ent);
+	}
+
+	return ent;
+}
+
+/*
+  Get an unlinked entry for a new block, recycling the least recently used
+  one if the cache is full. If all entries are referenced, the cache grows.
+ */
+static cache_entry_t *cache_new_entry(data_reader_shared_t *shared)
+{
+	cache_entry_t *ent = NULL;
+
+	if (shared->cache_count >= shared->cache_max)
+		ent = lru_victim(shared);
+
+	if (ent != NULL) {
+		lru_unlink(shared, ent);
+		hash_remove(shared, ent);
+		return ent;
+	}
+
+	ent = calloc(1, sizeof(*ent));
+	if (ent == NULL)
+		return NULL;
+
+	shared->cache_count += 1;
+	return ent;
+}
+
+static void cache_ref(data_reader_shared_t *shared, cache_entry_t *ent)
+{
+	if (ent->refcount++ == 0) {
+		ent->pin_next = shared->pinned;
+		shared->pinned = ent;
+	}
+}
+
+static void cache_unref(data_reader_shared_t *shared, cache_entry_t *ent)
+{
+	cache_entry_t **it;
+
+	if (--ent->refcount > 0)
+		return;
+
+	for (it = &shared->pinned; *it != ent; it = &(*it)->pin_next)
+		;
+
+	*it = ent->pin_next;
+	ent->pin_next = NULL;
+	cache_trim(shared);
+}
+
+static void cache_release(sqfs_data_reader_t *data, cache_entry_t *ent)
+{
+	cache_lock(data->shared);
+	cache_unref(data->shared, ent);
+	cache_unlock(data->shared);
+}
+
+/* keep a full sized block buffer around for the next cache miss */
+static void keep_spare(sqfs_data_reader_t *data, sqfs_block_t *blk)
+{
+	if (blk != NULL && data->spare == NULL &&
+	    blk->size == data->block_size) {
+		data->spare = blk;
+	} else {
+		free(blk);
+	}
+}
+
+/*
+  Insert a block read by the calling data reader into the cache and take a
+  reference to it. If another data reader sharing the cache was faster, the
+  block is discarded and the existing entry is used instead.
+ */
+static int cache_put(sqfs_data_reader_t *data, sqfs_u64 location,
+		     sqfs_block_t *blk, cache_entry_t **out)
+{
+	data_reader_shared_t *shared = data->shared;
+	cache_entry_t *ent;
+	sqfs_block_t *old;
+
+	cache_lock(shared);
+	shared->cache_misses += 1;
+
+	ent = cache_find(shared, location);
+
+	if (ent == NULL) {
+		ent = cache_new_entry(shared);
+		if (ent == NULL) {
+			cache_unlock(shared);
+			free(blk);
+			return SQFS_ERROR_ALLOC;
+		}
+
+		ent->location = location;
+		hash_insert(shared, ent);
+		lru_push_front(shared, ent);
+
+		/* swap in the new block, recycle the one of an evicted entry */
+		old = ent->block;
+		ent->block = blk;
+		blk = old;
+	}
+
+	cache_ref(shared, ent);
+	cache_unlock(shared);
+
+	keep_spare(data, blk);
+	*out = ent;
+	return 0;
+}
+
+/*
+  Get a referenced cache entry for the block at the given location. On a
+  miss, the block is read and decompressed without holding the cache lock,
+  so other data readers sharing the cache are not held up by it. The
+  reference must be dropped with cache_release.
+ */
+static int cache_get(sqfs_data_reader_t *data, sqfs_u64 location,
+		     sqfs_u32 size, cache_entry_t **out)
+{
+	data_reader_shared_t *shared = data->shared;
+	sqfs_block_t *blk;
+	int err;
+
+	cache_lock(shared);
+	*out = cache_find(shared, location);
+
+	if (*out != NULL) {
+		shared->cache_hits += 1;
+		cache_ref(shared, *out);
+		cache_unlock(shared);
+		return 0;
+	}
+
+	cache_unlock(shared);
+
+	blk = data->spare;
+	data->spare = NULL;
+
+	if (blk == NULL) {
+		blk = alloc_flex(sizeof(*blk), 1, data->block_size);
+		if (blk == NULL)
+			return SQFS_ERROR_ALLOC;
+	}
+
+	memset(blk, 0, sizeof(*blk));
+	blk->size = data->block_size;
+
+	err = data_reader_read_block(data, location, size, blk);
+	if (err) {
+		data->spare = blk;
+		return err;
+	}
+
+	return cache_put(data, location, blk, out);
+}
+
+static int get_fragment_location(sqfs_data_reader_t *data, size_t idx,
+				 sqfs_u64 *location, sqfs_u32 *size)
+{
+	data_reader_shared_t *shared = data->shared;
+
+	cache_lock(shared);
+	if (idx >= shared->num_fragments) {
+		cache_unlock(shared);
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+	}
+
+	*location = shared->frag[idx].start_offset;
+	*size = shared->frag[idx].size;
+	cache_unlock(shared);
+	return 0;
+}
+
+static int get_fragment_block(sqfs_data_reader_t *data, size_t idx,
+			      cache_entry_t **out)
+{
+	sqfs_u64 location;
+	sqfs_u32 size;
+	int err;
+
+	err = get_fragment_location(data, idx, &location, &size);
+	if (err)
+		return err;
+
+	return cache_get(data, location, size, out);
+}
+
+/*
+  If the file is memory mapped, a range of an uncompressed block can be
+  accessed in place, without going through the cache. Returns NULL if the
+  data has to be read through the cache instead. The whole block has to be
+  inside the file, so a broken block fails the same way as with read_at.
+ */
+static const sqfs_u8 *get_mapped(sqfs_data_reader_t *data, sqfs_u64 location,
+				 sqfs_u32 size, size_t offset, size_t len)
+{
+	sqfs_u32 on_disk_size = SQFS_ON_DISK_BLOCK_SIZE(size);
+	const sqfs_u8 *ptr;
+
+	if (SQFS_IS_SPARSE_BLOCK(size) || SQFS_IS_BLOCK_COMPRESSED(size))
+		return NULL;
+
+	if (offset > on_disk_size || len > (on_disk_size - offset))
+		return NULL;
+
+	ptr = sqfs_file_get_pointer(data->file, location, on_disk_size);
+	return ptr == NULL ? NULL : ptr + offset;
+}
+
+static const sqfs_u8 *get_fragment_mapped(sqfs_data_reader_t *data,
+					  size_t idx, size_t offset,
+					  size_t len)
+{
+	sqfs_u64 location;
+	sqfs_u32 size;
+
+	/* an empty range can always be accessed if the file is mapped */
+	if (sqfs_file_get_pointer(data->file, 0, 0) == NULL)
+		return NULL;
+
+	if (get_fragment_location(data, idx, &location, &size))
+		return NULL;
+
+	return get_mapped(data, location, size, offset, len);
+}
+
+static block_index_t *get_block_index(sqfs_data_reader_t *data,
+				      const sqfs_inode_generic_t *inode,
+				      sqfs_u64 block_start)
+{
+	block_index_t *idx, *victim = data->index;
+	sqfs_u64 *offsets;
+	size_t i;
+
+	data->index_clock += 1;
+
+	for (i = 0; i < INDEX_CACHE_SIZE; ++i) {
+		idx = data->index + i;
+
+		if (idx->offsets != NULL &&
+		    idx->inode_number == inode->base.inode_number &&
+		    idx->block_start == block_start &&
+		    idx->num_blocks == inode->num_file_blocks) {
+			idx->last_used = data->index_clock;
+			return idx;
+		}
+
+		if (idx->last_used < victim->last_used)
+			victim = idx;
+	}
+
+	if (SZ_ADD_OV(inode->num_file_blocks, 1, &i))
+		return NULL;
+
+	offsets = alloc_array(sizeof(offsets[0]), i);
+	if (offsets == NULL)
+		return NULL;
+
+	for (i = 0; i < inode->num_file_blocks; ++i) {
+		offsets[i + 1] = offsets[i] +
+			SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+	}
+
+	free(victim->offsets);
+	victim->offsets = offsets;
+	victim->inode_number = inode->base.inode_number;
+	victim->block_start = block_start;
+	victim->num_blocks = inode->num_file_blocks;
+	victim->last_used = data->index_clock;
+	return victim;
+}
+
+/*
+  Get the on-disk location of a block of a file. The index may also be
+  num_file_blocks, to get the location right after the last block.
+ */
+int data_reader_get_block_offset(sqfs_data_reader_t *data,
+				 const sqfs_inode_generic_t *inode,
+				 size_t index, sqfs_u64 *out)
+{
+	block_index_t *idx;
+	sqfs_u64 start;
+	size_t i;
+
+	sqfs_inode_get_file_block_start(inode, &start);
+
+	if (index < INDEX_MIN_BLOCKS) {
+		for (i = 0; i < index; ++i)
+			start += SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+
+		*out = start;
+		return 0;
+	}
+
+	idx = get_block_index(data, inode, start);
+	if (idx == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	*out = start + idx->offsets[index];
+	return 0;
+}
+
+int sqfs_data_reader_set_cache_size(sqfs_data_reader_t *data, size_t size)
+{
+	data_reader_shared_t *shared = data->shared;
+	size_t count, num_buckets;
+	cache_entry_t **buckets, *it;
+
+	count = size / data->block_size;
+	if (count < 1)
+		count = 1;
+
+	for (num_buckets = 1; num_buckets < count; num_buckets <<= 1) {
+		if (num_buckets > (~((size_t)0) >> 2))
+			return SQFS_ERROR_OVERFLOW;
+	}
+
+	buckets = alloc_array(sizeof(buckets[0]), num_buckets);
+	if (buckets == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	cache_lock(shared);
+	shared->cache_max = count;
+	cache_trim(shared);
+
+	free(shared->buckets);
+	shared->buckets = buckets;
+	shared->num_buckets = num_buckets;
+
+	for (it = shared->lru_first; it != NULL; it = it->next)
+		hash_insert(shared, it);
+
+	cache_unlock(shared);
+	return 0;
+}
+
+int sqfs_data_reader_get_stats(const sqfs_data_reader_t *data,
+			       sqfs_data_reader_stats_t *stats)
+{
+	data_reader_shared_t *shared = data->shared;
+
+	if (stats->size != sizeof(*stats))
+		return SQFS_ERROR_UNSUPPORTED;
+
+	cache_lock(shared);
+	stats->cache_hits = shared->cache_hits;
+	stats->cache_misses = shared->cache_misses;
+	stats->cached_blocks = shared->cache_count;
+	stats->cache_size = shared->cache_max * data->block_size;
+	cache_unlock(shared);
+	return 0;
+}
+
+static void destroy_shared(data_reader_shared_t *shared)
+{
+	while (shared->lru_first != NULL)
+		cache_evict(shared, shared->lru_first);
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_destroy(&shared->mtx);
+#endif
+	free(shared->zero_block);
+	free(shared->buckets);
+	free(shared->frag);
+	free(shared);
+}
+
+sqfs_data_reader_t *sqfs_data_reader_create(sqfs_file_t *file,
+					    size_t block_size,
+					    sqfs_compressor_t *cmp)
+{
+	sqfs_data_reader_t *data = alloc_flex(sizeof(*data), 1, block_size);
+
+	if (data == NULL)
+		return NULL;
+
+	data->shared = calloc(1, sizeof(*data->shared));
+	if (data->shared == NULL) {
+		free(data);
+		return NULL;
+	}
+
+#ifdef WITH_PTHREAD
+	data->shared->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+#endif
+	data->shared->refcount = 1;
+	data->shared->block_size = block_size;
+
+	data->file = file;
+	data->block_size = block_size;
+	data->cmp = cmp;
+
+	if (sqfs_data_reader_set_cache_size(data, DEFAULT_CACHE_BLOCKS *
+					    block_size)) {
+		destroy_shared(data->shared);
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+sqfs_data_reader_t *sqfs_data_reader_share(sqfs_data_reader_t *data)
+{
+	sqfs_data_reader_t *copy;
+
+	copy = alloc_flex(sizeof(*copy), 1, data->block_size);
+	if (copy == NULL)
+		return NULL;
+
+	copy->cmp = data->cmp->create_copy(data->cmp);
+	if (copy->cmp == NULL) {
+		free(copy);
+		return NULL;
+	}
+
+	copy->own_cmp = true;
+	copy->file = data->file;
+	copy->block_size = data->block_size;
+	copy->shared = data->shared;
+
+	cache_lock(copy->shared);
+	copy->shared->refcount += 1;
+	cache_unlock(copy->shared);
+	return copy;
+}
+
+int sqfs_data_reader_load_fragment_table(sqfs_data_reader_t *data,
+					 const sqfs_super_t *super)
+{
+	data_reader_shared_t *shared = data->shared;
+	sqfs_fragment_t *frag = NULL;
+	sqfs_u32 i, count = 0;
+	void *raw_frag;
+	size_t size;
+	int ret;
+
+	if (super->fragment_entry_count > 0 &&
+	    (super->flags & SQFS_FLAG_NO_FRAGMENTS) == 0) {
+		if (super->fragment_table_start >= super->bytes_used)
+			return SQFS_ERROR_OUT_OF_BOUNDS;
+
+		if (SZ_MUL_OV(sizeof(frag[0]), super->fragment_entry_count,
+			      &size)) {
+			return SQFS_ERROR_OVERFLOW;
+		}
+
+		ret = sqfs_read_table(data->file, data->cmp, size,
+				      super->fragment_table_start,
+				      super->directory_table_start,
+				      super->fragment_table_start, &raw_frag);
+		if (ret)
+			return ret;
+
+		count = super->fragment_entry_count;
+		frag = raw_frag;
+
+		for (i = 0; i < count; ++i) {
+			frag[i].size = le32toh(frag[i].size);
+			frag[i].start_offset = le64toh(frag[i].start_offset);
+		}
+	}
+
+	cache_lock(shared);
+	free(shared->frag);
+	shared->frag = frag;
+	shared->num_fragments = count;
+	cache_unlock(shared);
+	return 0;
+}
+
+void sqfs_data_reader_destroy(sqfs_data_reader_t *data)
+{
+	data_reader_shared_t *shared = data->shared;
+	size_t i, refcount;
+
+	data_reader_readahead_cleanup(data);
+
+	for (i = 0; i < INDEX_CACHE_SIZE; ++i)
+		free(data->index[i].offsets);
+
+	if (data->own_cmp)
+		data->cmp->destroy(data->cmp);
+
+	cache_lock(shared);
+	refcount = --shared->refcount;
+	cache_unlock(shared);
+
+	if (refcount == 0)
+		destroy_shared(shared);
+
+	free(data->spare);
+	free(data);
+}
+
+int sqfs_data_reader_get_block(sqfs_data_reader_t *data,
+			       const sqfs_inode_generic_t *inode,
+			       size_t index, sqfs_block_t **out)
+{
+	sqfs_u64 off, filesz;
+	size_t unpacked_size;
+	int err;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+
+	if (index >= inode->num_file_blocks)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	err = data_reader_readahead_get(data, inode, index, out);
+	if (err <= 0)
+		return err;
+
+	err = data_reader_get_block_offset(data, inode, index, &off);
+	if (err)
+		return err;
+
+	filesz -= (sqfs_u64)index * data->block_size;
+	unpacked_size = filesz < data->block_size ? filesz : data->block_size;
+
+	return get_block(data, off, inode->block_sizes[index],
+			 unpacked_size, out);
+}
+
+int sqfs_data_reader_get_fragment(sqfs_data_reader_t *data,
+				  const sqfs_inode_generic_t *inode,
+				  sqfs_block_t **out)
+{
+	sqfs_u32 frag_idx, frag_off, frag_sz;
+	cache_entry_t *frag;
+	sqfs_block_t *blk;
+	sqfs_u64 filesz;
+	int err;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+	sqfs_inode_get_frag_location(inode, &frag_idx, &frag_off);
+
+	if (inode->num_file_blocks * data->block_size >= filesz) {
+		*out = NULL;
+		return 0;
+	}
+
+	frag_sz = filesz % data->block_size;
+
+	err = get_fragment_block(data, frag_idx, &frag);
+	if (err)
+		return err;
+
+	if (frag_off + frag_sz > frag->block->size) {
+		err = SQFS_ERROR_OUT_OF_BOUNDS;
+		goto out;
+	}
+
+	blk = alloc_flex(sizeof(*blk), 1, frag_sz);
+	if (blk == NULL) {
+		err = SQFS_ERROR_ALLOC;
+		goto out;
+	}
+
+	blk->size = frag_sz;
+	memcpy(blk->data, (char *)frag->block->data + frag_off, frag_sz);
+
+	*out = blk;
+out:
+	cache_release(data, frag);
+	return err;
+}
+
+sqfs_s32 sqfs_data_reader_read(sqfs_data_reader_t *data,
+			       const sqfs_inode_generic_t *inode,
+			       sqfs_u64 offset, void *buffer, sqfs_u32 size)
+{
+	sqfs_u32 frag_idx, frag_off, diff, total = 0;
+	sqfs_u64 off, filesz;
+	const sqfs_u8 *ptr;
+	cache_entry_t *ent;
+	size_t i;
+	int err;
+
+	if (size >= 0x7FFFFFFF)
+		size = 0x7FFFFFFE;
+
+	/* work out file location and size */
+	sqfs_inode_get_file_size(inode, &filesz);
+	sqfs_inode_get_frag_location(inode, &frag_idx, &frag_off);
+
+	/* find location of the first block */
+	if (offset / data->block_size < inode->num_file_blocks) {
+		i = offset / data->block_size;
+	} else {
+		i = inode->num_file_blocks;
+	}
+
+	offset -= (sqfs_u64)i * data->block_size;
+
+	if (filesz > (sqfs_u64)i * data->block_size) {
+		filesz -= (sqfs_u64)i * data->block_size;
+	} else {
+		filesz = 0;
+	}
+
+	err = data_reader_get_block_offset(data, inode, i, &off);
+	if (err)
+		return err;
+
+	/* copy data from blocks */
+	while (i < inode->num_file_blocks && size > 0 && filesz > 0) {
+		if (offset >= filesz)
+			break;
+
+		diff = data->block_size - offset;
+		if (size < diff)
+			diff = size;
+
+		/* the last block of a file can be shorter */
+		if (filesz - offset < diff)
+			diff = filesz - offset;
+
+		ptr = get_mapped(data, off, inode->block_sizes[i],
+				 offset, diff);
+
+		if (SQFS_IS_SPARSE_BLOCK(inode->block_sizes[i])) {
+			memset(buffer, 0, diff);
+		} else if (ptr != NULL) {
+			memcpy(buffer, ptr, diff);
+			off += SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+		} else {
+			err = cache_get(data, off, inode->block_sizes[i],
+					&ent);
+			if (err)
+				return err;
+
+			if (offset + diff > ent->block->size) {
+				cache_release(data, ent);
+				return SQFS_ERROR_CORRUPTED;
+			}
+
+			memcpy(buffer, (char *)ent->block->data + offset, diff);
+			cache_release(data, ent);
+			off += SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+		}
+
+		if (filesz >= data->block_size) {
+			filesz -= data->block_size;
+		} else {
+			filesz = 0;
+		}
+
+		++i;
+		offset = 0;
+		size -= diff;
+		total += diff;
+		buffer = (char *)buffer + diff;
+	}
+
+	/* copy from fragment */
+	if (i == inode->num_file_blocks && size > 0 && filesz > 0) {
+		if (offset >= filesz)
+			return total;
+
+		if (offset + size > filesz)
+			size = filesz - offset;
+
+		if (size == 0)
+			return total;
+
+		ptr = get_fragment_mapped(data, frag_idx, frag_off + offset,
+					  size);
+		if (ptr != NULL) {
+			memcpy(buffer, ptr, size);
+			return total + size;
+		}
+
+		err = get_fragment_block(data, frag_idx, &ent);
+		if (err)
+			return err;
+
+		if (frag_off + filesz > ent->block->size) {
+			cache_release(data, ent);
+			return SQFS_ERROR_OUT_OF_BOUNDS;
+		}
+
+		memcpy(buffer, (char *)ent->block->data + frag_off + offset,
+		       size);
+		cache_release(data, ent);
+		total += size;
+	}
+
+	return total;
+}
+
+static const sqfs_u8 *get_zero_block(sqfs_data_reader_t *data)
+{
+	data_reader_shared_t *shared = data->shared;
+	sqfs_u8 *ptr;
+
+	cache_lock(shared);
+	if (shared->zero_block == NULL)
+		shared->zero_block = calloc(1, shared->block_size);
+
+	ptr = shared->zero_block;
+	cache_unlock(shared);
+	return ptr;
+}
+
+int sqfs_data_reader_get_block_ref(sqfs_data_reader_t *data,
+				   const sqfs_inode_generic_t *inode,
+				   size_t index, const sqfs_u8 **out,
+				   size_t *size)
+{
+	sqfs_u64 off, filesz;
+	size_t unpacked_size;
+	cache_entry_t *ent;
+	sqfs_block_t *blk;
+	int err;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+
+	if (index >= inode->num_file_blocks)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	filesz -= (sqfs_u64)index * data->block_size;
+	unpacked_size = filesz < data->block_size ? filesz : data->block_size;
+
+	if (SQFS_IS_SPARSE_BLOCK(inode->block_sizes[index])) {
+		*out = get_zero_block(data);
+		if (*out == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		*size = unpacked_size;
+		return 0;
+	}
+
+	err = data_reader_get_block_offset(data, inode, index, &off);
+	if (err)
+		return err;
+
+	*out = get_mapped(data, off, inode->block_sizes[index],
+			  0, unpacked_size);
+	if (*out != NULL) {
+		*size = unpacked_size;
+		return 0;
+	}
+
+	err = data_reader_readahead_get(data, inode, index, &blk);
+	if (err < 0)
+		return err;
+
+	if (err == 0) {
+		err = cache_put(data, off, blk, &ent);
+	} else {
+		err = cache_get(data, off, inode->block_sizes[index], &ent);
+	}
+
+	if (err)
+		return err;
+
+	if (unpacked_size > ent->block->size) {
+		cache_release(data, ent);
+		return SQFS_ERROR_CORRUPTED;
+	}
+
+	*out = ent->block->data;
+	*size = unpacked_size;
+	return 0;
+}
+
+int sqfs_data_reader_get_fragment_ref(sqfs_data_reader_t *data,
+				      const sqfs_inode_generic_t *inode,
+				      const sqfs_u8 **out, size_t *size)
+{
+	sqfs_u32 frag_idx, frag_off, frag_sz;
+	cache_entry_t *ent;
+	sqfs_u64 filesz;
+	int err;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+	sqfs_inode_get_frag_location(inode, &frag_idx, &frag_off);
+
+	if (inode->num_file_blocks * data->block_size >= filesz) {
+		*out = NULL;
+		*size = 0;
+		return 0;
+	}
+
+	frag_sz = filesz % data->block_size;
+
+	*out = get_fragment_mapped(data, frag_idx, frag_off, frag_sz);
+	if (*out != NULL) {
+		*size = frag_sz;
+		return 0;
+	}
+
+	err = get_fragment_block(data, frag_idx, &ent);
+	if (err)
+		return err;
+
+	if (frag_off + frag_sz > ent->block->size) {
+		cache_release(data, ent);
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+	}
+
+	*out = ent->block->data + frag_off;
+	*size = frag_sz;
+	return 0;
+}
+
+void sqfs_data_reader_release_ref(sqfs_data_reader_t *data, const sqfs_u8 *ptr)
+{
+	data_reader_shared_t *shared = data->shared;
+	cache_entry_t *ent;
+
+	if (ptr == NULL)
+		return;
+
+	cache_lock(shared);
+
+	for (ent = shared->pinned; ent != NULL; ent = ent->pin_next) {
+		if (ptr >= ent->block->data &&
+		    ptr < ent->block->data + ent->block->size) {
+			cache_unref(shared, ent);
+			break;
+		}
+	}
+
+	cache_unlock(shared);
+}
@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * internal.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef INTERNAL_H
+#define INTERNAL_H
+
+#include "config.h"
+
+#include "sqfs/data_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/block.h"
+#include "sqfs/error.h"
+#include "sqfs/table.h"
+#include "sqfs/inode.h"
+#include "sqfs/io.h"
+#include "util/util.h"
+#include "../io_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
+
+/* Default size of the block cache, in blocks */
+#define DEFAULT_CACHE_BLOCKS (8)
+
+/*
+  Files with more blocks than this get a table of block offsets, so finding
+  a block does not require summing up the sizes of all blocks before it.
+ */
+#define INDEX_MIN_BLOCKS (64)
+
+/* Number of block offset tables kept around */
+#define INDEX_CACHE_SIZE (4)
+
+/* Default number of blocks in flight per read-ahead worker */
+#define READAHEAD_BLOCKS_PER_WORKER (4)
+
+typedef struct {
+	/* identifies the file within the image */
+	sqfs_u32 inode_number;
+	sqfs_u64 block_start;
+	size_t num_blocks;
+
+	sqfs_u64 last_used;
+
+	/* offset of each block relative to the first, plus the total size */
+	sqfs_u64 *offsets;
+} block_index_t;
+
+typedef struct cache_entry_t {
+	/* LRU list, most recently used first */
+	struct cache_entry_t *prev;
+	struct cache_entry_t *next;
+
+	/* next entry in the same hash bucket */
+	struct cache_entry_t *hash_next;
+
+	/* on-disk location of the block, used as cache key */
+	sqfs_u64 location;
+
+	/* references handed out to the caller, the entry is kept while > 0 */
+	size_t refcount;
+	struct cache_entry_t *pin_next;
+
+	sqfs_block_t *block;
+} cache_entry_t;
+
+#ifdef WITH_PTHREAD
+typedef struct readahead_file_t {
+	struct readahead_file_t *next;
+	const sqfs_inode_generic_t *inode;
+} readahead_file_t;
+
+typedef struct {
+	const sqfs_inode_generic_t *inode;
+	size_t index;
+
+	/* on-disk size of the block, as stored in the inode */
+	sqfs_u32 size;
+
+	/* staging area for compressed data, one block size per job */
+	sqfs_u8 *raw;
+
+	/* the compressed data, in the staging area or in the mapped file */
+	const sqfs_u8 *data;
+
+	sqfs_block_t *blk;
+	int status;
+	bool done;
+} readahead_job_t;
+
+/* consecutive compressed blocks, fetched from the file with a single read */
+typedef struct {
+	/* sequence number of the first job */
+	size_t first;
+	size_t count;
+
+	/* on-disk location and total size of the blocks */
+	sqfs_u64 offset;
+	size_t size;
+} readahead_run_t;
+
+typedef struct {
+	struct readahead_t *shared;
+	pthread_t thread;
+	sqfs_compressor_t *cmp;
+} readahead_worker_t;
+
+typedef struct readahead_t {
+	pthread_mutex_t mtx;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	bool quit;
+
+	/*
+	  Ring buffer of blocks in flight, in the order they are delivered.
+	  The sequence numbers count up forever, the ring index is the
+	  sequence number modulo num_jobs.
+
+	  [head, work) has been picked up by workers, [work, tail) is waiting
+	  for a worker. Only the main thread modifies head and tail.
+	 */
+	readahead_job_t *jobs;
+	size_t num_jobs;
+	size_t head;
+	size_t work;
+	size_t tail;
+
+	sqfs_u8 *raw;
+
+	/* files queued for read-ahead, the first one is being scheduled */
+	readahead_file_t *files;
+	readahead_file_t *files_last;
+
+	/* the next block of the first queued file to schedule */
+	size_t sched_index;
+	sqfs_u64 sched_offset;
+
+	unsigned int num_workers;
+	unsigned int num_threads;
+	readahead_worker_t workers[];
+} readahead_t;
+#endif
+
+/*
+  State shared by all data readers created from the same one through
+  sqfs_data_reader_share. Everything but the block size is protected by
+  the mutex.
+ */
+typedef struct {
+#ifdef WITH_PTHREAD
+	pthread_mutex_t mtx;
+#endif
+	/* number of data readers using this */
+	size_t refcount;
+
+	sqfs_u32 block_size;
+
+	sqfs_fragment_t *frag;
+	sqfs_u32 num_fragments;
+
+	/* cache of uncompressed data and fragment blocks */
+	cache_entry_t **buckets;
+	size_t num_buckets;
+	cache_entry_t *lru_first;
+	cache_entry_t *lru_last;
+	size_t cache_count;
+	size_t cache_max;
+
+	sqfs_u64 cache_hits;
+	sqfs_u64 cache_misses;
+
+	/* cache entries with outstanding references */
+	cache_entry_t *pinned;
+
+	/* handed out for sparse blocks, allocated on first use */
+	sqfs_u8 *zero_block;
+} data_reader_shared_t;
+
+struct sqfs_data_reader_t {
+	data_reader_shared_t *shared;
+
+	sqfs_compressor_t *cmp;
+
+	/* set if cmp is a private copy, made by sqfs_data_reader_share */
+	bool own_cmp;
+
+	sqfs_file_t *file;
+	sqfs_u32 block_size;
+
+	/* block buffer of an evicted cache entry, used for the next miss */
+	sqfs_block_t *spare;
+
+	/* block offset tables of recently accessed large files */
+	block_index_t index[INDEX_CACHE_SIZE];
+	sqfs_u64 index_clock;
+
+#ifdef WITH_PTHREAD
+	/* decompression of upcoming blocks, NULL if disabled */
+	readahead_t *readahead;
+#endif
+
+	sqfs_u8 scratch[];
+};
+
+SQFS_INTERNAL
+int data_reader_get_block_offset(sqfs_data_reader_t *data,
+				 const sqfs_inode_generic_t *inode,
+				 size_t index, sqfs_u64 *out);
+
+SQFS_INTERNAL
+int data_reader_unpack_block(sqfs_compressor_t *cmp, const sqfs_u8 *raw,
+			     sqfs_u32 size, sqfs_block_t *blk);
+
+SQFS_INTERNAL
+int data_reader_read_block(sqfs_data_reader_t *data, sqfs_u64 off,
+			   sqfs_u32 size, sqfs_block_t *blk);
+
+/*
+  Try to get a block from the read-ahead queue. Returns zero if the block was
+  delivered, a value greater than zero if the block has not been queued and
+  must be read directly, or a negative E_SQFS_ERROR value on failure.
+ */
+SQFS_INTERNAL
+int data_reader_readahead_get(sqfs_data_reader_t *data,
+			      const sqfs_inode_generic_t *inode,
+			      size_t index, sqfs_block_t **out);
+
+SQFS_INTERNAL void data_reader_readahead_cleanup(sqfs_data_reader_t *data);
+
+#endif /* INTERNAL_H */
@@ -0,0 +1,463 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * pthread.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+static void *worker_proc(void *arg)
+{
+	readahead_worker_t *worker = arg;
+	readahead_t *ra = worker->shared;
+	readahead_job_t *job;
+	sqfs_u32 size;
+	int status;
+
+	pthread_mutex_lock(&ra->mtx);
+
+	for (;;) {
+		while (!ra->quit && ra->work == ra->tail)
+			pthread_cond_wait(&ra->work_cond, &ra->mtx);
+
+		if (ra->quit)
+			break;
+
+		job = ra->jobs + (ra->work++ % ra->num_jobs);
+
+		/* uncompressed, failed or dropped blocks */
+		if (job->done)
+			continue;
+
+		pthread_mutex_unlock(&ra->mtx);
+
+		size = SQFS_ON_DISK_BLOCK_SIZE(job->size);
+		status = data_reader_unpack_block(worker->cmp, job->data,
+						  size, job->blk);
+
+		pthread_mutex_lock(&ra->mtx);
+		job->status = status;
+		job->done = true;
+		pthread_cond_signal(&ra->done_cond);
+	}
+
+	pthread_mutex_unlock(&ra->mtx);
+	return NULL;
+}
+
+static void destroy_readahead(readahead_t *ra)
+{
+	readahead_file_t *file;
+	unsigned int i;
+	size_t seq;
+
+	pthread_mutex_lock(&ra->mtx);
+	ra->quit = true;
+	pthread_cond_broadcast(&ra->work_cond);
+	pthread_mutex_unlock(&ra->mtx);
+
+	for (i = 0; i < ra->num_threads; ++i)
+		pthread_join(ra->workers[i].thread, NULL);
+
+	for (i = 0; i < ra->num_workers; ++i) {
+		if (ra->workers[i].cmp != NULL)
+			ra->workers[i].cmp->destroy(ra->workers[i].cmp);
+	}
+
+	for (seq = ra->head; seq != ra->tail; ++seq)
+		free(ra->jobs[seq % ra->num_jobs].blk);
+
+	while (ra->files != NULL) {
+		file = ra->files;
+		ra->files = file->next;
+		free(file);
+	}
+
+	pthread_cond_destroy(&ra->done_cond);
+	pthread_cond_destroy(&ra->work_cond);
+	pthread_mutex_destroy(&ra->mtx);
+	free(ra->raw);
+	free(ra->jobs);
+	free(ra);
+}
+
+/* wait for the oldest job to complete and take it off the ring */
+static readahead_job_t *take_job(readahead_t *ra)
+{
+	readahead_job_t *job = ra->jobs + ra->head % ra->num_jobs;
+
+	pthread_mutex_lock(&ra->mtx);
+	while (!job->done)
+		pthread_cond_wait(&ra->done_cond, &ra->mtx);
+
+	/*
+	  Blocks that were complete when scheduled may be taken before a worker
+	  got to them. The workers must not get behind, the slot is reused.
+	 */
+	ra->head += 1;
+	if (ra->work < ra->head)
+		ra->work = ra->head;
+	pthread_mutex_unlock(&ra->mtx);
+	return job;
+}
+
+static void drop_job(readahead_t *ra)
+{
+	readahead_job_t *job = take_job(ra);
+
+	free(job->blk);
+	job->blk = NULL;
+}
+
+static void drop_all_jobs(readahead_t *ra)
+{
+	size_t seq;
+
+	/* blocks that no worker has picked up yet can simply be skipped */
+	pthread_mutex_lock(&ra->mtx);
+	for (seq = ra->work; seq != ra->tail; ++seq)
+		ra->jobs[seq % ra->num_jobs].done = true;
+	ra->work = ra->tail;
+	pthread_mutex_unlock(&ra->mtx);
+
+	while (ra->head != ra->tail)
+		drop_job(ra);
+}
+
+static void pop_file(readahead_t *ra)
+{
+	readahead_file_t *file = ra->files;
+
+	ra->files = file->next;
+	if (ra->files == NULL)
+		ra->files_last = NULL;
+
+	free(file);
+
+	ra->sched_index = 0;
+	if (ra->files != NULL) {
+		sqfs_inode_get_file_block_start(ra->files->inode,
+						&ra->sched_offset);
+	}
+}
+
+/*
+  Runs on the calling thread. Compressed blocks are only read from disk here,
+  so the underlying file is never accessed concurrently. If the file is
+  memory mapped, the workers decompress straight from the mapping. Otherwise
+  job->data is left NULL and the block is fetched later through read_run.
+ */
+static int read_job(sqfs_data_reader_t *data, readahead_job_t *job,
+		    sqfs_u64 offset)
+{
+	sqfs_u32 on_disk_size = SQFS_ON_DISK_BLOCK_SIZE(job->size);
+	size_t unpacked_size;
+	sqfs_u64 filesz;
+
+	sqfs_inode_get_file_size(job->inode, &filesz);
+	filesz -= (sqfs_u64)job->index * data->block_size;
+	unpacked_size = filesz < data->block_size ? filesz : data->block_size;
+
+	job->data = NULL;
+	job->blk = alloc_flex(sizeof(*job->blk), 1, unpacked_size);
+	if (job->blk == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	job->blk->size = unpacked_size;
+
+	if (!SQFS_IS_BLOCK_COMPRESSED(job->size)) {
+		return data_reader_read_block(data, offset, job->size,
+					      job->blk);
+	}
+
+	if (on_disk_size > unpacked_size)
+		return SQFS_ERROR_OVERFLOW;
+
+	job->data = sqfs_file_get_pointer(data->file, offset, on_disk_size);
+
+	return 0;
+}
+
+/*
+  Fetch the compressed data of a run of consecutive jobs with a single read.
+  The data is packed towards the end of the staging area of the jobs, so
+  that no job's data extends into the area of an earlier job, which is
+  reused as soon as that job has been taken off the ring.
+ */
+static void read_run(sqfs_data_reader_t *data, readahead_t *ra,
+		     readahead_run_t *run)
+{
+	readahead_job_t *job;
+	sqfs_u8 *ptr;
+	size_t i;
+	int err;
+
+	if (run->count == 0)
+		return;
+
+	job = ra->jobs + run->first % ra->num_jobs;
+	ptr = job->raw + run->count * data->block_size - run->size;
+
+	err = data->file->read_at(data->file, run->offset, ptr, run->size);
+
+	for (i = 0; i < run->count; ++i) {
+		job = ra->jobs + (run->first + i) % ra->num_jobs;
+		job->data = ptr;
+		ptr += SQFS_ON_DISK_BLOCK_SIZE(job->size);
+
+		if (err) {
+			job->status = err;
+			job->done = true;
+		}
+	}
+
+	run->count = 0;
+}
+
+static void schedule_blocks(sqfs_data_reader_t *data, readahead_t *ra)
+{
+	const sqfs_inode_generic_t *inode;
+	size_t tail = ra->tail;
+	readahead_run_t run;
+	readahead_job_t *job;
+	sqfs_u32 size;
+
+	/*
+	  Wait until at least half of the ring is free, so runs of
+	  consecutive blocks can be fetched with a single read.
+	 */
+	if (ra->head != ra->tail &&
+	    ra->num_jobs - (ra->tail - ra->head) < ra->num_jobs / 2) {
+		return;
+	}
+
+	run.count = 0;
+
+	while (ra->files != NULL && (tail - ra->head) < ra->num_jobs) {
+		inode = ra->files->inode;
+
+		if (ra->sched_index >= inode->num_file_blocks) {
+			read_run(data, ra, &run);
+			pop_file(ra);
+			continue;
+		}
+
+		size = inode->block_sizes[ra->sched_index];
+
+		/* sparse blocks take up no space, they don't end a run */
+		if (!SQFS_IS_SPARSE_BLOCK(size)) {
+			job = ra->jobs + tail % ra->num_jobs;
+			job->inode = inode;
+			job->index = ra->sched_index;
+			job->size = size;
+			job->status = read_job(data, job, ra->sched_offset);
+			job->done = job->status != 0 ||
+				!SQFS_IS_BLOCK_COMPRESSED(size);
+
+			/* uncompressed, failed or mapped blocks need no read */
+			if (!job->done && job->data == NULL) {
+				if (run.count == 0) {
+					run.first = tail;
+					run.offset = ra->sched_offset;
+					run.size = 0;
+				}
+
+				run.count += 1;
+				run.size += SQFS_ON_DISK_BLOCK_SIZE(size);
+			} else {
+				read_run(data, ra, &run);
+			}
+
+			/* the staging area of a run must not wrap around */
+			if (++tail % ra->num_jobs == 0)
+				read_run(data, ra, &run);
+		}
+
+		ra->sched_offset += SQFS_ON_DISK_BLOCK_SIZE(size);
+		ra->sched_index += 1;
+	}
+
+	read_run(data, ra, &run);
+
+	if (tail != ra->tail) {
+		pthread_mutex_lock(&ra->mtx);
+		ra->tail = tail;
+		pthread_cond_broadcast(&ra->work_cond);
+		pthread_mutex_unlock(&ra->mtx);
+	}
+}
+
+/*
+  The requested block is not in flight. If it belongs to a queued file, the
+  consumer skipped everything before it, so continue reading ahead after it.
+ */
+static int skip_ahead(sqfs_data_reader_t *data, readahead_t *ra,
+		      const sqfs_inode_generic_t *inode, size_t index)
+{
+	readahead_file_t *it;
+
+	for (it = ra->files; it != NULL; it = it->next) {
+		if (it->inode == inode)
+			break;
+	}
+
+	if (it == NULL || (it == ra->files && index < ra->sched_index))
+		return 0;
+
+	drop_all_jobs(ra);
+
+	while (ra->files != it)
+		pop_file(ra);
+
+	ra->sched_index = index + 1;
+
+	return data_reader_get_block_offset(data, inode, ra->sched_index,
+					    &ra->sched_offset);
+}
+
+int data_reader_readahead_get(sqfs_data_reader_t *data,
+			      const sqfs_inode_generic_t *inode,
+			      size_t index, sqfs_block_t **out)
+{
+	readahead_t *ra = data->readahead;
+	readahead_job_t *job = NULL;
+	sqfs_block_t *blk;
+	size_t seq;
+	int err;
+
+	if (ra == NULL)
+		return 1;
+
+	for (seq = ra->head; seq != ra->tail; ++seq) {
+		job = ra->jobs + seq % ra->num_jobs;
+
+		if (job->inode == inode && job->index == index)
+			break;
+	}
+
+	if (seq == ra->tail) {
+		err = skip_ahead(data, ra, inode, index);
+		if (err)
+			return err;
+
+		schedule_blocks(data, ra);
+		return 1;
+	}
+
+	while (ra->head != seq)
+		drop_job(ra);
+
+	job = take_job(ra);
+	blk = job->blk;
+	err = job->status;
+	job->blk = NULL;
+
+	schedule_blocks(data, ra);
+
+	if (err) {
+		free(blk);
+		return err;
+	}
+
+	*out = blk;
+	return 0;
+}
+
+void data_reader_readahead_cleanup(sqfs_data_reader_t *data)
+{
+	if (data->readahead != NULL) {
+		destroy_readahead(data->readahead);
+		data->readahead = NULL;
+	}
+}
+
+int sqfs_data_reader_set_readahead(sqfs_data_reader_t *data,
+				   unsigned int num_workers,
+				   size_t max_blocks)
+{
+	readahead_t *ra;
+	unsigned int i;
+	size_t j;
+
+	data_reader_readahead_cleanup(data);
+
+	if (num_workers == 0)
+		return 0;
+
+	if (max_blocks == 0)
+		max_blocks = (size_t)num_workers * READAHEAD_BLOCKS_PER_WORKER;
+
+	ra = alloc_flex(sizeof(*ra), sizeof(ra->workers[0]), num_workers);
+	if (ra == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	ra->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	ra->work_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	ra->done_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	ra->num_workers = num_workers;
+	ra->num_jobs = max_blocks;
+
+	ra->jobs = alloc_array(sizeof(ra->jobs[0]), max_blocks);
+	if (ra->jobs == NULL)
+		goto fail_alloc;
+
+	ra->raw = alloc_array(data->block_size, max_blocks);
+	if (ra->raw == NULL)
+		goto fail_alloc;
+
+	for (j = 0; j < max_blocks; ++j)
+		ra->jobs[j].raw = ra->raw + j * data->block_size;
+
+	for (i = 0; i < num_workers; ++i) {
+		ra->workers[i].shared = ra;
+		ra->workers[i].cmp = data->cmp->create_copy(data->cmp);
+
+		if (ra->workers[i].cmp == NULL)
+			goto fail_alloc;
+	}
+
+	for (i = 0; i < num_workers; ++i) {
+		if (pthread_create(&ra->workers[i].thread, NULL,
+				   worker_proc, ra->workers + i) != 0) {
+			destroy_readahead(ra);
+			return SQFS_ERROR_INTERNAL;
+		}
+
+		ra->num_threads += 1;
+	}
+
+	data->readahead = ra;
+	return 0;
+fail_alloc:
+	destroy_readahead(ra);
+	return SQFS_ERROR_ALLOC;
+}
+
+int sqfs_data_reader_queue_file(sqfs_data_reader_t *data,
+				const sqfs_inode_generic_t *inode)
+{
+	readahead_t *ra = data->readahead;
+	readahead_file_t *file;
+
+	if (ra == NULL || inode->num_file_blocks == 0)
+		return 0;
+
+	file = calloc(1, sizeof(*file));
+	if (file == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	file->inode = inode;
+
+	if (ra->files == NULL) {
+		ra->files = file;
+		ra->sched_index = 0;
+		sqfs_inode_get_file_block_start(inode, &ra->sched_offset);
+	} else {
+		ra->files_last->next = file;
+	}
+
+	ra->files_last = file;
+	schedule_blocks(data, ra);
+	return 0;
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * serial.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+int data_reader_readahead_get(sqfs_data_reader_t *data,
+			      const sqfs_inode_generic_t *inode,
+			      size_t index, sqfs_block_t **out)
+{
+	(void)data; (void)inode; (void)index; (void)out;
+	return 1;
+}
+
+void data_reader_readahead_cleanup(sqfs_data_reader_t *data)
+{
+	(void)data;
+}
+
+int sqfs_data_reader_set_readahead(sqfs_data_reader_t *data,
+				   unsigned int num_workers,
+				   size_t max_blocks)
+{
+	(void)data; (void)num_workers; (void)max_blocks;
+	return 0;
+}
+
+int sqfs_data_reader_queue_file(sqfs_data_reader_t *data,
+				const sqfs_inode_generic_t *inode)
+{
+	(void)data; (void)inode;
+	return 0;
+}
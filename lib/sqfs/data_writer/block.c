@@ -9,10 +9,25 @@
 
 #include <string.h>
 
+static void rehash_blocks(sqfs_data_writer_t *proc)
+{
+	size_t i, idx;
+
+	for (i = 0; i < proc->max_blocks; ++i)
+		proc->blk_buckets[i] = BLK_INFO_NONE;
+
+	for (i = 0; i < proc->num_blocks; ++i) {
+		idx = proc->blocks[i].hash % proc->max_blocks;
+
+		proc->blocks[i].next = proc->blk_buckets[idx];
+		proc->blk_buckets[idx] = i;
+	}
+}
+
 static int store_block_location(sqfs_data_writer_t *proc, sqfs_u64 offset,
 				sqfs_u32 size, sqfs_u32 chksum)
 {
-	size_t new_sz;
+	size_t new_sz, idx;
 	void *new;
 
 	if (proc->num_blocks == proc->max_blocks) {
@@ -23,49 +38,188 @@ static int store_block_location(sqfs_data_writer_t *proc, sqfs_u64 offset,
 			return SQFS_ERROR_ALLOC;
 
 		proc->blocks = new;
+
+		new = realloc(proc->blk_buckets,
+			      sizeof(proc->blk_buckets[0]) * new_sz);
+
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		proc->blk_buckets = new;
 		proc->max_blocks = new_sz;
+		rehash_blocks(proc);
 	}
 
 	proc->blocks[proc->num_blocks].offset = offset;
 	proc->blocks[proc->num_blocks].hash = MK_BLK_HASH(chksum, size);
+
+	idx = proc->blocks[proc->num_blocks].hash % proc->max_blocks;
+	proc->blocks[proc->num_blocks].next = proc->blk_buckets[idx];
+	proc->blk_buckets[idx] = proc->num_blocks;
+
 	proc->num_blocks += 1;
 	return 0;
 }
 
+static void drop_block_locations(sqfs_data_writer_t *proc, size_t count)
+{
+	size_t idx;
+
+	/* Bucket chains are ordered by descending index, so removing from the
+	   back always unlinks the head of a chain. */
+	while (proc->num_blocks > count) {
+		proc->num_blocks -= 1;
+
+		idx = proc->blocks[proc->num_blocks].hash % proc->max_blocks;
+		proc->blk_buckets[idx] = proc->blocks[proc->num_blocks].next;
+	}
+}
+
 static size_t deduplicate_blocks(sqfs_data_writer_t *proc, size_t count)
 {
-	size_t i, j;
+	size_t i, j, start = proc->file_start;
+	sqfs_u64 hash;
+
+	if (count == 0)
+		return 0;
+
+	hash = proc->blocks[proc->file_start].hash;
+	i = proc->blk_buckets[hash % proc->max_blocks];
 
-	for (i = 0; i < proc->file_start; ++i) {
-		for (j = 0; j < count; ++j) {
+	for (; i != BLK_INFO_NONE; i = proc->blocks[i].next) {
+		if (i >= start || proc->blocks[i].hash != hash)
+			continue;
+
+		for (j = 1; j < count; ++j) {
 			if (proc->blocks[i + j].hash !=
 			    proc->blocks[proc->file_start + j].hash)
 				break;
 		}
 
 		if (j == count)
-			break;
+			start = i;
 	}
 
-	return i;
+	return start;
+}
+
+static int write_file(sqfs_data_writer_t *proc, const void *data,
+		      size_t size)
+{
+	sqfs_u64 offset = proc->file->get_size(proc->file);
+	sqfs_u64 start, end;
+	int ret;
+
+	start = get_time_ns();
+	data_writer_trace(proc, SQFS_TRACE_WRITE_BEGIN, TRACE_THREAD_WRITER,
+			  start, size);
+
+	ret = proc->file->write_at(proc->file, offset, data, size);
+
+	end = get_time_ns();
+	data_writer_trace(proc, SQFS_TRACE_WRITE_END, TRACE_THREAD_WRITER,
+			  end, size);
+
+	proc->write_time += end - start;
+	return ret;
+}
+
+static sqfs_u64 output_size(sqfs_data_writer_t *proc)
+{
+	return proc->file->get_size(proc->file) + proc->wrbuf_used;
 }
 
+int data_writer_flush_output(sqfs_data_writer_t *proc)
+{
+	int ret;
+
+	if (proc->wrbuf_used == 0)
+		return 0;
+
+	ret = write_file(proc, proc->wrbuf, proc->wrbuf_used);
+	proc->wrbuf_used = 0;
+	return ret;
+}
+
+/*
+  If the blocks of the file currently being written still fit into the
+  deduplication budget, only write out what comes before the file, so
+  the file can still be dropped without ever being written to disk.
+ */
+static int make_room(sqfs_data_writer_t *proc, size_t size)
+{
+	sqfs_u64 offset = proc->file->get_size(proc->file);
+	size_t keep, diff;
+	int ret;
+
+	if (!proc->hold_file || proc->start < offset)
+		return data_writer_flush_output(proc);
+
+	keep = output_size(proc) - proc->start;
+	if (keep + size > proc->dedup_max)
+		return data_writer_flush_output(proc);
+
+	diff = proc->start - offset;
+	ret = write_file(proc, proc->wrbuf, diff);
+	if (ret)
+		return ret;
+
+	memmove(proc->wrbuf, proc->wrbuf + diff, keep);
+	proc->wrbuf_used = keep;
+	return 0;
+}
+
+static int write_output(sqfs_data_writer_t *proc, const void *data,
+			size_t size)
+{
+	int ret;
+
+	if (size > proc->wrbuf_size - proc->wrbuf_used) {
+		ret = make_room(proc, size);
+		if (ret)
+			return ret;
+	}
+
+	if (size > proc->wrbuf_size - proc->wrbuf_used)
+		return write_file(proc, data, size);
+
+	memcpy(proc->wrbuf + proc->wrbuf_used, data, size);
+	proc->wrbuf_used += size;
+	return 0;
+}
+
+static int truncate_output(sqfs_data_writer_t *proc, sqfs_u64 size)
+{
+	sqfs_u64 file_size = proc->file->get_size(proc->file);
+
+	if (size >= file_size) {
+		proc->wrbuf_used = size - file_size;
+		return 0;
+	}
+
+	proc->wrbuf_used = 0;
+	return proc->file->truncate(proc->file, size);
+}
+
+/*
+  Pad the output up to the next device block boundary. The padding is not
+  recorded as a block of the file, the file data starts right after it.
+ */
 static int align_file(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 {
-	sqfs_u32 chksum;
 	void *padding;
-	sqfs_u64 size;
 	size_t diff;
 	int ret;
 
 	if (!(blk->flags & SQFS_BLK_ALIGN))
 		return 0;
 
-	size = proc->file->get_size(proc->file);
-	diff = size % proc->devblksz;
+	diff = output_size(proc) % proc->devblksz;
 	if (diff == 0)
 		return 0;
 
+	diff = proc->devblksz - diff;
+
 	padding = calloc(1, diff);
 	if (padding == 0)
 		return SQFS_ERROR_ALLOC;
@@ -73,14 +227,9 @@ static int align_file(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 	if (proc->hooks != NULL && proc->hooks->prepare_padding != NULL)
 		proc->hooks->prepare_padding(proc->user_ptr, padding, diff);
 
-	chksum = crc32(0, padding, diff);
-
-	ret = proc->file->write_at(proc->file, size, padding, diff);
+	ret = write_output(proc, padding, diff);
 	free(padding);
-	if (ret)
-		return ret;
-
-	return store_block_location(proc, size, diff | (1 << 24), chksum);
+	return ret;
 }
 
 int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
@@ -91,12 +240,19 @@ int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 	int err;
 
 	if (proc->hooks != NULL && proc->hooks->pre_block_write != NULL) {
+		/* The hook is allowed to append to the file directly. This
+		   also writes out a file that is being held back. */
+		err = data_writer_flush_output(proc);
+		if (err)
+			return err;
+
 		proc->hooks->pre_block_write(proc->user_ptr, blk, proc->file);
 	}
 
 	if (blk->flags & SQFS_BLK_FIRST_BLOCK) {
-		proc->start = proc->file->get_size(proc->file);
+		proc->start = output_size(proc);
 		proc->file_start = proc->num_blocks;
+		proc->hold_file = proc->dedup_max > 0;
 
 		err = align_file(proc, blk);
 		if (err)
@@ -104,32 +260,44 @@ int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 	}
 
 	if (blk->size != 0) {
+		if ((blk->flags & SQFS_BLK_ESTIMATE_ENTROPY) &&
+		    (blk->flags & SQFS_BLK_DONT_COMPRESS)) {
+			proc->incompressible_blocks += 1;
+		}
+
 		out = blk->size;
 		if (!(blk->flags & SQFS_BLK_IS_COMPRESSED))
 			out |= 1 << 24;
 
-		offset = proc->file->get_size(proc->file);
+		offset = output_size(proc);
 
 		if (blk->flags & SQFS_BLK_FRAGMENT_BLOCK) {
-			offset = htole64(offset);
-			proc->fragments[blk->index].start_offset = offset;
+			proc->fragments[blk->index].start_offset =
+				htole64(offset);
 			proc->fragments[blk->index].pad0 = 0;
 			proc->fragments[blk->index].size = htole32(out);
+			proc->frag_blocks_written += 1;
 		} else {
 			blk->inode->block_sizes[blk->index] = out;
+			proc->blocks_written += 1;
 		}
 
 		err = store_block_location(proc, offset, out, blk->checksum);
 		if (err)
 			return err;
 
-		err = proc->file->write_at(proc->file, offset,
-					   blk->data, blk->size);
+		err = write_output(proc, blk->data, blk->size);
 		if (err)
 			return err;
+
+		proc->bytes_written += blk->size;
 	}
 
 	if (proc->hooks != NULL && proc->hooks->post_block_write != NULL) {
+		err = data_writer_flush_output(proc);
+		if (err)
+			return err;
+
 		proc->hooks->post_block_write(proc->user_ptr, blk, proc->file);
 	}
 
@@ -138,6 +306,8 @@ int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 		if (err)
 			return err;
 
+		proc->hold_file = false;
+
 		count = proc->num_blocks - proc->file_start;
 		start = deduplicate_blocks(proc, count);
 		offset = proc->blocks[start].offset;
@@ -150,20 +320,24 @@ int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 		offset = start + count;
 		if (offset >= proc->file_start) {
 			count = proc->num_blocks - offset;
-			proc->num_blocks = offset;
+			drop_block_locations(proc, offset);
 		} else {
-			proc->num_blocks = proc->file_start;
+			drop_block_locations(proc, proc->file_start);
 		}
 
+		bytes = output_size(proc) - proc->start;
+
+		proc->blocks_written -= count;
+		proc->bytes_written -= bytes;
+		proc->duplicate_blocks += count;
+
 		if (proc->hooks != NULL &&
 		    proc->hooks->notify_blocks_erased != NULL) {
-			bytes = proc->file->get_size(proc->file) - proc->start;
-
 			proc->hooks->notify_blocks_erased(proc->user_ptr,
 							  count, bytes);
 		}
 
-		err = proc->file->truncate(proc->file, proc->start);
+		err = truncate_output(proc, proc->start);
 		if (err)
 			return err;
 	}
@@ -18,111 +18,286 @@ void free_blk_list(sqfs_block_t *list)
 	}
 }
 
+void data_writer_trace(sqfs_data_writer_t *proc, int event,
+		       unsigned int thread, sqfs_u64 timestamp, sqfs_u64 arg)
+{
+	if (proc->hooks == NULL || proc->hooks->trace_event == NULL)
+		return;
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_lock(&proc->trace_mtx);
+#endif
+	proc->hooks->trace_event(proc->user_ptr, event, thread,
+				 timestamp, arg);
+#ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&proc->trace_mtx);
+#endif
+}
+
+static void pool_lock(sqfs_data_writer_t *proc)
+{
+#ifdef WITH_PTHREAD
+	pthread_mutex_lock(&proc->pool_mtx);
+#else
+	(void)proc;
+#endif
+}
+
+static void pool_unlock(sqfs_data_writer_t *proc)
+{
+#ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&proc->pool_mtx);
+#else
+	(void)proc;
+#endif
+}
+
+sqfs_block_t *data_writer_alloc_block(sqfs_data_writer_t *proc)
+{
+	sqfs_block_t *blk;
+
+	pool_lock(proc);
+	blk = proc->pool;
+
+	if (blk != NULL) {
+		proc->pool = blk->next;
+		proc->pool_free -= 1;
+		pool_unlock(proc);
+
+		memset(blk, 0, sizeof(*blk));
+		return blk;
+	}
+
+	proc->pool_total += 1;
+	if (proc->pool_total > proc->pool_peak)
+		proc->pool_peak = proc->pool_total;
+	pool_unlock(proc);
+
+	blk = alloc_flex(sizeof(*blk), 1, proc->max_block_size);
+	if (blk == NULL) {
+		pool_lock(proc);
+		proc->pool_total -= 1;
+		pool_unlock(proc);
+	}
+
+	return blk;
+}
+
+void data_writer_release_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
+{
+	if (blk == NULL)
+		return;
+
+	pool_lock(proc);
+	if (proc->pool_free >= proc->pool_max_free) {
+		proc->pool_total -= 1;
+		pool_unlock(proc);
+		free(blk);
+		return;
+	}
+
+	blk->next = proc->pool;
+	proc->pool = blk;
+	proc->pool_free += 1;
+	pool_unlock(proc);
+}
+
+/* Can have at most max_backlog + 1 blocks in flight. Round up to a
+   power of two so the sequence number can simply be masked. */
+static size_t done_ring_size(size_t max_backlog)
+{
+	size_t i;
+
+	for (i = 1; i <= max_backlog; i <<= 1) {
+		if (i > (~((size_t)0) >> 1))
+			return 0;
+	}
+
+	return i;
+}
+
+/* replaces the done ring and the time stamps, which must be empty */
+static int alloc_done_ring(sqfs_data_writer_t *proc, size_t count)
+{
+	sqfs_block_t **done;
+#ifdef WITH_PTHREAD
+	blk_time_t *times;
+#endif
+
+	done = alloc_array(sizeof(done[0]), count);
+	if (done == NULL)
+		return SQFS_ERROR_ALLOC;
+
+#ifdef WITH_PTHREAD
+	times = alloc_array(sizeof(times[0]), count);
+	if (times == NULL) {
+		free(done);
+		return SQFS_ERROR_ALLOC;
+	}
+
+	free(proc->blk_times);
+	proc->blk_times = times;
+#endif
+	free(proc->done);
+	proc->done = done;
+	proc->done_mask = count - 1;
+	return 0;
+}
+
 int data_writer_init(sqfs_data_writer_t *proc, size_t max_block_size,
 		     sqfs_compressor_t *cmp, unsigned int num_workers,
 		     size_t max_backlog, size_t devblksz, sqfs_file_t *file)
 {
+	size_t i;
+
 	proc->max_block_size = max_block_size;
 	proc->num_workers = num_workers;
 	proc->max_backlog = max_backlog;
+	proc->pool_max_free = max_backlog + 2;
 	proc->devblksz = devblksz;
 	proc->cmp = cmp;
+	proc->compressors[0] = cmp;
+	proc->num_compressors = 1;
 	proc->file = file;
 	proc->max_blocks = INIT_BLOCK_COUNT;
 	proc->frag_list_max = INIT_BLOCK_COUNT;
+	proc->wrbuf_size = max_block_size * WRITE_BUFFER_BLOCKS;
+
+	proc->wrbuf = alloc_array(max_block_size, WRITE_BUFFER_BLOCKS);
+	if (proc->wrbuf == NULL)
+		return -1;
 
 	proc->blocks = alloc_array(sizeof(proc->blocks[0]), proc->max_blocks);
 	if (proc->blocks == NULL)
 		return -1;
 
+	proc->blk_buckets = alloc_array(sizeof(proc->blk_buckets[0]),
+					proc->max_blocks);
+	if (proc->blk_buckets == NULL)
+		return -1;
+
+	for (i = 0; i < proc->max_blocks; ++i)
+		proc->blk_buckets[i] = BLK_INFO_NONE;
+
 	proc->frag_list = alloc_array(sizeof(proc->frag_list[0]),
 				      proc->frag_list_max);
 	if (proc->frag_list == NULL)
 		return -1;
 
+	proc->frag_buckets = alloc_array(sizeof(proc->frag_buckets[0]),
+					 proc->frag_list_max);
+	if (proc->frag_buckets == NULL)
+		return -1;
+
+	for (i = 0; i < proc->frag_list_max; ++i)
+		proc->frag_buckets[i] = BLK_INFO_NONE;
+
+	i = done_ring_size(max_backlog);
+	if (i == 0 || alloc_done_ring(proc, i) != 0)
+		return -1;
+
 	return 0;
 }
 
 void data_writer_cleanup(sqfs_data_writer_t *proc)
 {
-	free_blk_list(proc->queue);
-	free_blk_list(proc->done);
+	size_t i;
+
+	if (proc->done != NULL) {
+		for (i = 0; i <= proc->done_mask; ++i)
+			free(proc->done[i]);
+	}
+
+	free_blk_list(proc->pool);
+#ifdef WITH_PTHREAD
+	free(proc->blk_times);
+#endif
+	free(proc->done);
 	free(proc->blk_current);
 	free(proc->frag_block);
+	free(proc->frag_buckets);
 	free(proc->frag_list);
 	free(proc->fragments);
+	free(proc->blk_buckets);
 	free(proc->blocks);
+	free(proc->wrbuf);
 	free(proc);
 }
 
 void data_writer_store_done(sqfs_data_writer_t *proc, sqfs_block_t *blk,
 			    int status)
 {
-	sqfs_block_t *it = proc->done, *prev = NULL;
-
-	while (it != NULL) {
-		if (it->sequence_number >= blk->sequence_number)
-			break;
-		prev = it;
-		it = it->next;
-	}
-
-	if (prev == NULL) {
-		blk->next = proc->done;
-		proc->done = blk;
-	} else {
-		blk->next = prev->next;
-		prev->next = blk;
-	}
+	proc->done[blk->sequence_number & proc->done_mask] = blk;
 
 	if (status != 0 && proc->status == 0)
 		proc->status = status;
-
-	proc->backlog -= 1;
 }
 
-sqfs_block_t *data_writer_next_work_item(sqfs_data_writer_t *proc)
+/*
+  Estimate the second order (Renyi) entropy of the byte values in a sample of
+  the block. For uniformly distributed bytes the sum of the squared histogram
+  counts is about n^2 / 256. If it is within 25% of that, the block most likely
+  contains already compressed or encrypted data.
+ */
+static bool is_incompressible(const sqfs_u8 *data, size_t size)
 {
-	sqfs_block_t *blk;
+	size_t i, j, stride, count = 0;
+	sqfs_u32 histogram[256];
+	sqfs_u64 sum = 0;
 
-	if (proc->status != 0)
-		return NULL;
+	if (size < ENTROPY_SAMPLE_COUNT * ENTROPY_SAMPLE_SIZE)
+		return false;
 
-	blk = proc->queue;
-	proc->queue = blk->next;
-	blk->next = NULL;
+	memset(histogram, 0, sizeof(histogram));
+	stride = size / ENTROPY_SAMPLE_COUNT;
 
-	if (proc->queue == NULL)
-		proc->queue_last = NULL;
+	for (i = 0; i < ENTROPY_SAMPLE_COUNT; ++i) {
+		for (j = 0; j < ENTROPY_SAMPLE_SIZE; ++j)
+			histogram[data[i * stride + j]] += 1;
 
-	return blk;
+		count += ENTROPY_SAMPLE_SIZE;
+	}
+
+	for (i = 0; i < 256; ++i)
+		sum += (sqfs_u64)histogram[i] * histogram[i];
+
+	return sum * 256 * 4 < (sqfs_u64)count * count * 5;
 }
 
-int data_writer_do_block(sqfs_block_t *block, sqfs_compressor_t *cmp,
-			 sqfs_u8 *scratch, size_t scratch_size)
+int data_writer_do_block(sqfs_block_t **block, sqfs_compressor_t *cmp,
+			 sqfs_block_t **scratch, size_t scratch_size)
 {
+	sqfs_block_t *blk = *block, *out = *scratch;
 	ssize_t ret;
 
-	if (block->size == 0) {
-		block->checksum = 0;
+	if (blk->size == 0) {
+		blk->checksum = 0;
 		return 0;
 	}
 
-	block->checksum = crc32(0, block->data, block->size);
+	blk->checksum = crc32(0, blk->data, blk->size);
 
-	if (block->flags & SQFS_BLK_IS_FRAGMENT)
+	if (blk->flags & SQFS_BLK_IS_FRAGMENT)
 		return 0;
 
-	if (!(block->flags & SQFS_BLK_DONT_COMPRESS)) {
-		ret = cmp->do_block(cmp, block->data, block->size,
-				    scratch, scratch_size);
+	if ((blk->flags & SQFS_BLK_ESTIMATE_ENTROPY) &&
+	    is_incompressible(blk->data, blk->size)) {
+		blk->flags |= SQFS_BLK_DONT_COMPRESS;
+	}
+
+	if (!(blk->flags & SQFS_BLK_DONT_COMPRESS)) {
+		ret = cmp->do_block(cmp, blk->data, blk->size,
+				    out->data, scratch_size);
 		if (ret < 0)
 			return ret;
 
 		if (ret > 0) {
-			memcpy(block->data, scratch, ret);
-			block->size = ret;
-			block->flags |= SQFS_BLK_IS_COMPRESSED;
+			memcpy(out, blk, offsetof(sqfs_block_t, data));
+			out->size = ret;
+			out->flags |= SQFS_BLK_IS_COMPRESSED;
+
+			*scratch = blk;
+			*block = out;
 		}
 	}
 
@@ -157,13 +332,162 @@ int sqfs_data_writer_write_fragment_table(sqfs_data_writer_t *proc,
 	return 0;
 }
 
+/* a done ring slot and, with threads, the time stamps of the block */
+static size_t ring_entry_size(void)
+{
+#ifdef WITH_PTHREAD
+	return sizeof(sqfs_block_t *) + sizeof(blk_time_t);
+#else
+	return sizeof(sqfs_block_t *);
+#endif
+}
+
+static size_t fixed_memory(const sqfs_data_writer_t *proc)
+{
+	return proc->wrbuf_size + ring_entry_size() * (proc->done_mask + 1);
+}
+
+static size_t buffer_size(const sqfs_data_writer_t *proc)
+{
+	return sizeof(sqfs_block_t) + proc->max_block_size;
+}
+
+int sqfs_data_writer_set_memory_limit(sqfs_data_writer_t *proc, size_t limit)
+{
+	unsigned int workers = proc->num_workers ? proc->num_workers : 1;
+	size_t count, fixed, ring = 0;
+	int ret = 0;
+
+	/* the done ring can only be replaced while it is empty */
+	if (proc->enqueue_id != 0)
+		return SQFS_ERROR_INTERNAL;
+
+	/* a scratch block per worker, the current block, the fragment
+	   block, one spare for a fragment block being flushed and the
+	   tail end that is released after it has been moved into one */
+	fixed = proc->wrbuf_size + (workers + 4) * buffer_size(proc);
+
+	if (limit <= fixed)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	/* In flight is compared with '>', so max_backlog + 1 blocks can
+	   exist. The done ring needs a slot for each of them, which comes
+	   out of the same budget. */
+	for (count = (limit - fixed) / buffer_size(proc); count > workers;
+	     --count) {
+		ring = done_ring_size(count - 1);
+
+		if (ring != 0 && ring * ring_entry_size() <=
+		    limit - fixed - count * buffer_size(proc)) {
+			break;
+		}
+	}
+
+	if (count <= workers)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_lock(&proc->mtx);
+#endif
+	if (ring != proc->done_mask + 1)
+		ret = alloc_done_ring(proc, ring);
+
+	if (ret == 0) {
+		proc->max_backlog = count - 1;
+		proc->pool_max_free = proc->max_backlog + 2;
+	}
+#ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&proc->mtx);
+#endif
+	return ret;
+}
+
+int sqfs_data_writer_get_stats(const sqfs_data_writer_t *proc,
+			       sqfs_data_writer_stats_t *stats)
+{
+#ifdef WITH_PTHREAD
+	compress_worker_t *worker;
+	unsigned int i;
+#endif
+
+	if (stats->size != sizeof(*stats))
+		return SQFS_ERROR_UNSUPPORTED;
+
+	stats->max_block_buffers = proc->pool_peak;
+	stats->sparse_blocks = proc->sparse_blocks;
+	stats->incompressible_blocks = proc->incompressible_blocks;
+	stats->blocks_written = proc->blocks_written;
+	stats->frag_blocks_written = proc->frag_blocks_written;
+	stats->duplicate_blocks = proc->duplicate_blocks;
+	stats->fragments_stored = proc->frags_stored;
+	stats->fragments_discarded = proc->frags_discarded;
+	stats->bytes_written = proc->bytes_written;
+	stats->peak_memory = fixed_memory(proc) +
+		proc->pool_peak * buffer_size(proc);
+	stats->blocks_processed = proc->blocks_processed;
+	stats->wait_time = proc->wait_time;
+	stats->compress_time = proc->compress_time;
+	stats->queue_time = proc->queue_time;
+	stats->reorder_time = proc->reorder_time;
+	stats->write_time = proc->write_time;
+#ifdef WITH_PTHREAD
+	stats->max_worker_time = 0;
+
+	for (i = 0; i < proc->num_workers; ++i) {
+		worker = proc->workers[i];
+
+		pthread_mutex_lock(&worker->mtx);
+		stats->blocks_processed += worker->blocks_processed;
+		stats->compress_time += worker->busy_time;
+		stats->queue_time += worker->queue_time;
+
+		if (worker->busy_time > stats->max_worker_time)
+			stats->max_worker_time = worker->busy_time;
+		pthread_mutex_unlock(&worker->mtx);
+	}
+#else
+	stats->max_worker_time = proc->compress_time;
+#endif
+	return 0;
+}
+
+int sqfs_data_writer_set_dedup_buffer(sqfs_data_writer_t *proc, size_t size)
+{
+	size_t total;
+	void *new;
+
+	if (SZ_MUL_OV(proc->max_block_size, WRITE_BUFFER_BLOCKS, &total) ||
+	    SZ_ADD_OV(total, size, &total)) {
+		return SQFS_ERROR_OVERFLOW;
+	}
+
+	new = realloc(proc->wrbuf, total);
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	proc->wrbuf = new;
+	proc->wrbuf_size = total;
+	proc->dedup_max = size;
+	return 0;
+}
+
 int sqfs_data_writer_set_hooks(sqfs_data_writer_t *proc, void *user_ptr,
 			       const sqfs_block_hooks_t *hooks)
 {
-	if (hooks->size != sizeof(*hooks))
+	size_t size = hooks->size;
+
+	/* the struct before trace_event was added is still accepted */
+	if (size < offsetof(sqfs_block_hooks_t, trace_event))
 		return SQFS_ERROR_UNSUPPORTED;
 
-	proc->hooks = hooks;
+	if (size > sizeof(proc->hooks_copy))
+		size = sizeof(proc->hooks_copy);
+
+	memset(&proc->hooks_copy, 0, sizeof(proc->hooks_copy));
+	memcpy(&proc->hooks_copy, hooks, size);
+	proc->hooks_copy.size = sizeof(proc->hooks_copy);
+
+	proc->hooks = &proc->hooks_copy;
 	proc->user_ptr = user_ptr;
 	return 0;
 }
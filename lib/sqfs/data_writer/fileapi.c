@@ -14,7 +14,7 @@ static bool is_zero_block(unsigned char *ptr, size_t size)
 
 static int add_sentinel_block(sqfs_data_writer_t *proc)
 {
-	sqfs_block_t *blk = calloc(1, sizeof(*blk));
+	sqfs_block_t *blk = data_writer_alloc_block(proc);
 
 	if (blk == NULL)
 		return test_and_set_status(proc, SQFS_ERROR_ALLOC);
@@ -34,6 +34,13 @@ int sqfs_data_writer_begin_file(sqfs_data_writer_t *proc,
 	if (flags & ~SQFS_BLK_USER_SETTABLE_FLAGS)
 		return test_and_set_status(proc, SQFS_ERROR_UNSUPPORTED);
 
+	if (SQFS_BLK_GET_COMPRESSOR(flags) >= proc->num_compressors)
+		return test_and_set_status(proc, SQFS_ERROR_UNSUPPORTED);
+
+	/* pointless to estimate if we don't compress anyway */
+	if (flags & SQFS_BLK_DONT_COMPRESS)
+		flags &= ~SQFS_BLK_ESTIMATE_ENTROPY;
+
 	proc->inode = inode;
 	proc->blk_flags = flags | SQFS_BLK_FIRST_BLOCK;
 	proc->blk_index = 0;
@@ -41,21 +48,27 @@ int sqfs_data_writer_begin_file(sqfs_data_writer_t *proc,
 	return 0;
 }
 
-static int flush_block(sqfs_data_writer_t *proc, sqfs_block_t *block)
+static void add_sparse_block(sqfs_data_writer_t *proc, size_t size)
 {
-	block->index = proc->blk_index++;
-	block->flags = proc->blk_flags;
-	block->inode = proc->inode;
+	sqfs_inode_make_extended(proc->inode);
+	proc->inode->data.file_ext.sparse += size;
+	proc->inode->num_file_blocks += 1;
+	proc->inode->block_sizes[proc->blk_index++] = 0;
+	proc->sparse_blocks += 1;
+}
 
+static int flush_block(sqfs_data_writer_t *proc, sqfs_block_t *block)
+{
 	if (is_zero_block(block->data, block->size)) {
-		sqfs_inode_make_extended(proc->inode);
-		proc->inode->data.file_ext.sparse += block->size;
-		proc->inode->num_file_blocks += 1;
-		proc->inode->block_sizes[block->index] = 0;
-		free(block);
+		add_sparse_block(proc, block->size);
+		data_writer_release_block(proc, block);
 		return 0;
 	}
 
+	block->index = proc->blk_index++;
+	block->flags = proc->blk_flags;
+	block->inode = proc->inode;
+
 	if (block->size < proc->max_block_size &&
 	    !(block->flags & SQFS_BLK_DONT_FRAGMENT)) {
 		block->flags |= SQFS_BLK_IS_FRAGMENT;
@@ -67,51 +80,106 @@ static int flush_block(sqfs_data_writer_t *proc, sqfs_block_t *block)
 	return data_writer_enqueue(proc, block);
 }
 
+int sqfs_data_writer_reserve(sqfs_data_writer_t *proc, void **ptr,
+			     size_t *size)
+{
+	if (proc->inode == NULL)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+
+	if (proc->blk_current == NULL) {
+		proc->blk_current = data_writer_alloc_block(proc);
+
+		if (proc->blk_current == NULL)
+			return test_and_set_status(proc, SQFS_ERROR_ALLOC);
+	}
+
+	*ptr = proc->blk_current->data + proc->blk_current->size;
+	*size = proc->max_block_size - proc->blk_current->size;
+	return 0;
+}
+
+int sqfs_data_writer_commit(sqfs_data_writer_t *proc, size_t size)
+{
+	int err;
+
+	if (size == 0)
+		return 0;
+
+	if (proc->blk_current == NULL)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+
+	if (size > proc->max_block_size - proc->blk_current->size)
+		return test_and_set_status(proc, SQFS_ERROR_OUT_OF_BOUNDS);
+
+	proc->blk_current->size += size;
+
+	if (proc->blk_current->size == proc->max_block_size) {
+		err = flush_block(proc, proc->blk_current);
+		proc->blk_current = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
 int sqfs_data_writer_append(sqfs_data_writer_t *proc, const void *data,
 			    size_t size)
 {
 	size_t diff;
-	void *new;
+	void *ptr;
 	int err;
 
 	while (size > 0) {
-		if (proc->blk_current == NULL) {
-			new = alloc_flex(sizeof(*proc->blk_current), 1,
-					 proc->max_block_size);
+		err = sqfs_data_writer_reserve(proc, &ptr, &diff);
+		if (err)
+			return err;
+
+		if (diff > size)
+			diff = size;
 
-			if (new == NULL)
-				return test_and_set_status(proc,
-							   SQFS_ERROR_ALLOC);
+		memcpy(ptr, data, diff);
 
-			proc->blk_current = new;
-		}
+		err = sqfs_data_writer_commit(proc, diff);
+		if (err)
+			return err;
+
+		size -= diff;
+		data = (const char *)data + diff;
+	}
+
+	return 0;
+}
+
+int sqfs_data_writer_append_sparse(sqfs_data_writer_t *proc, sqfs_u64 size)
+{
+	size_t diff;
+	void *ptr;
+	int err;
 
-		diff = proc->max_block_size - proc->blk_current->size;
+	if (proc->inode == NULL)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
 
-		if (diff == 0) {
-			err = flush_block(proc, proc->blk_current);
-			proc->blk_current = NULL;
-			if (err)
-				return err;
+	while (size > 0) {
+		if (proc->blk_current == NULL && size >= proc->max_block_size) {
+			add_sparse_block(proc, proc->max_block_size);
+			size -= proc->max_block_size;
 			continue;
 		}
 
+		err = sqfs_data_writer_reserve(proc, &ptr, &diff);
+		if (err)
+			return err;
+
 		if (diff > size)
 			diff = size;
 
-		memcpy(proc->blk_current->data + proc->blk_current->size,
-		       data, diff);
+		memset(ptr, 0, diff);
 
-		size -= diff;
-		proc->blk_current->size += diff;
-		data = (const char *)data + diff;
-	}
+		err = sqfs_data_writer_commit(proc, diff);
+		if (err)
+			return err;
 
-	if (proc->blk_current != NULL &&
-	    proc->blk_current->size == proc->max_block_size) {
-		err = flush_block(proc, proc->blk_current);
-		proc->blk_current = NULL;
-		return err;
+		size -= diff;
 	}
 
 	return 0;
@@ -124,15 +192,31 @@ int sqfs_data_writer_end_file(sqfs_data_writer_t *proc)
 	if (proc->inode == NULL)
 		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
 
-	if (!(proc->blk_flags & SQFS_BLK_FIRST_BLOCK)) {
-		if (proc->blk_current != NULL &&
-		    (proc->blk_flags & SQFS_BLK_DONT_FRAGMENT)) {
-			proc->blk_flags |= SQFS_BLK_LAST_BLOCK;
-		} else {
-			err = add_sentinel_block(proc);
-			if (err)
-				return err;
-		}
+	if (proc->blk_current != NULL && proc->blk_current->size == 0) {
+		data_writer_release_block(proc, proc->blk_current);
+		proc->blk_current = NULL;
+	}
+
+	/* A tail end of zeros is stored as a sparse block and never
+	   submitted, so it cannot carry the last block flag. The inode must
+	   also be complete before the last block is submitted, the writer
+	   thread may already be working on it while we are still here. */
+	if (proc->blk_current != NULL &&
+	    is_zero_block(proc->blk_current->data, proc->blk_current->size)) {
+		add_sparse_block(proc, proc->blk_current->size);
+		data_writer_release_block(proc, proc->blk_current);
+		proc->blk_current = NULL;
+	}
+
+	/* A tail end that is not turned into a fragment is the last block,
+	   even if it is the only block of the file. */
+	if (proc->blk_current != NULL &&
+	    (proc->blk_flags & SQFS_BLK_DONT_FRAGMENT)) {
+		proc->blk_flags |= SQFS_BLK_LAST_BLOCK;
+	} else if (!(proc->blk_flags & SQFS_BLK_FIRST_BLOCK)) {
+		err = add_sentinel_block(proc);
+		if (err)
+			return err;
 	}
 
 	if (proc->blk_current != NULL) {
@@ -28,6 +28,21 @@ static int grow_fragment_table(sqfs_data_writer_t *proc)
 	return 0;
 }
 
+static void rehash_fragments(sqfs_data_writer_t *proc)
+{
+	size_t i, idx;
+
+	for (i = 0; i < proc->frag_list_max; ++i)
+		proc->frag_buckets[i] = BLK_INFO_NONE;
+
+	for (i = 0; i < proc->frag_list_num; ++i) {
+		idx = proc->frag_list[i].hash % proc->frag_list_max;
+
+		proc->frag_list[i].next = proc->frag_buckets[idx];
+		proc->frag_buckets[idx] = i;
+	}
+}
+
 static int grow_deduplication_list(sqfs_data_writer_t *proc)
 {
 	size_t new_sz;
@@ -42,23 +57,47 @@ static int grow_deduplication_list(sqfs_data_writer_t *proc)
 			return SQFS_ERROR_ALLOC;
 
 		proc->frag_list = new;
+
+		new = realloc(proc->frag_buckets,
+			      sizeof(proc->frag_buckets[0]) * new_sz);
+
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		proc->frag_buckets = new;
 		proc->frag_list_max = new_sz;
+		rehash_fragments(proc);
 	}
 
 	return 0;
 }
 
+static size_t find_fragment(sqfs_data_writer_t *proc, sqfs_u64 hash)
+{
+	size_t i = proc->frag_buckets[hash % proc->frag_list_max];
+
+	while (i != BLK_INFO_NONE && proc->frag_list[i].hash != hash)
+		i = proc->frag_list[i].next;
+
+	return i;
+}
+
 static int store_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
 			  sqfs_u64 hash)
 {
 	int err = grow_deduplication_list(proc);
+	size_t idx;
 
 	if (err)
 		return err;
 
+	idx = hash % proc->frag_list_max;
+
 	proc->frag_list[proc->frag_list_num].index = proc->frag_block->index;
 	proc->frag_list[proc->frag_list_num].offset = proc->frag_block->size;
 	proc->frag_list[proc->frag_list_num].hash = hash;
+	proc->frag_list[proc->frag_list_num].next = proc->frag_buckets[idx];
+	proc->frag_buckets[idx] = proc->frag_list_num;
 	proc->frag_list_num += 1;
 
 	sqfs_inode_set_frag_location(frag->inode, proc->frag_block->index,
@@ -73,6 +112,7 @@ static int store_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
 
 	proc->frag_block->flags |= (frag->flags & SQFS_BLK_DONT_COMPRESS);
 	proc->frag_block->size += frag->size;
+	proc->frags_stored += 1;
 	return 0;
 }
 
@@ -85,10 +125,9 @@ int process_completed_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
 
 	hash = MK_BLK_HASH(frag->checksum, frag->size);
 
-	for (i = 0; i < proc->frag_list_num; ++i) {
-		if (proc->frag_list[i].hash == hash)
-			goto out_duplicate;
-	}
+	i = find_fragment(proc, hash);
+	if (i != BLK_INFO_NONE)
+		goto out_duplicate;
 
 	if (proc->frag_block != NULL) {
 		size = proc->frag_block->size + frag->size;
@@ -100,13 +139,11 @@ int process_completed_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
 	}
 
 	if (proc->frag_block == NULL) {
-		size = sizeof(sqfs_block_t) + proc->max_block_size;
-
 		err = grow_fragment_table(proc);
 		if (err)
 			goto fail;
 
-		proc->frag_block = calloc(1, size);
+		proc->frag_block = data_writer_alloc_block(proc);
 		if (proc->frag_block == NULL) {
 			err = SQFS_ERROR_ALLOC;
 			goto fail;
@@ -122,13 +159,15 @@ int process_completed_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
 
 	return 0;
 fail:
-	free(*blk_out);
+	data_writer_release_block(proc, *blk_out);
 	*blk_out = NULL;
 	return err;
 out_duplicate:
 	sqfs_inode_set_frag_location(frag->inode, proc->frag_list[i].index,
 				     proc->frag_list[i].offset);
 
+	proc->frags_discarded += 1;
+
 	if (proc->hooks != NULL &&
 	    proc->hooks->notify_fragment_discard != NULL) {
 		proc->hooks->notify_fragment_discard(proc->user_ptr, frag);
@@ -18,6 +18,7 @@
 #include "sqfs/io.h"
 #include "util/util.h"
 
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <zlib.h>
@@ -32,25 +33,76 @@
 
 #define INIT_BLOCK_COUNT (128)
 
+#define BLK_INFO_NONE (~((size_t)0))
+
+/* Number and size of the chunks sampled for the entropy estimate. */
+#define ENTROPY_SAMPLE_COUNT (64)
+#define ENTROPY_SAMPLE_SIZE (64)
+
+/* Size of the output buffer that coalesces block writes, in blocks. */
+#define WRITE_BUFFER_BLOCKS (8)
+
+/* Thread numbers reported to the trace_event hook. */
+#define TRACE_THREAD_MAIN (0)
+#ifdef WITH_PTHREAD
+#define TRACE_THREAD_WRITER (1)
+#else
+#define TRACE_THREAD_WRITER TRACE_THREAD_MAIN
+#endif
+#define TRACE_THREAD_WORKER(idx) (2 + (idx))
+
 
 typedef struct {
 	sqfs_u64 offset;
 	sqfs_u64 hash;
+
+	/* next entry in the same hash bucket, BLK_INFO_NONE terminated */
+	size_t next;
 } blk_info_t;
 
 typedef struct {
 	sqfs_u32 index;
 	sqfs_u32 offset;
 	sqfs_u64 hash;
+
+	/* next entry in the same hash bucket, BLK_INFO_NONE terminated */
+	size_t next;
 } frag_info_t;
 
 
 #ifdef WITH_PTHREAD
+typedef struct {
+	sqfs_u64 enqueued;
+	sqfs_u64 done;
+} blk_time_t;
+
 typedef struct {
 	sqfs_data_writer_t *shared;
-	sqfs_compressor_t *cmp;
 	pthread_t thread;
-	sqfs_u8 scratch[];
+	unsigned int index;
+
+	/* per worker submission queue, other workers may steal from it */
+	pthread_mutex_t mtx;
+	pthread_cond_t queue_cond;
+	sqfs_block_t *queue;
+	sqfs_block_t *queue_last;
+	bool quit;
+
+	/* set before looking for work to steal, cleared by whoever wakes
+	   the worker up because a queue got another block */
+	bool idle;
+
+	/* private copies of the data writer's compressors */
+	sqfs_compressor_t *cmp[SQFS_MAX_DATA_COMPRESSORS];
+
+	/* swapped with the block being processed if compression succeeds */
+	sqfs_block_t *scratch;
+
+	/* stage timing of the blocks compressed by this worker, protected by
+	   the worker mutex and summed up by sqfs_data_writer_get_stats */
+	sqfs_u64 busy_time;
+	sqfs_u64 queue_time;
+	size_t blocks_processed;
 } compress_worker_t;
 #endif
 
@@ -58,22 +110,33 @@ struct sqfs_data_writer_t {
 	/* synchronization primitives */
 #ifdef WITH_PTHREAD
 	pthread_mutex_t mtx;
-	pthread_cond_t queue_cond;
 	pthread_cond_t done_cond;
+	pthread_cond_t space_cond;
+	pthread_mutex_t pool_mtx;
+	pthread_mutex_t trace_mtx;
+
+	/* takes completed blocks off the done queue and writes them out */
+	pthread_t writer;
+	bool writer_started;
+	bool writer_quit;
+
+	/* time stamps of the blocks in flight, indexed like the done queue */
+	blk_time_t *blk_times;
 #endif
 
 	/* needs rw access by worker and main thread */
-	sqfs_block_t *queue;
-	sqfs_block_t *queue_last;
-
-	sqfs_block_t *done;
-	size_t backlog;
+	/* ring buffer of completed blocks, indexed by sequence number */
+	sqfs_block_t **done;
+	size_t done_mask;
 	int status;
 
-	/* used by main thread only */
+	/* enqueue side by the main thread, dequeue side by the writer */
 	sqfs_u32 enqueue_id;
 	sqfs_u32 dequeue_id;
 
+	/* everything before this has been written out by the writer thread */
+	sqfs_u32 written_id;
+
 	unsigned int num_workers;
 	size_t max_backlog;
 
@@ -90,21 +153,68 @@ struct sqfs_data_writer_t {
 	size_t num_blocks;
 	size_t max_blocks;
 	blk_info_t *blocks;
+
+	/* hash index into blocks, has max_blocks entries */
+	size_t *blk_buckets;
 	sqfs_compressor_t *cmp;
 
+	/* selected via block flags, the first entry is the default cmp */
+	sqfs_compressor_t *compressors[SQFS_MAX_DATA_COMPRESSORS];
+	unsigned int num_compressors;
+
 	sqfs_block_t *frag_block;
 	frag_info_t *frag_list;
 	size_t frag_list_num;
 	size_t frag_list_max;
 
+	/* hash index into frag_list, has frag_list_max entries */
+	size_t *frag_buckets;
+
+	/* points to hooks_copy once hooks are set, NULL otherwise */
 	const sqfs_block_hooks_t *hooks;
+	sqfs_block_hooks_t hooks_copy;
 	void *user_ptr;
 
+	/* consecutive block writes are collected here */
+	sqfs_u8 *wrbuf;
+	size_t wrbuf_used;
+	size_t wrbuf_size;
+
+	/* how much of the current file may be held back in wrbuf */
+	size_t dedup_max;
+	bool hold_file;
+
+	/* recycled block buffers, shared by the main and the writer thread */
+	sqfs_block_t *pool;
+	size_t pool_free;
+	size_t pool_max_free;
+	size_t pool_total;
+	size_t pool_peak;
+
 	/* file API */
 	sqfs_inode_generic_t *inode;
 	sqfs_block_t *blk_current;
 	sqfs_u32 blk_flags;
 	size_t blk_index;
+	size_t sparse_blocks;
+
+	/* statistics, updated by whoever processes the completed blocks */
+	size_t incompressible_blocks;
+	size_t blocks_written;
+	size_t frag_blocks_written;
+	size_t duplicate_blocks;
+	size_t frags_stored;
+	size_t frags_discarded;
+	sqfs_u64 bytes_written;
+
+	/* stage timing in nanoseconds, see sqfs_data_writer_stats_t. With
+	   threads, the compression side is counted per worker instead. */
+	size_t blocks_processed;
+	sqfs_u64 wait_time;
+	sqfs_u64 compress_time;
+	sqfs_u64 queue_time;
+	sqfs_u64 reorder_time;
+	sqfs_u64 write_time;
 
 	/* used only by workers */
 	size_t max_block_size;
@@ -112,7 +222,7 @@ struct sqfs_data_writer_t {
 #ifdef WITH_PTHREAD
 	compress_worker_t *workers[];
 #else
-	sqfs_u8 scratch[];
+	sqfs_block_t *scratch;
 #endif
 };
 
@@ -123,8 +233,19 @@ SQFS_INTERNAL
 int process_completed_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
 			       sqfs_block_t **blk_out);
 
+SQFS_INTERNAL int data_writer_flush_output(sqfs_data_writer_t *proc);
+
 SQFS_INTERNAL void free_blk_list(sqfs_block_t *list);
 
+SQFS_INTERNAL
+void data_writer_trace(sqfs_data_writer_t *proc, int event,
+		       unsigned int thread, sqfs_u64 timestamp, sqfs_u64 arg);
+
+SQFS_INTERNAL sqfs_block_t *data_writer_alloc_block(sqfs_data_writer_t *proc);
+
+SQFS_INTERNAL
+void data_writer_release_block(sqfs_data_writer_t *proc, sqfs_block_t *blk);
+
 SQFS_INTERNAL
 int data_writer_init(sqfs_data_writer_t *proc, size_t max_block_size,
 		     sqfs_compressor_t *cmp, unsigned int num_workers,
@@ -137,11 +258,8 @@ void data_writer_store_done(sqfs_data_writer_t *proc, sqfs_block_t *blk,
 			    int status);
 
 SQFS_INTERNAL
-sqfs_block_t *data_writer_next_work_item(sqfs_data_writer_t *proc);
-
-SQFS_INTERNAL
-int data_writer_do_block(sqfs_block_t *block, sqfs_compressor_t *cmp,
-			 sqfs_u8 *scratch, size_t scratch_size);
+int data_writer_do_block(sqfs_block_t **block, sqfs_compressor_t *cmp,
+			 sqfs_block_t **scratch, size_t scratch_size);
 
 SQFS_INTERNAL
 int test_and_set_status(sqfs_data_writer_t *proc, int status);
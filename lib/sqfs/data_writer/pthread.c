@@ -7,36 +7,173 @@
 #define SQFS_BUILDING_DLL
 #include "internal.h"
 
-static void *worker_proc(void *arg)
+static sqfs_block_t *pop_work_item(compress_worker_t *worker)
+{
+	sqfs_block_t *blk = worker->queue;
+
+	if (blk != NULL) {
+		worker->queue = blk->next;
+		blk->next = NULL;
+
+		if (worker->queue == NULL)
+			worker->queue_last = NULL;
+	}
+
+	return blk;
+}
+
+static sqfs_block_t *steal_work_item(compress_worker_t *worker)
 {
-	compress_worker_t *worker = arg;
 	sqfs_data_writer_t *shared = worker->shared;
+	compress_worker_t *victim;
 	sqfs_block_t *blk = NULL;
-	int status = 0;
+	unsigned int i;
+
+	for (i = 1; i < shared->num_workers && blk == NULL; ++i) {
+		victim = shared->workers[(worker->index + i) %
+					 shared->num_workers];
+
+		/* a worker never holds more than its own mutex or the one
+		   of its victim, so this cannot dead lock */
+		pthread_mutex_lock(&victim->mtx);
+		blk = pop_work_item(victim);
+		pthread_mutex_unlock(&victim->mtx);
+	}
+
+	return blk;
+}
+
+/* called and returns with the worker mutex held */
+static sqfs_block_t *next_work_item(compress_worker_t *worker)
+{
+	sqfs_block_t *blk = NULL;
+
+	while (!worker->quit) {
+		blk = pop_work_item(worker);
+		if (blk != NULL)
+			break;
+
+		/* A block added to another queue after we looked at it is
+		   seen by wake_idle_worker, which then clears the flag */
+		worker->idle = true;
+		pthread_mutex_unlock(&worker->mtx);
+		blk = steal_work_item(worker);
+		pthread_mutex_lock(&worker->mtx);
 
-	for (;;) {
-		pthread_mutex_lock(&shared->mtx);
 		if (blk != NULL) {
-			data_writer_store_done(shared, blk, status);
-			pthread_cond_broadcast(&shared->done_cond);
+			worker->idle = false;
+			break;
 		}
 
-		while (shared->queue == NULL && shared->status == 0)
-			pthread_cond_wait(&shared->queue_cond, &shared->mtx);
+		while (worker->idle && worker->queue == NULL && !worker->quit)
+			pthread_cond_wait(&worker->queue_cond, &worker->mtx);
 
-		blk = data_writer_next_work_item(shared);
-		pthread_mutex_unlock(&shared->mtx);
+		worker->idle = false;
+	}
+
+	return blk;
+}
+
+static void *worker_proc(void *arg)
+{
+	compress_worker_t *worker = arg;
+	sqfs_data_writer_t *shared = worker->shared;
+	sqfs_u64 start, end, queued;
+	sqfs_compressor_t *cmp;
+	sqfs_block_t *blk;
+	blk_time_t *times;
+	int status;
+
+	pthread_mutex_lock(&worker->mtx);
+	for (;;) {
+		blk = next_work_item(worker);
+		pthread_mutex_unlock(&worker->mtx);
 
 		if (blk == NULL)
 			break;
 
-		status = data_writer_do_block(blk, worker->cmp,
-					      worker->scratch,
+		cmp = worker->cmp[SQFS_BLK_GET_COMPRESSOR(blk->flags)];
+		times = shared->blk_times +
+			(blk->sequence_number & shared->done_mask);
+
+		start = get_time_ns();
+		data_writer_trace(shared, SQFS_TRACE_COMPRESS_BEGIN,
+				  TRACE_THREAD_WORKER(worker->index), start,
+				  blk->sequence_number);
+
+		status = data_writer_do_block(&blk, cmp,
+					      &worker->scratch,
 					      shared->max_block_size);
+
+		end = get_time_ns();
+		data_writer_trace(shared, SQFS_TRACE_COMPRESS_END,
+				  TRACE_THREAD_WORKER(worker->index), end,
+				  blk->sequence_number);
+
+		/* the slot is reused once the block is in the done queue */
+		queued = start - times->enqueued;
+		times->done = end;
+
+		pthread_mutex_lock(&shared->mtx);
+		data_writer_store_done(shared, blk, status);
+		status = shared->status;
+		pthread_cond_signal(&shared->done_cond);
+		pthread_mutex_unlock(&shared->mtx);
+
+		pthread_mutex_lock(&worker->mtx);
+		worker->busy_time += end - start;
+		worker->queue_time += queued;
+		worker->blocks_processed += 1;
+
+		if (status != 0) {
+			pthread_mutex_unlock(&worker->mtx);
+			break;
+		}
 	}
 	return NULL;
 }
 
+static void stop_workers(sqfs_data_writer_t *proc)
+{
+	unsigned int i;
+
+	for (i = 0; i < proc->num_workers; ++i) {
+		if (proc->workers[i] == NULL)
+			continue;
+
+		pthread_mutex_lock(&proc->workers[i]->mtx);
+		proc->workers[i]->quit = true;
+		pthread_cond_signal(&proc->workers[i]->queue_cond);
+		pthread_mutex_unlock(&proc->workers[i]->mtx);
+	}
+}
+
+static void *writer_proc(void *arg);
+
+static void stop_writer(sqfs_data_writer_t *proc)
+{
+	pthread_mutex_lock(&proc->mtx);
+	proc->writer_quit = true;
+	pthread_cond_signal(&proc->done_cond);
+	pthread_mutex_unlock(&proc->mtx);
+}
+
+static void destroy_worker(compress_worker_t *worker)
+{
+	size_t i;
+
+	for (i = 0; i < SQFS_MAX_DATA_COMPRESSORS; ++i) {
+		if (worker->cmp[i] != NULL)
+			worker->cmp[i]->destroy(worker->cmp[i]);
+	}
+
+	free_blk_list(worker->queue);
+	free(worker->scratch);
+	pthread_cond_destroy(&worker->queue_cond);
+	pthread_mutex_destroy(&worker->mtx);
+	free(worker);
+}
+
 sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 					    sqfs_compressor_t *cmp,
 					    unsigned int num_workers,
@@ -44,6 +181,7 @@ sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 					    size_t devblksz,
 					    sqfs_file_t *file)
 {
+	compress_worker_t *worker;
 	sqfs_data_writer_t *proc;
 	unsigned int i;
 	int ret;
@@ -57,8 +195,10 @@ sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 		return NULL;
 
 	proc->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
-	proc->queue_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
 	proc->done_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	proc->space_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	proc->pool_mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	proc->trace_mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
 
 	if (data_writer_init(proc, max_block_size, cmp, num_workers,
 			     max_backlog, devblksz, file)) {
@@ -66,16 +206,22 @@ sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 	}
 
 	for (i = 0; i < num_workers; ++i) {
-		proc->workers[i] = alloc_flex(sizeof(compress_worker_t),
-					      1, max_block_size);
-
-		if (proc->workers[i] == NULL)
+		worker = calloc(1, sizeof(*worker));
+		if (worker == NULL)
 			goto fail_init;
 
-		proc->workers[i]->shared = proc;
-		proc->workers[i]->cmp = cmp->create_copy(cmp);
+		worker->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+		worker->queue_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+		worker->shared = proc;
+		worker->index = i;
+		proc->workers[i] = worker;
 
-		if (proc->workers[i]->cmp == NULL)
+		worker->cmp[0] = cmp->create_copy(cmp);
+		if (worker->cmp[0] == NULL)
+			goto fail_init;
+
+		worker->scratch = data_writer_alloc_block(proc);
+		if (worker->scratch == NULL)
 			goto fail_init;
 	}
 
@@ -87,12 +233,14 @@ sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 			goto fail_thread;
 	}
 
+	ret = pthread_create(&proc->writer, NULL, writer_proc, proc);
+	if (ret != 0)
+		goto fail_thread;
+
+	proc->writer_started = true;
 	return proc;
 fail_thread:
-	pthread_mutex_lock(&proc->mtx);
-	proc->status = -1;
-	pthread_cond_broadcast(&proc->queue_cond);
-	pthread_mutex_unlock(&proc->mtx);
+	stop_workers(proc);
 
 	for (i = 0; i < num_workers; ++i) {
 		if (proc->workers[i]->thread > 0) {
@@ -101,17 +249,13 @@ fail_thread:
 	}
 fail_init:
 	for (i = 0; i < num_workers; ++i) {
-		if (proc->workers[i] != NULL) {
-			if (proc->workers[i]->cmp != NULL) {
-				proc->workers[i]->cmp->
-					destroy(proc->workers[i]->cmp);
-			}
-
-			free(proc->workers[i]);
-		}
+		if (proc->workers[i] != NULL)
+			destroy_worker(proc->workers[i]);
 	}
+	pthread_mutex_destroy(&proc->trace_mtx);
+	pthread_mutex_destroy(&proc->pool_mtx);
+	pthread_cond_destroy(&proc->space_cond);
 	pthread_cond_destroy(&proc->done_cond);
-	pthread_cond_destroy(&proc->queue_cond);
 	pthread_mutex_destroy(&proc->mtx);
 	data_writer_cleanup(proc);
 	return NULL;
@@ -121,96 +265,216 @@ void sqfs_data_writer_destroy(sqfs_data_writer_t *proc)
 {
 	unsigned int i;
 
-	pthread_mutex_lock(&proc->mtx);
-	proc->status = -1;
-	pthread_cond_broadcast(&proc->queue_cond);
-	pthread_mutex_unlock(&proc->mtx);
+	stop_workers(proc);
+	stop_writer(proc);
+
+	if (proc->writer_started)
+		pthread_join(proc->writer, NULL);
 
 	for (i = 0; i < proc->num_workers; ++i) {
 		pthread_join(proc->workers[i]->thread, NULL);
-
-		proc->workers[i]->cmp->destroy(proc->workers[i]->cmp);
-		free(proc->workers[i]);
+		destroy_worker(proc->workers[i]);
 	}
 
+	pthread_mutex_destroy(&proc->trace_mtx);
+	pthread_mutex_destroy(&proc->pool_mtx);
+	pthread_cond_destroy(&proc->space_cond);
 	pthread_cond_destroy(&proc->done_cond);
-	pthread_cond_destroy(&proc->queue_cond);
 	pthread_mutex_destroy(&proc->mtx);
 
 	data_writer_cleanup(proc);
 }
 
+int sqfs_data_writer_add_compressor(sqfs_data_writer_t *proc,
+				    sqfs_compressor_t *cmp)
+{
+	unsigned int i, idx = proc->num_compressors;
+	sqfs_compressor_t *copy;
+
+	if (idx >= SQFS_MAX_DATA_COMPRESSORS)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	for (i = 0; i < proc->num_workers; ++i) {
+		copy = cmp->create_copy(cmp);
+		if (copy == NULL)
+			goto fail;
+
+		pthread_mutex_lock(&proc->workers[i]->mtx);
+		proc->workers[i]->cmp[idx] = copy;
+		pthread_mutex_unlock(&proc->workers[i]->mtx);
+	}
+
+	proc->compressors[idx] = cmp;
+	proc->num_compressors += 1;
+	return idx;
+fail:
+	while (i-- > 0) {
+		pthread_mutex_lock(&proc->workers[i]->mtx);
+		copy = proc->workers[i]->cmp[idx];
+		proc->workers[i]->cmp[idx] = NULL;
+		pthread_mutex_unlock(&proc->workers[i]->mtx);
+
+		copy->destroy(copy);
+	}
+	return SQFS_ERROR_ALLOC;
+}
+
+/*
+  The block was added to the queue of a busy worker. If any other worker is
+  waiting for work, wake up one of them to steal it.
+ */
+static void wake_idle_worker(sqfs_data_writer_t *proc,
+			     const compress_worker_t *busy)
+{
+	compress_worker_t *worker;
+	bool found = false;
+	unsigned int i;
+
+	for (i = 1; i < proc->num_workers && !found; ++i) {
+		worker = proc->workers[(busy->index + i) % proc->num_workers];
+
+		pthread_mutex_lock(&worker->mtx);
+		if (worker->idle) {
+			worker->idle = false;
+			pthread_cond_signal(&worker->queue_cond);
+			found = true;
+		}
+		pthread_mutex_unlock(&worker->mtx);
+	}
+}
+
 static void append_to_work_queue(sqfs_data_writer_t *proc,
 				 sqfs_block_t *block)
 {
-	if (proc->queue_last == NULL) {
-		proc->queue = proc->queue_last = block;
-	} else {
-		proc->queue_last->next = block;
-		proc->queue_last = block;
-	}
+	compress_worker_t *worker;
+	sqfs_u64 now = get_time_ns();
+	size_t idx;
+	bool idle;
+
+	worker = proc->workers[proc->enqueue_id % proc->num_workers];
 
 	block->sequence_number = proc->enqueue_id++;
 	block->next = NULL;
-	proc->backlog += 1;
-	pthread_cond_broadcast(&proc->queue_cond);
+
+	idx = block->sequence_number & proc->done_mask;
+	proc->blk_times[idx].enqueued = now;
+	data_writer_trace(proc, SQFS_TRACE_ENQUEUE, TRACE_THREAD_MAIN,
+			  now, block->sequence_number);
+
+	pthread_mutex_lock(&worker->mtx);
+	if (worker->queue_last == NULL) {
+		worker->queue = worker->queue_last = block;
+	} else {
+		worker->queue_last->next = block;
+		worker->queue_last = block;
+	}
+	idle = worker->idle;
+	pthread_cond_signal(&worker->queue_cond);
+	pthread_mutex_unlock(&worker->mtx);
+
+	if (!idle)
+		wake_idle_worker(proc, worker);
+}
+
+static void prepend_to_work_queue(sqfs_data_writer_t *proc,
+				  sqfs_block_t *block)
+{
+	compress_worker_t *worker;
+	sqfs_u64 now = get_time_ns();
+	size_t idx;
+	bool idle;
+
+	worker = proc->workers[block->sequence_number % proc->num_workers];
+
+	idx = block->sequence_number & proc->done_mask;
+	proc->blk_times[idx].enqueued = now;
+	data_writer_trace(proc, SQFS_TRACE_ENQUEUE, TRACE_THREAD_WRITER,
+			  now, block->sequence_number);
+
+	pthread_mutex_lock(&worker->mtx);
+	block->next = worker->queue;
+	worker->queue = block;
+
+	if (worker->queue_last == NULL)
+		worker->queue_last = block;
+
+	idle = worker->idle;
+	pthread_cond_signal(&worker->queue_cond);
+	pthread_mutex_unlock(&worker->mtx);
+
+	if (!idle)
+		wake_idle_worker(proc, worker);
+}
+
+/*
+  Blocks taken off the done queue by the writer thread still count until
+  they are written. A fragment block that gets compressed while processing
+  them reuses an earlier sequence number, so the done queue has to have room
+  for all of them.
+ */
+static size_t blocks_in_flight(const sqfs_data_writer_t *proc)
+{
+	return (sqfs_u32)(proc->enqueue_id - proc->written_id);
+}
+
+static bool done_queue_ready(const sqfs_data_writer_t *proc)
+{
+	return proc->done[proc->dequeue_id & proc->done_mask] != NULL;
 }
 
 static sqfs_block_t *try_dequeue(sqfs_data_writer_t *proc)
 {
-	sqfs_block_t *queue, *it, *prev;
+	sqfs_block_t *queue = NULL, **next_ptr = &queue, *it;
+	size_t idx;
 
-	it = proc->done;
-	prev = NULL;
+	for (;;) {
+		idx = proc->dequeue_id & proc->done_mask;
+		it = proc->done[idx];
 
-	while (it != NULL && it->sequence_number == proc->dequeue_id) {
-		prev = it;
-		it = it->next;
+		if (it == NULL)
+			break;
+
+		proc->done[idx] = NULL;
 		proc->dequeue_id += 1;
-	}
 
-	if (prev == NULL) {
-		queue = NULL;
-	} else {
-		queue = proc->done;
-		prev->next = NULL;
-		proc->done = it;
+		*next_ptr = it;
+		next_ptr = &it->next;
 	}
 
+	*next_ptr = NULL;
 	return queue;
 }
 
-static sqfs_block_t *queue_merge(sqfs_block_t *lhs, sqfs_block_t *rhs)
+static void requeue_done(sqfs_data_writer_t *proc, sqfs_block_t *queue)
 {
-	sqfs_block_t *it, *head = NULL, **next_ptr = &head;
+	sqfs_block_t *it;
 
-	while (lhs != NULL && rhs != NULL) {
-		if (lhs->sequence_number <= rhs->sequence_number) {
-			it = lhs;
-			lhs = lhs->next;
-		} else {
-			it = rhs;
-			rhs = rhs->next;
-		}
+	while (queue != NULL) {
+		it = queue;
+		queue = it->next;
 
-		*next_ptr = it;
-		next_ptr = &it->next;
+		proc->done[it->sequence_number & proc->done_mask] = it;
 	}
-
-	it = (lhs != NULL ? lhs : rhs);
-	*next_ptr = it;
-	return head;
 }
 
 static int process_done_queue(sqfs_data_writer_t *proc, sqfs_block_t *queue)
 {
 	sqfs_block_t *it, *block = NULL;
+	sqfs_u64 now;
+	size_t idx;
 	int status = 0;
 
 	while (queue != NULL && status == 0) {
 		it = queue;
 		queue = it->next;
 
+		now = get_time_ns();
+		idx = it->sequence_number & proc->done_mask;
+		proc->reorder_time += now - proc->blk_times[idx].done;
+
+		data_writer_trace(proc, SQFS_TRACE_DEQUEUE, TRACE_THREAD_WRITER,
+				  now, it->sequence_number);
+
 		if (it->flags & SQFS_BLK_IS_FRAGMENT) {
 			block = NULL;
 			status = process_completed_fragment(proc, it, &block);
@@ -220,34 +484,64 @@ static int process_done_queue(sqfs_data_writer_t *proc, sqfs_block_t *queue)
 				proc->dequeue_id = it->sequence_number;
 				block->sequence_number = it->sequence_number;
 
-				if (proc->queue == NULL) {
-					proc->queue = block;
-					proc->queue_last = block;
-				} else {
-					block->next = proc->queue;
-					proc->queue = block;
-				}
-
-				proc->backlog += 1;
-				proc->done = queue_merge(queue, proc->done);
-				pthread_cond_broadcast(&proc->queue_cond);
+				prepend_to_work_queue(proc, block);
+				requeue_done(proc, queue);
 				pthread_mutex_unlock(&proc->mtx);
 
 				queue = NULL;
 			} else {
-				free(block);
+				data_writer_release_block(proc, block);
 			}
 		} else {
 			status = process_completed_block(proc, it);
 		}
 
-		free(it);
+		data_writer_release_block(proc, it);
 	}
 
 	free_blk_list(queue);
 	return status;
 }
 
+static void *writer_proc(void *arg)
+{
+	sqfs_data_writer_t *proc = arg;
+	sqfs_block_t *queue;
+	int status;
+
+	pthread_mutex_lock(&proc->mtx);
+	for (;;) {
+		while (!done_queue_ready(proc) && !proc->writer_quit &&
+		       proc->status == 0) {
+			pthread_cond_wait(&proc->done_cond, &proc->mtx);
+		}
+
+		if (proc->writer_quit || proc->status != 0)
+			break;
+
+		queue = try_dequeue(proc);
+		pthread_mutex_unlock(&proc->mtx);
+
+		status = process_done_queue(proc, queue);
+
+		pthread_mutex_lock(&proc->mtx);
+		proc->written_id = proc->dequeue_id;
+
+		if (status != 0 && proc->status == 0)
+			proc->status = status;
+
+		pthread_cond_broadcast(&proc->space_cond);
+	}
+	status = proc->status;
+	pthread_cond_broadcast(&proc->space_cond);
+	pthread_mutex_unlock(&proc->mtx);
+
+	if (status != 0)
+		stop_workers(proc);
+
+	return NULL;
+}
+
 int test_and_set_status(sqfs_data_writer_t *proc, int status)
 {
 	pthread_mutex_lock(&proc->mtx);
@@ -256,73 +550,81 @@ int test_and_set_status(sqfs_data_writer_t *proc, int status)
 	} else {
 		status = proc->status;
 	}
-	pthread_cond_broadcast(&proc->queue_cond);
+	pthread_cond_broadcast(&proc->done_cond);
+	pthread_cond_broadcast(&proc->space_cond);
 	pthread_mutex_unlock(&proc->mtx);
+
+	stop_workers(proc);
 	return status;
 }
 
 int data_writer_enqueue(sqfs_data_writer_t *proc, sqfs_block_t *block)
 {
-	sqfs_block_t *queue;
+	sqfs_u64 start, end;
 	int status;
 
 	pthread_mutex_lock(&proc->mtx);
-	while (proc->backlog > proc->max_backlog && proc->status == 0)
-		pthread_cond_wait(&proc->done_cond, &proc->mtx);
+	if (blocks_in_flight(proc) > proc->max_backlog && proc->status == 0) {
+		start = get_time_ns();
+		data_writer_trace(proc, SQFS_TRACE_WAIT_BEGIN,
+				  TRACE_THREAD_MAIN, start,
+				  blocks_in_flight(proc));
+
+		while (blocks_in_flight(proc) > proc->max_backlog &&
+		       proc->status == 0) {
+			pthread_cond_wait(&proc->space_cond, &proc->mtx);
+		}
 
-	if (proc->status != 0) {
-		status = proc->status;
-		pthread_mutex_unlock(&proc->mtx);
-		free(block);
-		return status;
-	}
+		end = get_time_ns();
+		data_writer_trace(proc, SQFS_TRACE_WAIT_END,
+				  TRACE_THREAD_MAIN, end,
+				  blocks_in_flight(proc));
 
-	append_to_work_queue(proc, block);
-	block = NULL;
+		proc->wait_time += end - start;
+	}
 
-	queue = try_dequeue(proc);
+	status = proc->status;
 	pthread_mutex_unlock(&proc->mtx);
 
-	status = process_done_queue(proc, queue);
-	if (status != 0)
-		return test_and_set_status(proc, status);
+	if (status != 0) {
+		data_writer_release_block(proc, block);
+		return status;
+	}
 
+	append_to_work_queue(proc, block);
 	return 0;
 }
 
 int sqfs_data_writer_finish(sqfs_data_writer_t *proc)
 {
-	sqfs_block_t *queue;
-	int status = 0;
+	sqfs_block_t *frag;
+	int status;
 
+	pthread_mutex_lock(&proc->mtx);
 	for (;;) {
-		pthread_mutex_lock(&proc->mtx);
-		while (proc->backlog > 0 && proc->status == 0)
-			pthread_cond_wait(&proc->done_cond, &proc->mtx);
+		while (blocks_in_flight(proc) > 0 && proc->status == 0)
+			pthread_cond_wait(&proc->space_cond, &proc->mtx);
 
-		if (proc->status != 0) {
-			status = proc->status;
-			pthread_mutex_unlock(&proc->mtx);
-			return status;
-		}
+		if (proc->status != 0 || proc->frag_block == NULL)
+			break;
 
-		queue = proc->done;
-		proc->done = NULL;
+		frag = proc->frag_block;
+		proc->frag_block = NULL;
 		pthread_mutex_unlock(&proc->mtx);
 
-		if (queue == NULL) {
-			if (proc->frag_block != NULL) {
-				append_to_work_queue(proc, proc->frag_block);
-				proc->frag_block = NULL;
-				continue;
-			}
-			break;
-		}
-
-		status = process_done_queue(proc, queue);
-		if (status != 0)
-			return status;
+		append_to_work_queue(proc, frag);
+		pthread_mutex_lock(&proc->mtx);
 	}
+	status = proc->status;
+	pthread_mutex_unlock(&proc->mtx);
+
+	if (status != 0)
+		return status;
+
+	/* the writer thread is idle until more blocks are submitted */
+	status = data_writer_flush_output(proc);
+	if (status != 0)
+		return test_and_set_status(proc, status);
 
 	return 0;
 }
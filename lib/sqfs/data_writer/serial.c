@@ -16,7 +16,7 @@ sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 {
 	sqfs_data_writer_t *proc;
 
-	proc = alloc_flex(sizeof(*proc), 1, max_block_size);
+	proc = calloc(1, sizeof(*proc));
 
 	if (proc == NULL)
 		return NULL;
@@ -27,14 +27,31 @@ sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 		return NULL;
 	}
 
+	proc->scratch = data_writer_alloc_block(proc);
+	if (proc->scratch == NULL) {
+		data_writer_cleanup(proc);
+		return NULL;
+	}
+
 	return proc;
 }
 
 void sqfs_data_writer_destroy(sqfs_data_writer_t *proc)
 {
+	free(proc->scratch);
 	data_writer_cleanup(proc);
 }
 
+int sqfs_data_writer_add_compressor(sqfs_data_writer_t *proc,
+				    sqfs_compressor_t *cmp)
+{
+	if (proc->num_compressors >= SQFS_MAX_DATA_COMPRESSORS)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	proc->compressors[proc->num_compressors] = cmp;
+	return proc->num_compressors++;
+}
+
 int test_and_set_status(sqfs_data_writer_t *proc, int status)
 {
 	if (proc->status == 0)
@@ -46,53 +63,99 @@ int test_and_set_status(sqfs_data_writer_t *proc, int status)
 int data_writer_enqueue(sqfs_data_writer_t *proc, sqfs_block_t *block)
 {
 	sqfs_block_t *fragblk = NULL;
+	sqfs_compressor_t *cmp;
+	sqfs_u64 start, end;
 
 	if (proc->status != 0) {
-		free(block);
+		data_writer_release_block(proc, block);
 		return proc->status;
 	}
 
+	block->sequence_number = proc->enqueue_id++;
+	data_writer_trace(proc, SQFS_TRACE_ENQUEUE, TRACE_THREAD_MAIN,
+			  get_time_ns(), block->sequence_number);
+
 	if (block->flags & SQFS_BLK_IS_FRAGMENT) {
 		block->checksum = crc32(0, block->data, block->size);
 
 		proc->status = process_completed_fragment(proc, block,
 							  &fragblk);
-		free(block);
+		data_writer_release_block(proc, block);
 
 		if (proc->status != 0) {
-			free(fragblk);
+			data_writer_release_block(proc, fragblk);
 			return proc->status;
 		}
 
 		if (fragblk == NULL)
 			return 0;
 
+		fragblk->sequence_number = block->sequence_number;
 		block = fragblk;
 	}
 
-	proc->status = data_writer_do_block(block, proc->cmp, proc->scratch,
+	cmp = proc->compressors[SQFS_BLK_GET_COMPRESSOR(block->flags)];
+
+	start = get_time_ns();
+	data_writer_trace(proc, SQFS_TRACE_COMPRESS_BEGIN, TRACE_THREAD_MAIN,
+			  start, block->sequence_number);
+
+	proc->status = data_writer_do_block(&block, cmp, &proc->scratch,
 					    proc->max_block_size);
 
+	end = get_time_ns();
+	data_writer_trace(proc, SQFS_TRACE_COMPRESS_END, TRACE_THREAD_MAIN,
+			  end, block->sequence_number);
+
+	proc->compress_time += end - start;
+	proc->blocks_processed += 1;
+
 	if (proc->status == 0)
 		proc->status = process_completed_block(proc, block);
 
-	free(block);
+	data_writer_release_block(proc, block);
 	return proc->status;
 }
 
 int sqfs_data_writer_finish(sqfs_data_writer_t *proc)
 {
-	if (proc->status != 0 || proc->frag_block == NULL)
+	sqfs_u64 start, end;
+
+	if (proc->status != 0)
 		return proc->status;
 
-	proc->status = data_writer_do_block(proc->frag_block, proc->cmp,
-					    proc->scratch,
-					    proc->max_block_size);
+	if (proc->frag_block != NULL) {
+		proc->frag_block->sequence_number = proc->enqueue_id++;
 
-	if (proc->status == 0)
-		proc->status = process_completed_block(proc, proc->frag_block);
+		start = get_time_ns();
+		data_writer_trace(proc, SQFS_TRACE_COMPRESS_BEGIN,
+				  TRACE_THREAD_MAIN, start,
+				  proc->frag_block->sequence_number);
+
+		proc->status = data_writer_do_block(&proc->frag_block,
+						    proc->cmp, &proc->scratch,
+						    proc->max_block_size);
+
+		end = get_time_ns();
+		data_writer_trace(proc, SQFS_TRACE_COMPRESS_END,
+				  TRACE_THREAD_MAIN, end,
+				  proc->frag_block->sequence_number);
+
+		proc->compress_time += end - start;
+		proc->blocks_processed += 1;
+
+		if (proc->status == 0) {
+			proc->status = process_completed_block(proc,
+							proc->frag_block);
+		}
+
+		data_writer_release_block(proc, proc->frag_block);
+		proc->frag_block = NULL;
+
+		if (proc->status != 0)
+			return proc->status;
+	}
 
-	free(proc->frag_block);
-	proc->frag_block = NULL;
+	proc->status = data_writer_flush_output(proc);
 	return proc->status;
 }
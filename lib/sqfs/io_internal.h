@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * io_internal.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef IO_INTERNAL_H
+#define IO_INTERNAL_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+#include "sqfs/io.h"
+
+/*
+  Get a pointer to a range of a file without copying it. This only works for
+  files created through sqfs_open_file with SQFS_FILE_OPEN_MMAP that could
+  actually be mapped. For any other file, including caller provided
+  implementations of sqfs_file_t, or if the range is out of bounds, NULL is
+  returned and the caller has to fall back to read_at.
+
+  The pointer stays valid until the file is destroyed.
+ */
+SQFS_INTERNAL const sqfs_u8 *sqfs_file_get_pointer(sqfs_file_t *file,
+						    sqfs_u64 offset,
+						    size_t size);
+
+#endif /* IO_INTERNAL_H */
@@ -13,6 +13,7 @@
 #include "sqfs/block.h"
 #include "sqfs/io.h"
 #include "util/util.h"
+#include "io_internal.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -32,16 +33,19 @@ struct sqfs_meta_reader_t {
 	/* A byte offset into the uncompressed data of the current block */
 	size_t offset;
 
+	/* The uncompressed data, either in data or in the mapped file */
+	const sqfs_u8 *block;
+
 	/* The underlying file descriptor to read from */
 	sqfs_file_t *file;
 
 	/* A pointer to the compressor to use for extracting data */
 	sqfs_compressor_t *cmp;
 
-	/* The raw data read from the input file */
+	/* The uncompressed data read from the input file */
 	sqfs_u8 data[SQFS_META_BLOCK_SIZE];
 
-	/* The uncompressed data read from the input file */
+	/* The raw data read from the input file if it is compressed */
 	sqfs_u8 scratch[SQFS_META_BLOCK_SIZE];
 };
 
@@ -69,6 +73,7 @@ void sqfs_meta_reader_destroy(sqfs_meta_reader_t *m)
 int sqfs_meta_reader_seek(sqfs_meta_reader_t *m, sqfs_u64 block_start,
 			  size_t offset)
 {
+	const sqfs_u8 *ptr = NULL;
 	bool compressed;
 	sqfs_u16 header;
 	sqfs_u32 size;
@@ -100,20 +105,37 @@ int sqfs_meta_reader_seek(sqfs_meta_reader_t *m, sqfs_u64 block_start,
 	if ((block_start + 2 + size) > m->limit)
 		return SQFS_ERROR_OUT_OF_BOUNDS;
 
-	err = m->file->read_at(m->file, block_start + 2, m->data, size);
-	if (err)
-		return err;
+	ptr = sqfs_file_get_pointer(m->file, block_start + 2, size);
 
 	if (compressed) {
-		ret = m->cmp->do_block(m->cmp, m->data, size,
-				       m->scratch, sizeof(m->scratch));
+		if (ptr == NULL) {
+			err = m->file->read_at(m->file, block_start + 2,
+					       m->scratch, size);
+			if (err)
+				return err;
+
+			ptr = m->scratch;
+		}
+
+		ret = m->cmp->do_block(m->cmp, ptr, size,
+				       m->data, sizeof(m->data));
 
 		if (ret < 0)
 			return ret;
 
-		memcpy(m->data, m->scratch, ret);
+		m->block = m->data;
 		m->data_used = ret;
 	} else {
+		if (ptr == NULL) {
+			err = m->file->read_at(m->file, block_start + 2,
+					       m->data, size);
+			if (err)
+				return err;
+
+			ptr = m->data;
+		}
+
+		m->block = ptr;
 		m->data_used = size;
 	}
 
@@ -151,7 +173,7 @@ int sqfs_meta_reader_read(sqfs_meta_reader_t *m, void *data, size_t size)
 		if (diff > size)
 			diff = size;
 
-		memcpy(data, m->data + m->offset, diff);
+		memcpy(data, m->block + m->offset, diff);
 
 		m->offset += diff;
 		data = (char *)data + diff;
@@ -9,9 +9,12 @@
 
 #include "sqfs/io.h"
 #include "sqfs/error.h"
+#include "../io_internal.h"
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -22,6 +25,9 @@ typedef struct {
 
 	sqfs_u64 size;
 	int fd;
+
+	/* read-only mapping of the whole file, NULL if not mapped */
+	sqfs_u8 *map;
 } sqfs_file_stdio_t;
 
 
@@ -29,10 +35,36 @@ static void stdio_destroy(sqfs_file_t *base)
 {
 	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
 
+	if (file->map != NULL)
+		munmap(file->map, file->size);
+
 	close(file->fd);
 	free(file);
 }
 
+static int map_check_range(const sqfs_file_stdio_t *file, sqfs_u64 offset,
+			   size_t size)
+{
+	if (offset > file->size || size > (file->size - offset))
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	return 0;
+}
+
+static int map_read_at(sqfs_file_t *base, sqfs_u64 offset,
+		       void *buffer, size_t size)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+	int ret;
+
+	ret = map_check_range(file, offset, size);
+	if (ret)
+		return ret;
+
+	memcpy(buffer, file->map + offset, size);
+	return 0;
+}
+
 static int stdio_read_at(sqfs_file_t *base, sqfs_u64 offset,
 			 void *buffer, size_t size)
 {
@@ -156,8 +188,38 @@ sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags)
 
 	base->destroy = stdio_destroy;
 	base->read_at = stdio_read_at;
+
+	/* fall back to regular reads for anything that cannot be mapped */
+	if ((flags & SQFS_FILE_OPEN_READ_ONLY) &&
+	    (flags & SQFS_FILE_OPEN_MMAP) &&
+	    file->size > 0 && file->size <= SIZE_MAX) {
+		file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+				 file->fd, 0);
+
+		if (file->map == MAP_FAILED) {
+			file->map = NULL;
+		} else {
+			base->read_at = map_read_at;
+		}
+	}
+
 	base->write_at = stdio_write_at;
 	base->get_size = stdio_get_size;
 	base->truncate = stdio_truncate;
 	return base;
 }
+
+const sqfs_u8 *sqfs_file_get_pointer(sqfs_file_t *base, sqfs_u64 offset,
+				     size_t size)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+
+	/* only our own files can be mapped, anything else uses read_at */
+	if (base->destroy != stdio_destroy || file->map == NULL)
+		return NULL;
+
+	if (map_check_range(file, offset, size))
+		return NULL;
+
+	return file->map + offset;
+}
@@ -9,8 +9,10 @@
 
 #include "sqfs/io.h"
 #include "sqfs/error.h"
+#include "../io_internal.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -37,7 +39,7 @@ static int stdio_read_at(sqfs_file_t *base, sqfs_u64 offset,
 {
 	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
 	DWORD actually_read;
-	LARGE_INTEGER pos;
+	OVERLAPPED ov;
 
 	if (offset >= file->size)
 		return SQFS_ERROR_OUT_OF_BOUNDS;
@@ -48,16 +50,23 @@ static int stdio_read_at(sqfs_file_t *base, sqfs_u64 offset,
 	if ((offset + size - 1) >= file->size)
 		return SQFS_ERROR_OUT_OF_BOUNDS;
 
-	pos.QuadPart = offset;
-
-	if (!SetFilePointerEx(file->fd, pos, NULL, FILE_BEGIN))
-		return SQFS_ERROR_IO;
-
+	/*
+	  Pass the offset with the read instead of moving the file pointer,
+	  so data readers on different threads can read concurrently.
+	 */
 	while (size > 0) {
-		if (!ReadFile(file->fd, buffer, size, &actually_read, NULL))
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = offset & 0xFFFFFFFF;
+		ov.OffsetHigh = offset >> 32;
+
+		if (!ReadFile(file->fd, buffer, size, &actually_read, &ov))
 			return SQFS_ERROR_IO;
 
+		if (actually_read == 0)
+			return SQFS_ERROR_OUT_OF_BOUNDS;
+
 		size -= actually_read;
+		offset += actually_read;
 		buffer = (char *)buffer + actually_read;
 	}
 
@@ -168,3 +177,10 @@ sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags)
 	base->truncate = stdio_truncate;
 	return base;
 }
+
+const sqfs_u8 *sqfs_file_get_pointer(sqfs_file_t *file, sqfs_u64 offset,
+				     size_t size)
+{
+	(void)file; (void)offset; (void)size;
+	return NULL;
+}
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * get_time.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "util/util.h"
+
+#if defined(_WIN32) || defined(__WINDOWS__)
+#include <windows.h>
+
+sqfs_u64 get_time_ns(void)
+{
+	LARGE_INTEGER count, freq;
+
+	if (!QueryPerformanceFrequency(&freq) ||
+	    !QueryPerformanceCounter(&count) || freq.QuadPart <= 0) {
+		return 0;
+	}
+
+	return (sqfs_u64)(count.QuadPart / freq.QuadPart) * 1000000000UL +
+		(sqfs_u64)((count.QuadPart % freq.QuadPart) * 1000000000LL /
+			   freq.QuadPart);
+}
+#else
+#include <time.h>
+
+sqfs_u64 get_time_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+
+	return (sqfs_u64)ts.tv_sec * 1000000000UL + (sqfs_u64)ts.tv_nsec;
+}
+#endif
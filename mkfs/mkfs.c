@@ -28,62 +28,177 @@ static int restore_working_dir(options_t *opt)
 	return 0;
 }
 
-static int pack_files(sqfs_data_writer_t *data, fstree_t *fs,
-		      data_writer_stats_t *stats, options_t *opt)
+/*
+  Input files are opened a few files ahead of the one currently being packed
+  and the kernel is asked to start reading them in the background, so the
+  compressor threads do not have to wait for the I/O of every single file.
+  The files are still packed strictly in list order.
+ */
+#define PREFETCH_MAX_BYTES (16 * 1024 * 1024)
+
+typedef struct {
+	file_info_t *fi;
+	int fd;
+} prefetch_t;
+
+static void prefetch_file(prefetch_t *pf, file_info_t *fi)
+{
+	struct stat sb;
+	off_t size;
+
+	pf->fi = fi;
+	pf->fd = open(fi->input_file, O_RDONLY);
+
+	/* failures are reported when the file is actually packed */
+	if (pf->fd < 0 || fstat(pf->fd, &sb) != 0)
+		return;
+
+	size = sb.st_size;
+	if (size > PREFETCH_MAX_BYTES)
+		size = PREFETCH_MAX_BYTES;
+
+	if (size > 0)
+		posix_fadvise(pf->fd, 0, size, POSIX_FADV_WILLNEED);
+}
+
+static void drop_prefetched(prefetch_t *window, size_t head, size_t used,
+			    size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < used; ++i) {
+		if (window[(head + i) % count].fd >= 0) {
+			close(window[(head + i) % count].fd);
+			window[(head + i) % count].fd = -1;
+		}
+	}
+}
+
+static int pack_file(sqfs_writer_t *sqfs, options_t *opt, file_info_t *fi,
+		     int fd)
 {
 	sqfs_inode_generic_t *inode;
 	size_t max_blk_count;
 	sqfs_u64 filesize;
-	sqfs_file_t *file;
-	file_info_t *fi;
-	int ret;
+	tree_node_t *node;
+	struct stat sb;
+	int ret, flags;
+	char *path;
 
-	if (set_working_dir(opt))
+	if (!opt->cfg.quiet)
+		printf("packing %s\n", fi->input_file);
+
+	/* file_info_t is embedded in the tree node */
+	node = (tree_node_t *)((char *)fi - offsetof(tree_node_t, data.file));
+
+	path = fstree_get_path(node);
+	if (path == NULL) {
+		perror(fi->input_file);
 		return -1;
+	}
 
-	for (fi = fs->files; fi != NULL; fi = fi->next) {
-		if (!opt->cfg.quiet)
-			printf("packing %s\n", fi->input_file);
+	ret = sqfs_writer_file_flags(sqfs, &opt->cfg, path, &flags);
+	free(path);
 
-		file = sqfs_open_file(fi->input_file,
-				      SQFS_FILE_OPEN_READ_ONLY);
-		if (file == NULL) {
-			perror(fi->input_file);
-			return -1;
-		}
+	if (ret)
+		return -1;
+
+	if (fstat(fd, &sb)) {
+		perror(fi->input_file);
+		return -1;
+	}
 
-		filesize = file->get_size(file);
+	filesize = sb.st_size;
 
-		max_blk_count = filesize / opt->cfg.block_size;
-		if (filesize % opt->cfg.block_size)
-			++max_blk_count;
+	max_blk_count = filesize / opt->cfg.block_size;
+	if (filesize % opt->cfg.block_size)
+		++max_blk_count;
 
-		inode = alloc_flex(sizeof(*inode), sizeof(sqfs_u32),
-				   max_blk_count);
-		if (inode == NULL) {
-			perror("creating file inode");
-			file->destroy(file);
-			return -1;
+	inode = alloc_flex(sizeof(*inode), sizeof(sqfs_u32), max_blk_count);
+	if (inode == NULL) {
+		perror("creating file inode");
+		return -1;
+	}
+
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->base.type = SQFS_INODE_FILE;
+	sqfs_inode_set_file_size(inode, filesize);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+
+	fi->user_ptr = inode;
+
+	ret = 0;
+	if (opt->hash_files) {
+		ret = file_dedup_check(sqfs, fi->input_file, fd,
+				       filesize, flags, inode);
+	}
+
+	if (ret == 0) {
+		ret = write_data_from_fd(fi->input_file, sqfs->data,
+					 inode, fd, flags);
+	}
+
+	if (ret < 0)
+		return -1;
+
+	sqfs->stats.file_count += 1;
+	sqfs->stats.bytes_read += filesize;
+	return 0;
+}
+
+static int pack_files(sqfs_writer_t *sqfs, options_t *opt)
+{
+	size_t head = 0, used = 0, count = opt->prefetch + 1;
+	file_info_t *next = sqfs->fs.files;
+	prefetch_t *window, cur;
+	int ret = 0;
+
+	if (set_working_dir(opt))
+		return -1;
+
+	window = alloc_array(sizeof(window[0]), count);
+	if (window == NULL) {
+		perror("creating file prefetch window");
+		return -1;
+	}
+
+	while (ret == 0 && (used > 0 || next != NULL)) {
+		while (used < count && next != NULL) {
+			prefetch_file(&window[(head + used) % count], next);
+			next = next->next;
+			used += 1;
 		}
 
-		inode->block_sizes = (sqfs_u32 *)inode->extra;
-		inode->base.type = SQFS_INODE_FILE;
-		sqfs_inode_set_file_size(inode, filesize);
-		sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+		cur = window[head];
+		head = (head + 1) % count;
+		used -= 1;
 
-		fi->user_ptr = inode;
+		if (cur.fd < 0) {
+			cur.fd = open(cur.fi->input_file, O_RDONLY);
 
-		ret = write_data_from_file(fi->input_file, data,
-					   inode, file, 0);
-		file->destroy(file);
+			if (cur.fd < 0 &&
+			    (errno == EMFILE || errno == ENFILE)) {
+				drop_prefetched(window, head, used, count);
+				cur.fd = open(cur.fi->input_file, O_RDONLY);
+			}
 
-		if (ret)
-			return -1;
+			if (cur.fd < 0) {
+				perror(cur.fi->input_file);
+				ret = -1;
+				break;
+			}
+		}
 
-		stats->file_count += 1;
-		stats->bytes_read += filesize;
+		ret = pack_file(sqfs, opt, cur.fi, cur.fd);
+		close(cur.fd);
 	}
 
+	drop_prefetched(window, head, used, count);
+	free(window);
+
+	if (ret)
+		return -1;
+
 	return restore_working_dir(opt);
 }
 
@@ -128,15 +243,23 @@ static int relabel_tree_dfs(const char *filename, sqfs_xattr_writer_t *xwr,
 	return 0;
 }
 
-static int read_fstree(fstree_t *fs, options_t *opt, sqfs_xattr_writer_t *xwr,
+static int add_file_policy(void *user, const char *pattern,
+			   const char *options)
+{
+	sqfs_writer_t *sqfs = user;
+
+	return file_policy_add(&sqfs->policy, pattern, options);
+}
+
+static int read_fstree(sqfs_writer_t *sqfs, options_t *opt,
 		       void *selinux_handle)
 {
 	FILE *fp;
 	int ret;
 
 	if (opt->infile == NULL) {
-		return fstree_from_dir(fs, opt->packdir, selinux_handle,
-				       xwr, opt->dirscan_flags);
+		return fstree_from_dir(&sqfs->fs, opt->packdir, selinux_handle,
+				       sqfs->xwr, opt->dirscan_flags);
 	}
 
 	fp = fopen(opt->infile, "rb");
@@ -145,12 +268,13 @@ static int read_fstree(fstree_t *fs, options_t *opt, sqfs_xattr_writer_t *xwr,
 		return -1;
 	}
 
-	ret = fstree_from_file(fs, opt->infile, fp);
+	ret = fstree_from_file(&sqfs->fs, opt->infile, fp,
+			       add_file_policy, sqfs);
 	fclose(fp);
 
 	if (ret == 0 && selinux_handle != NULL)
-		ret = relabel_tree_dfs(opt->cfg.filename, xwr,
-				       fs->root, selinux_handle);
+		ret = relabel_tree_dfs(opt->cfg.filename, sqfs->xwr,
+				       sqfs->fs.root, selinux_handle);
 
 	return ret;
 }
@@ -173,7 +297,7 @@ int main(int argc, char **argv)
 			goto out;
 	}
 
-	if (read_fstree(&sqfs.fs, &opt, sqfs.xwr, sehnd)) {
+	if (read_fstree(&sqfs, &opt, sehnd)) {
 		if (sehnd != NULL)
 			selinux_close_context_file(sehnd);
 		goto out;
@@ -187,7 +311,7 @@ int main(int argc, char **argv)
 	tree_node_sort_recursive(sqfs.fs.root);
 	fstree_gen_file_list(&sqfs.fs);
 
-	if (pack_files(sqfs.data, &sqfs.fs, &sqfs.stats, &opt))
+	if (pack_files(&sqfs, &opt))
 		goto out;
 
 	if (sqfs_writer_finish(&sqfs, &opt.cfg))
@@ -28,18 +28,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 #include <dirent.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
 
+/* number of input files opened and read ahead of the one being packed */
+#define PREFETCH_DEFAULT (8)
+#define MAX_PREFETCH (1024)
+
 typedef struct {
 	sqfs_writer_cfg_t cfg;
 	unsigned int dirscan_flags;
 	const char *infile;
 	const char *packdir;
 	const char *selinux;
+	bool hash_files;
+	size_t prefetch;
 } options_t;
 
 enum {
@@ -16,6 +16,13 @@ static struct option long_opts[] = {
 	{ "pack-dir", required_argument, NULL, 'D' },
 	{ "num-jobs", required_argument, NULL, 'j' },
 	{ "queue-backlog", required_argument, NULL, 'Q' },
+	{ "dedup-buffer", required_argument, NULL, 'M' },
+	{ "memory-limit", required_argument, NULL, 'm' },
+	{ "skip-incompressible", no_argument, NULL, 'I' },
+	{ "file-policy", required_argument, NULL, 'P' },
+	{ "hash-files", no_argument, NULL, 'H' },
+	{ "prefetch", required_argument, NULL, 'p' },
+	{ "trace", required_argument, NULL, 'T' },
 	{ "keep-time", no_argument, NULL, 'k' },
 #ifdef HAVE_SYS_XATTR_H
 	{ "keep-xattr", no_argument, NULL, 'x' },
@@ -31,7 +38,7 @@ static struct option long_opts[] = {
 	{ "help", no_argument, NULL, 'h' },
 };
 
-static const char *short_opts = "F:D:X:c:b:B:d:j:Q:kxoefqhV"
+static const char *short_opts = "F:D:X:c:b:B:d:j:Q:M:m:IP:Hp:T:kxoefqhV"
 #ifdef WITH_SELINUX
 "s:"
 #endif
@@ -68,6 +75,30 @@ static const char *help_string =
 "                              worker queue before the packer starts waiting\n"
 "                              for the block processors to catch up.\n"
 "                              Defaults to 10 times the number of jobs.\n"
+"  --dedup-buffer, -M <size>   Keep up to this many bytes of compressed data\n"
+"                              of a file in memory until it is known whether\n"
+"                              the file is a duplicate. Defaults to 0.\n"
+"  --memory-limit, -m <size>   Limit the memory used for data block buffers\n"
+"                              to roughly this many bytes. The queue backlog\n"
+"                              is sized to fit, replacing the one set with\n"
+"                              --queue-backlog.\n"
+"  --skip-incompressible, -I   Estimate the entropy of each data block and\n"
+"                              store blocks that look incompressible without\n"
+"                              running the compressor on them.\n"
+"  --file-policy, -P <rule>    Apply flags and compressor options to files\n"
+"                              matching a pattern. See below for details.\n"
+"                              Can be specified multiple times.\n"
+"  --hash-files, -H            Hash the contents of all input files and pack\n"
+"                              files with identical contents only once,\n"
+"                              without compressing the duplicates again.\n"
+"  --prefetch, -p <count>      Number of input files to open and start\n"
+"                              reading in the background, ahead of the file\n"
+"                              that is currently being packed.\n"
+"                              Defaults to %u.\n"
+"  --trace, -T <file>          Write a timeline of the data block pipeline\n"
+"                              to a file in trace-event JSON format.\n";
+
+static const char *help_format =
 "  --block-size, -b <size>     Block size to use for Squashfs image.\n"
 "                              Defaults to %u.\n"
 "  --dev-block-size, -B <size> Device block size to padd the image to.\n"
@@ -111,6 +142,7 @@ const char *help_details =
 "slink <path> <mode> <uid> <gid> <target>\n"
 "pipe <path> <mode> <uid> <gid>\n"
 "sock <path> <mode> <uid> <gid>\n"
+"policy <pattern> <options>\n"
 "\n"
 "<path>       Absolute path of the entry in the image. Can be put in quotes\n"
 "             if some components contain spaces.\n"
@@ -124,6 +156,8 @@ const char *help_details =
 "<dev_type>   Device type (b=block, c=character).\n"
 "<maj>        Major number of a device special file.\n"
 "<min>        Minor number of a device special file.\n"
+"<pattern>    Pattern for a file policy rule, see --file-policy below.\n"
+"<options>    Options for a file policy rule, see --file-policy below.\n"
 "\n"
 "Example:\n"
 "    # A simple squashfs image\n"
@@ -141,7 +175,29 @@ const char *help_details =
 "    \n"
 "    # file name with a space in it.\n"
 "    file \"/opt/my app/\\\"special\\\"/data\" 0600 0 0\n"
-"\n\n";
+"    \n"
+"    # Don't bother compressing images.\n"
+"    policy *.png dont-compress\n"
+"\n"
+"File policy rules have the form <pattern>:<options>. The pattern is matched\n"
+"against the file name if it contains no '/', otherwise against the full\n"
+"path of the file in the image. The first matching rule is used. Options\n"
+"is a comma separated list of the following flags and compressor options\n"
+"(see --comp-extra):\n"
+"\n"
+"  dont-compress        Store the data blocks of the file uncompressed.\n"
+"  dont-fragment        Do not pack the tail end into a fragment block.\n"
+"  align                Align the file data to the device block size.\n"
+"  skip-incompressible  Same as --skip-incompressible, but for this file.\n"
+"\n"
+"Compressor options that are stored in the image (e.g. the XZ dictionary\n"
+"size) are always taken from the global settings. Tail ends packed into\n"
+"fragment blocks always use the global compressor settings.\n"
+"\n"
+"Example:\n"
+"    --file-policy '*.jpg:dont-compress' --file-policy 'bin/*:level=9'\n"
+"\n"
+"\n";
 
 void process_command_line(options_t *opt, int argc, char **argv)
 {
@@ -150,6 +206,7 @@ void process_command_line(options_t *opt, int argc, char **argv)
 
 	memset(opt, 0, sizeof(*opt));
 	sqfs_writer_cfg_init(&opt->cfg);
+	opt->prefetch = PREFETCH_DEFAULT;
 
 	for (;;) {
 		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
@@ -175,20 +232,60 @@ void process_command_line(options_t *opt, int argc, char **argv)
 			}
 			break;
 		case 'b':
-			opt->cfg.block_size = strtol(optarg, NULL, 0);
+			if (parse_size("Block size", &opt->cfg.block_size,
+				       optarg, 1, SIZE_MAX)) {
+				goto fail_arg;
+			}
 			break;
 		case 'j':
-			opt->cfg.num_jobs = strtol(optarg, NULL, 0);
+			if (parse_size("Number of jobs", &opt->cfg.num_jobs,
+				       optarg, 1, MAX_NUM_JOBS)) {
+				goto fail_arg;
+			}
 			break;
 		case 'Q':
-			opt->cfg.max_backlog = strtol(optarg, NULL, 0);
+			if (parse_size("Queue backlog", &opt->cfg.max_backlog,
+				       optarg, 1, SIZE_MAX)) {
+				goto fail_arg;
+			}
 			break;
-		case 'B':
-			opt->cfg.devblksize = strtol(optarg, NULL, 0);
-			if (opt->cfg.devblksize < 1024) {
-				fputs("Device block size must be at "
-				      "least 1024\n", stderr);
+		case 'M':
+			if (parse_size("Dedup buffer size",
+				       &opt->cfg.dedup_buffer, optarg,
+				       0, SIZE_MAX)) {
+				goto fail_arg;
+			}
+			break;
+		case 'm':
+			if (parse_size("Memory limit", &opt->cfg.memory_limit,
+				       optarg, 0, SIZE_MAX)) {
+				goto fail_arg;
+			}
+			break;
+		case 'I':
+			opt->cfg.skip_incompressible = true;
+			break;
+		case 'P':
+			if (file_policy_add_rule(&opt->cfg.policy, optarg))
 				exit(EXIT_FAILURE);
+			break;
+		case 'H':
+			opt->hash_files = true;
+			break;
+		case 'p':
+			if (parse_size("Prefetch count", &opt->prefetch,
+				       optarg, 0, MAX_PREFETCH)) {
+				goto fail_arg;
+			}
+			break;
+		case 'T':
+			opt->cfg.trace_file = optarg;
+			break;
+		case 'B':
+			if (parse_size("Device block size",
+				       &opt->cfg.devblksize, optarg,
+				       1024, SIZE_MAX)) {
+				goto fail_arg;
 			}
 			break;
 		case 'd':
@@ -229,7 +326,8 @@ void process_command_line(options_t *opt, int argc, char **argv)
 			break;
 #endif
 		case 'h':
-			printf(help_string,
+			printf(help_string, PREFETCH_DEFAULT);
+			printf(help_format,
 			       SQFS_DEFAULT_BLOCK_SIZE, SQFS_DEVBLK_SIZE);
 			fputs(help_details, stdout);
 			compressor_print_available();
@@ -245,6 +343,7 @@ void process_command_line(options_t *opt, int argc, char **argv)
 	if (opt->cfg.num_jobs < 1)
 		opt->cfg.num_jobs = 1;
 
+	/* a memory limit replaces this once it is applied */
 	if (opt->cfg.max_backlog < 1)
 		opt->cfg.max_backlog = 10 * opt->cfg.num_jobs;
 
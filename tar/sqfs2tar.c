@@ -22,11 +22,12 @@ static struct option long_opts[] = {
 	{ "keep-as-dir", no_argument, NULL, 'k' },
 	{ "no-skip", no_argument, NULL, 's' },
 	{ "no-xattr", no_argument, NULL, 'X' },
+	{ "num-jobs", required_argument, NULL, 'j' },
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
 };
 
-static const char *short_opts = "d:ksXhV";
+static const char *short_opts = "d:ksXj:hV";
 
 static const char *usagestr =
 "Usage: sqfs2tar [OPTIONS...] <sqfsfile>\n"
@@ -53,6 +54,11 @@ static const char *usagestr =
 "                            archive. By default, it is simply skipped\n"
 "                            and a warning is written to stderr.\n"
 "\n"
+"  --num-jobs, -j <count>    Number of threads to use for decompressing\n"
+"                            file data. If more than one, the upcoming\n"
+"                            blocks are decompressed ahead of time.\n"
+"                            Defaults to 1.\n"
+"\n"
 "  --help, -h                Print help text and exit.\n"
 "  --version, -V             Print version information and exit.\n"
 "\n"
@@ -68,6 +74,7 @@ static unsigned int record_counter;
 static bool dont_skip = false;
 static bool keep_as_dir = false;
 static bool no_xattr = false;
+static unsigned int num_jobs = 1;
 
 static char **subdirs = NULL;
 static size_t num_subdirs = 0;
@@ -80,7 +87,7 @@ static sqfs_super_t super;
 
 static void process_args(int argc, char **argv)
 {
-	size_t idx, new_count;
+	size_t idx, new_count, value;
 	int i, ret;
 	void *new;
 
@@ -122,6 +129,13 @@ static void process_args(int argc, char **argv)
 		case 'X':
 			no_xattr = true;
 			break;
+		case 'j':
+			if (parse_size("Number of jobs", &value, optarg,
+				       1, MAX_NUM_JOBS)) {
+				goto fail_arg;
+			}
+			num_jobs = value;
+			break;
 		case 'h':
 			fputs(usagestr, stdout);
 			goto out_success;
@@ -256,6 +270,27 @@ fail:
 	return -1;
 }
 
+static int queue_files_dfs(const sqfs_tree_node_t *n)
+{
+	int ret;
+
+	if (S_ISREG(n->inode->base.mode)) {
+		ret = sqfs_data_reader_queue_file(data, n->inode);
+		if (ret) {
+			sqfs_perror((const char *)n->name, "queueing file",
+				    ret);
+			return -1;
+		}
+	}
+
+	for (n = n->children; n != NULL; n = n->next) {
+		if (queue_files_dfs(n))
+			return -1;
+	}
+
+	return 0;
+}
+
 static int write_tree_dfs(const sqfs_tree_node_t *n)
 {
 	tar_xattr_t *xattr = NULL, *xit;
@@ -395,7 +430,8 @@ int main(int argc, char **argv)
 
 	process_args(argc, argv);
 
-	file = sqfs_open_file(filename, SQFS_FILE_OPEN_READ_ONLY);
+	file = sqfs_open_file(filename, SQFS_FILE_OPEN_READ_ONLY |
+			      SQFS_FILE_OPEN_MMAP);
 	if (file == NULL) {
 		perror(filename);
 		goto out_dirs;
@@ -511,6 +547,17 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (num_jobs > 1) {
+		ret = sqfs_data_reader_set_readahead(data, num_jobs, 0);
+		if (ret) {
+			sqfs_perror(filename, "setting up read-ahead", ret);
+			goto out;
+		}
+
+		if (queue_files_dfs(root))
+			goto out;
+	}
+
 	if (write_tree_dfs(root))
 		goto out;
 
@@ -9,6 +9,7 @@
 #include "tar.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <string.h>
@@ -21,6 +22,11 @@ static struct option long_opts[] = {
 	{ "defaults", required_argument, NULL, 'd' },
 	{ "num-jobs", required_argument, NULL, 'j' },
 	{ "queue-backlog", required_argument, NULL, 'Q' },
+	{ "dedup-buffer", required_argument, NULL, 'M' },
+	{ "memory-limit", required_argument, NULL, 'm' },
+	{ "skip-incompressible", no_argument, NULL, 'I' },
+	{ "file-policy", required_argument, NULL, 'P' },
+	{ "trace", required_argument, NULL, 'T' },
 	{ "comp-extra", required_argument, NULL, 'X' },
 	{ "no-skip", no_argument, NULL, 's' },
 	{ "no-xattr", no_argument, NULL, 'x' },
@@ -32,7 +38,7 @@ static struct option long_opts[] = {
 	{ "version", no_argument, NULL, 'V' },
 };
 
-static const char *short_opts = "c:b:B:d:X:j:Q:sxekfqhV";
+static const char *short_opts = "c:b:B:d:X:j:Q:M:m:IP:T:sxekfqhV";
 
 static const char *usagestr =
 "Usage: tar2sqfs [OPTIONS...] <sqfsfile>\n"
@@ -52,6 +58,21 @@ static const char *usagestr =
 "                              worker queue before the packer starts waiting\n"
 "                              for the block processors to catch up.\n"
 "                              Defaults to 10 times the number of jobs.\n"
+"  --dedup-buffer, -M <size>   Keep up to this many bytes of compressed data\n"
+"                              of a file in memory until it is known whether\n"
+"                              the file is a duplicate. Defaults to 0.\n"
+"  --memory-limit, -m <size>   Limit the memory used for data block buffers\n"
+"                              to roughly this many bytes. The queue backlog\n"
+"                              is sized to fit, replacing the one set with\n"
+"                              --queue-backlog.\n"
+"  --skip-incompressible, -I   Estimate the entropy of each data block and\n"
+"                              store blocks that look incompressible without\n"
+"                              running the compressor on them.\n"
+"  --file-policy, -P <rule>    Apply flags and compressor options to files\n"
+"                              matching a pattern. See below for details.\n"
+"                              Can be specified multiple times.\n"
+"  --trace, -T <file>          Write a timeline of the data block pipeline\n"
+"                              to a file in trace-event JSON format.\n"
 "  --block-size, -b <size>     Block size to use for Squashfs image.\n"
 "                              Defaults to %u.\n"
 "  --dev-block-size, -B <size> Device block size to padd the image to.\n"
@@ -75,12 +96,31 @@ static const char *usagestr =
 "  --quiet, -q                 Do not print out progress reports.\n"
 "  --help, -h                  Print help text and exit.\n"
 "  --version, -V               Print version information and exit.\n"
+"\n";
+
+static const char *policystr =
+"File policy rules have the form <pattern>:<options>. The pattern is matched\n"
+"against the file name if it contains no '/', otherwise against the full\n"
+"path of the file in the image. The first matching rule is used. Options\n"
+"is a comma separated list of the following flags and compressor options\n"
+"(see --comp-extra):\n"
+"\n"
+"  dont-compress        Store the data blocks of the file uncompressed.\n"
+"  dont-fragment        Do not pack the tail end into a fragment block.\n"
+"  align                Align the file data to the device block size.\n"
+"  skip-incompressible  Same as --skip-incompressible, but for this file.\n"
+"\n"
+"Compressor options that are stored in the image (e.g. the XZ dictionary\n"
+"size) are always taken from the global settings. Tail ends packed into\n"
+"fragment blocks always use the global compressor settings.\n"
 "\n"
 "Examples:\n"
 "\n"
 "\ttar2sqfs rootfs.sqfs < rootfs.tar\n"
 "\tzcat rootfs.tar.gz | tar2sqfs rootfs.sqfs\n"
 "\txzcat rootfs.tar.xz | tar2sqfs rootfs.sqfs\n"
+"\ttar2sqfs -c gzip -P '*.jpg:dont-compress' -P 'bin/*:level=9' "
+"rootfs.sqfs < rootfs.tar\n"
 "\n";
 
 static bool dont_skip = false;
@@ -102,14 +142,15 @@ static void process_args(int argc, char **argv)
 
 		switch (i) {
 		case 'b':
-			cfg.block_size = strtol(optarg, NULL, 0);
+			if (parse_size("Block size", &cfg.block_size, optarg,
+				       1, SIZE_MAX)) {
+				goto fail_arg;
+			}
 			break;
 		case 'B':
-			cfg.devblksize = strtol(optarg, NULL, 0);
-			if (cfg.devblksize < 1024) {
-				fputs("Device block size must be at "
-				      "least 1024\n", stderr);
-				exit(EXIT_FAILURE);
+			if (parse_size("Device block size", &cfg.devblksize,
+				       optarg, 1024, SIZE_MAX)) {
+				goto fail_arg;
 			}
 			break;
 		case 'c':
@@ -128,10 +169,38 @@ static void process_args(int argc, char **argv)
 			}
 			break;
 		case 'j':
-			cfg.num_jobs = strtol(optarg, NULL, 0);
+			if (parse_size("Number of jobs", &cfg.num_jobs, optarg,
+				       1, MAX_NUM_JOBS)) {
+				goto fail_arg;
+			}
 			break;
 		case 'Q':
-			cfg.max_backlog = strtol(optarg, NULL, 0);
+			if (parse_size("Queue backlog", &cfg.max_backlog,
+				       optarg, 1, SIZE_MAX)) {
+				goto fail_arg;
+			}
+			break;
+		case 'M':
+			if (parse_size("Dedup buffer size", &cfg.dedup_buffer,
+				       optarg, 0, SIZE_MAX)) {
+				goto fail_arg;
+			}
+			break;
+		case 'm':
+			if (parse_size("Memory limit", &cfg.memory_limit,
+				       optarg, 0, SIZE_MAX)) {
+				goto fail_arg;
+			}
+			break;
+		case 'I':
+			cfg.skip_incompressible = true;
+			break;
+		case 'P':
+			if (file_policy_add_rule(&cfg.policy, optarg))
+				exit(EXIT_FAILURE);
+			break;
+		case 'T':
+			cfg.trace_file = optarg;
 			break;
 		case 'X':
 			cfg.comp_extra = optarg;
@@ -160,6 +229,7 @@ static void process_args(int argc, char **argv)
 		case 'h':
 			printf(usagestr, SQFS_DEFAULT_BLOCK_SIZE,
 			       SQFS_DEVBLK_SIZE);
+			fputs(policystr, stdout);
 			compressor_print_available();
 			exit(EXIT_SUCCESS);
 		case 'V':
@@ -173,6 +243,7 @@ static void process_args(int argc, char **argv)
 	if (cfg.num_jobs < 1)
 		cfg.num_jobs = 1;
 
+	/* a memory limit replaces this once it is applied */
 	if (cfg.max_backlog < 1)
 		cfg.max_backlog = 10 * cfg.num_jobs;
 
@@ -205,8 +276,11 @@ static int write_file(tar_header_decoded_t *hdr, file_info_t *fi,
 	sqfs_inode_generic_t *inode;
 	size_t max_blk_count;
 	sqfs_file_t *file;
+	int ret, flags;
 	sqfs_u64 sum;
-	int ret;
+
+	if (sqfs_writer_file_flags(&sqfs, &cfg, hdr->name, &flags))
+		return -1;
 
 	max_blk_count = filesize / cfg.block_size;
 	if (filesize % cfg.block_size)
@@ -242,7 +316,7 @@ static int write_file(tar_header_decoded_t *hdr, file_info_t *fi,
 		}
 	}
 
-	ret = write_data_from_file(hdr->name, sqfs.data, inode, file, 0);
+	ret = write_data_from_file(hdr->name, sqfs.data, inode, file, flags);
 	file->destroy(file);
 
 	sqfs.stats.bytes_read += filesize;
@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_common.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+static void mem_destroy(sqfs_file_t *base)
+{
+	mem_file_t *file = (mem_file_t *)base;
+
+	free(file->data);
+	free(file);
+}
+
+static int mem_read_at(sqfs_file_t *base, sqfs_u64 offset,
+		       void *buffer, size_t size)
+{
+	mem_file_t *file = (mem_file_t *)base;
+
+	if (offset > file->size || size > file->size - offset)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	memcpy(buffer, file->data + offset, size);
+	file->num_reads += 1;
+	return 0;
+}
+
+static int mem_truncate(sqfs_file_t *base, sqfs_u64 size)
+{
+	mem_file_t *file = (mem_file_t *)base;
+	size_t new_max;
+	void *new;
+
+	if (size > file->max_size) {
+		new_max = file->max_size ? file->max_size : 4096;
+		while (new_max < size)
+			new_max *= 2;
+
+		new = realloc(file->data, new_max);
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		file->data = new;
+		file->max_size = new_max;
+	}
+
+	if (size > file->size)
+		memset(file->data + file->size, 0, size - file->size);
+
+	file->size = size;
+	return 0;
+}
+
+static int mem_write_at(sqfs_file_t *base, sqfs_u64 offset,
+			const void *buffer, size_t size)
+{
+	mem_file_t *file = (mem_file_t *)base;
+	int ret;
+
+	if (offset + size > file->size) {
+		ret = mem_truncate(base, offset + size);
+		if (ret)
+			return ret;
+	}
+
+	memcpy(file->data + offset, buffer, size);
+	return 0;
+}
+
+static sqfs_u64 mem_get_size(const sqfs_file_t *base)
+{
+	return ((const mem_file_t *)base)->size;
+}
+
+mem_file_t *mem_file_create(void)
+{
+	mem_file_t *file = calloc(1, sizeof(*file));
+
+	if (file == NULL)
+		return NULL;
+
+	file->base.destroy = mem_destroy;
+	file->base.read_at = mem_read_at;
+	file->base.write_at = mem_write_at;
+	file->base.get_size = mem_get_size;
+	file->base.truncate = mem_truncate;
+	return file;
+}
+
+void fill_pattern(sqfs_u8 *data, size_t size, unsigned int seed)
+{
+	static const char *words[] = {
+		"squash", "block ", "inode ", "fragment", "\n", "table ",
+		"cache ", "data ",
+	};
+	size_t i = 0, len;
+	const char *w;
+
+	while (i < size) {
+		seed = seed * 1103515245 + 12345;
+		w = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+		len = strlen(w);
+
+		if (len > size - i)
+			len = size - i;
+
+		memcpy(data + i, w, len);
+		i += len;
+	}
+}
+
+void find_colliding_seeds(size_t size, unsigned int first,
+			  unsigned int *a, unsigned int *b)
+{
+	sqfs_u32 crc[2048];
+	unsigned int i, j;
+	sqfs_u8 *data;
+
+	data = malloc(size);
+	assert(data != NULL);
+
+	for (i = 0; i < sizeof(crc) / sizeof(crc[0]); ++i) {
+		fill_pattern(data, size, first + i);
+		crc[i] = crc32(0, data, size);
+
+		for (j = 0; j < i; ++j) {
+			if ((crc[j] % 1024) == (crc[i] % 1024) &&
+			    crc[j] != crc[i]) {
+				*a = first + j;
+				*b = first + i;
+				free(data);
+				return;
+			}
+		}
+	}
+
+	assert(0);
+}
+
+void image_create(test_image_t *img, size_t block_size,
+		  unsigned int num_workers, size_t max_backlog)
+{
+	sqfs_compressor_config_t cfg;
+
+	memset(img, 0, sizeof(*img));
+	img->block_size = block_size;
+
+	img->file = mem_file_create();
+	assert(img->file != NULL);
+
+	assert(sqfs_compressor_config_init(&cfg, SQFS_COMP_GZIP,
+					   block_size, 0) == 0);
+	img->cmp = sqfs_compressor_create(&cfg);
+	assert(img->cmp != NULL);
+
+	cfg.flags |= SQFS_COMP_FLAG_UNCOMPRESS;
+	img->uncmp = sqfs_compressor_create(&cfg);
+	assert(img->uncmp != NULL);
+
+	img->wr = sqfs_data_writer_create(block_size, img->cmp, num_workers,
+					  max_backlog, 4096,
+					  (sqfs_file_t *)img->file);
+	assert(img->wr != NULL);
+}
+
+sqfs_inode_generic_t *image_add_file(test_image_t *img, const sqfs_u8 *data,
+				     size_t size, sqfs_u32 flags)
+{
+	sqfs_inode_generic_t *inode;
+
+	inode = calloc(1, sizeof(*inode) +
+		       (size / img->block_size + 1) * sizeof(sqfs_u32));
+	assert(inode != NULL);
+
+	inode->base.type = SQFS_INODE_FILE;
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	sqfs_inode_set_file_size(inode, size);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+
+	assert(sqfs_data_writer_begin_file(img->wr, inode, flags) == 0);
+	assert(sqfs_data_writer_append(img->wr, data, size) == 0);
+	assert(sqfs_data_writer_end_file(img->wr) == 0);
+	return inode;
+}
+
+void image_finish(test_image_t *img)
+{
+	assert(sqfs_data_writer_finish(img->wr) == 0);
+
+	memset(&img->super, 0, sizeof(img->super));
+	img->super.directory_table_start = img->file->size;
+	assert(sqfs_data_writer_write_fragment_table(img->wr,
+						     &img->super) == 0);
+	img->super.bytes_used = img->file->size;
+}
+
+sqfs_data_reader_t *image_open_reader(test_image_t *img)
+{
+	sqfs_data_reader_t *rd;
+
+	rd = sqfs_data_reader_create((sqfs_file_t *)img->file,
+				     img->block_size, img->uncmp);
+	assert(rd != NULL);
+	assert(sqfs_data_reader_load_fragment_table(rd, &img->super) == 0);
+	return rd;
+}
+
+void image_destroy(test_image_t *img)
+{
+	if (img->wr != NULL)
+		sqfs_data_writer_destroy(img->wr);
+	if (img->uncmp != NULL)
+		img->uncmp->destroy(img->uncmp);
+	if (img->cmp != NULL)
+		img->cmp->destroy(img->cmp);
+
+	img->file->base.destroy((sqfs_file_t *)img->file);
+}
+
+void image_get_stats(test_image_t *img, sqfs_data_writer_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->size = sizeof(*stats);
+	assert(sqfs_data_writer_get_stats(img->wr, stats) == 0);
+}
+
+sqfs_u64 file_block_start(const sqfs_inode_generic_t *inode)
+{
+	sqfs_u64 start;
+
+	assert(sqfs_inode_get_file_block_start(inode, &start) == 0);
+	return start;
+}
+
+void check_reader_stats(sqfs_data_reader_t *rd, sqfs_data_reader_stats_t *last,
+			sqfs_u64 hits, sqfs_u64 misses, size_t cached)
+{
+	sqfs_data_reader_stats_t stats;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.size = sizeof(stats);
+	assert(sqfs_data_reader_get_stats(rd, &stats) == 0);
+
+	assert(stats.cache_hits - last->cache_hits == hits);
+	assert(stats.cache_misses - last->cache_misses == misses);
+	assert(stats.cached_blocks == cached);
+
+	*last = stats;
+}
+
+void check_file(sqfs_data_reader_t *rd, const sqfs_inode_generic_t *inode,
+		const sqfs_u8 *data, size_t size)
+{
+	sqfs_u8 *buffer = malloc(size + 1);
+
+	assert(buffer != NULL);
+	memset(buffer, 0xAA, size + 1);
+
+	assert(sqfs_data_reader_read(rd, inode, 0, buffer,
+				     size) == (sqfs_s32)size);
+	assert(memcmp(buffer, data, size) == 0);
+	assert(buffer[size] == 0xAA);
+	free(buffer);
+}
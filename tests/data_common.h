@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_common.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef DATA_COMMON_H
+#define DATA_COMMON_H
+
+#include "sqfs/data_writer.h"
+#include "sqfs/data_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/inode.h"
+#include "sqfs/super.h"
+#include "sqfs/io.h"
+
+/* An in-memory sqfs_file_t that counts the read requests made on it. */
+typedef struct {
+	sqfs_file_t base;
+
+	sqfs_u8 *data;
+	size_t size;
+	size_t max_size;
+
+	size_t num_reads;
+} mem_file_t;
+
+/*
+  An image in memory, with a data writer packing files into it and a
+  compressor for reading them back.
+ */
+typedef struct {
+	mem_file_t *file;
+	sqfs_compressor_t *cmp;
+	sqfs_compressor_t *uncmp;
+	sqfs_data_writer_t *wr;
+	sqfs_super_t super;
+	size_t block_size;
+} test_image_t;
+
+mem_file_t *mem_file_create(void);
+
+/* deterministic, compressible test data that differs for each seed */
+void fill_pattern(sqfs_u8 *data, size_t size, unsigned int seed);
+
+/*
+  Blocks and fragments are indexed by (size << 32 | crc32) modulo a power of
+  two bucket count of at most 1024 in the tests. Find two seeds, starting
+  at the given one, for which fill_pattern generates data of the given size
+  that always ends up in the same bucket, but with a different checksum.
+ */
+void find_colliding_seeds(size_t size, unsigned int first,
+			  unsigned int *a, unsigned int *b);
+
+/* Create an empty image with a GZIP data writer on top. */
+void image_create(test_image_t *img, size_t block_size,
+		  unsigned int num_workers, size_t max_backlog);
+
+/* Pack a file and return the inode that the data writer filled in. */
+sqfs_inode_generic_t *image_add_file(test_image_t *img, const sqfs_u8 *data,
+				     size_t size, sqfs_u32 flags);
+
+/* Flush the data writer and write the fragment table after the data. */
+void image_finish(test_image_t *img);
+
+/* Create a data reader for the finished image. */
+sqfs_data_reader_t *image_open_reader(test_image_t *img);
+
+void image_destroy(test_image_t *img);
+
+void image_get_stats(test_image_t *img, sqfs_data_writer_stats_t *stats);
+
+sqfs_u64 file_block_start(const sqfs_inode_generic_t *inode);
+
+/*
+  Check the block cache statistics of a data reader against the ones from
+  the previous call: the number of new hits and misses, and the number of
+  blocks that are cached now. The previous statistics are kept in *last,
+  which must be zero initialized before the first call.
+ */
+void check_reader_stats(sqfs_data_reader_t *rd, sqfs_data_reader_stats_t *last,
+			sqfs_u64 hits, sqfs_u64 misses, size_t cached);
+
+/* Read a whole file back and compare it with the expected data. */
+void check_file(sqfs_data_reader_t *rd, const sqfs_inode_generic_t *inode,
+		const sqfs_u8 *data, size_t size);
+
+#endif /* DATA_COMMON_H */
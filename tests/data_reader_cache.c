@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_reader_cache.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define NUM_BLOCKS (16)
+#define TAIL_SIZE (1000)
+#define FILE_SIZE (NUM_BLOCKS * BLOCK_SIZE + TAIL_SIZE)
+#define CACHE_BLOCKS (4)
+
+static sqfs_inode_generic_t *inode;
+static sqfs_data_reader_stats_t last_stats;
+static size_t last_reads;
+static test_image_t img;
+
+/* one file with NUM_BLOCKS blocks, each from a different seed, and a tail */
+static void pack_image(void)
+{
+	sqfs_u8 data[FILE_SIZE];
+	size_t i;
+
+	for (i = 0; i < NUM_BLOCKS; ++i)
+		fill_pattern(data + i * BLOCK_SIZE, BLOCK_SIZE, i);
+
+	fill_pattern(data + i * BLOCK_SIZE, TAIL_SIZE, i);
+
+	image_create(&img, BLOCK_SIZE, 1, 10);
+	inode = image_add_file(&img, data, FILE_SIZE, 0);
+	image_finish(&img);
+}
+
+/* read a whole block (or the tail end) and check its content */
+static void read_block(sqfs_data_reader_t *rd, size_t i)
+{
+	size_t size = i < NUM_BLOCKS ? BLOCK_SIZE : TAIL_SIZE;
+	sqfs_u8 data[BLOCK_SIZE], buffer[BLOCK_SIZE];
+
+	fill_pattern(data, size, i);
+	memset(buffer, 0, sizeof(buffer));
+
+	assert(sqfs_data_reader_read(rd, inode, i * BLOCK_SIZE, buffer,
+				     size) == (sqfs_s32)size);
+	assert(memcmp(buffer, data, size) == 0);
+}
+
+/*
+  Check the statistics since the last call. Every miss must be exactly one
+  read from the file, a hit none at all.
+ */
+static void check_stats(sqfs_data_reader_t *rd, sqfs_u64 hits,
+			sqfs_u64 misses, size_t cached)
+{
+	check_reader_stats(rd, &last_stats, hits, misses, cached);
+
+	assert(img.file->num_reads - last_reads == misses);
+	last_reads = img.file->num_reads;
+}
+
+static void check_cache_size(sqfs_data_reader_t *rd, size_t size)
+{
+	sqfs_data_reader_stats_t stats;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.size = sizeof(stats) - 1;
+	assert(sqfs_data_reader_get_stats(rd, &stats) ==
+	       SQFS_ERROR_UNSUPPORTED);
+
+	stats.size = sizeof(stats);
+	assert(sqfs_data_reader_get_stats(rd, &stats) == 0);
+	assert(stats.cache_size == size);
+}
+
+int main(void)
+{
+	sqfs_data_reader_t *rd;
+	size_t i;
+
+	pack_image();
+
+	rd = image_open_reader(&img);
+	last_reads = img.file->num_reads;
+
+	check_cache_size(rd, 8 * BLOCK_SIZE);
+
+	/* rounded down to whole blocks */
+	assert(sqfs_data_reader_set_cache_size(rd, CACHE_BLOCKS * BLOCK_SIZE +
+					       BLOCK_SIZE / 2) == 0);
+	check_cache_size(rd, CACHE_BLOCKS * BLOCK_SIZE);
+
+	/* fill the cache, then everything in it is a hit */
+	for (i = 0; i < CACHE_BLOCKS; ++i)
+		read_block(rd, i);
+	check_stats(rd, 0, CACHE_BLOCKS, CACHE_BLOCKS);
+
+	for (i = 0; i < CACHE_BLOCKS; ++i)
+		read_block(rd, i);
+	check_stats(rd, CACHE_BLOCKS, 0, CACHE_BLOCKS);
+
+	/* the least recently used block is dropped first */
+	read_block(rd, 4);
+	read_block(rd, 1);
+	check_stats(rd, 1, 1, CACHE_BLOCKS);
+
+	read_block(rd, 0);
+	check_stats(rd, 0, 1, CACHE_BLOCKS);
+
+	/* block 0 replaced block 2, the rest is still there */
+	read_block(rd, 4);
+	read_block(rd, 1);
+	read_block(rd, 0);
+	check_stats(rd, 3, 0, CACHE_BLOCKS);
+
+	read_block(rd, 2);
+	check_stats(rd, 0, 1, CACHE_BLOCKS);
+
+	/* the fragment block is cached like any other block */
+	read_block(rd, NUM_BLOCKS);
+	read_block(rd, NUM_BLOCKS);
+	check_stats(rd, 1, 1, CACHE_BLOCKS);
+
+	/* a sequential read through the whole file only replaces blocks */
+	for (i = 5; i < NUM_BLOCKS; ++i)
+		read_block(rd, i);
+	check_stats(rd, 0, NUM_BLOCKS - 5, CACHE_BLOCKS);
+
+	/* shrinking keeps the most recently used blocks */
+	assert(sqfs_data_reader_set_cache_size(rd, 2 * BLOCK_SIZE) == 0);
+	check_cache_size(rd, 2 * BLOCK_SIZE);
+	check_stats(rd, 0, 0, 2);
+
+	read_block(rd, NUM_BLOCKS - 2);
+	read_block(rd, NUM_BLOCKS - 1);
+	check_stats(rd, 2, 0, 2);
+
+	read_block(rd, NUM_BLOCKS - 3);
+	check_stats(rd, 0, 1, 2);
+
+	/* at least one block is always cached */
+	assert(sqfs_data_reader_set_cache_size(rd, 0) == 0);
+	check_cache_size(rd, BLOCK_SIZE);
+	check_stats(rd, 0, 0, 1);
+
+	read_block(rd, NUM_BLOCKS - 3);
+	read_block(rd, 7);
+	read_block(rd, 7);
+	check_stats(rd, 2, 1, 1);
+
+	/* growing again does not bring anything back */
+	assert(sqfs_data_reader_set_cache_size(rd, 8 * BLOCK_SIZE) == 0);
+	check_cache_size(rd, 8 * BLOCK_SIZE);
+	check_stats(rd, 0, 0, 1);
+
+	read_block(rd, 0);
+	read_block(rd, 7);
+	check_stats(rd, 1, 1, 2);
+
+	sqfs_data_reader_destroy(rd);
+	free(inode);
+	image_destroy(&img);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_reader_index.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define FILE_BLOCKS (150)
+#define TAIL_SIZE (1000)
+#define FILE_SIZE (FILE_BLOCKS * BLOCK_SIZE + TAIL_SIZE)
+
+/* more files than the data reader keeps block offset tables for */
+#define NUM_FILES (6)
+
+static sqfs_inode_generic_t *inodes[NUM_FILES];
+static sqfs_u8 *content[NUM_FILES];
+static test_image_t img;
+
+/*
+  Every file has different block data, with a few sparse blocks in between,
+  so the on-disk block sizes vary. One file is stored uncompressed.
+ */
+static void gen_file(size_t f)
+{
+	size_t i;
+
+	content[f] = malloc(FILE_SIZE);
+	assert(content[f] != NULL);
+
+	for (i = 0; i <= FILE_BLOCKS; ++i) {
+		if ((i % 10) == 3) {
+			memset(content[f] + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+		} else {
+			fill_pattern(content[f] + i * BLOCK_SIZE,
+				     i < FILE_BLOCKS ? BLOCK_SIZE : TAIL_SIZE,
+				     f * 1000 + i);
+		}
+	}
+}
+
+static void pack_image(void)
+{
+	size_t f;
+
+	image_create(&img, BLOCK_SIZE, 1, 10);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		gen_file(f);
+
+		inodes[f] = image_add_file(&img, content[f], FILE_SIZE,
+					   f == 1 ? SQFS_BLK_DONT_COMPRESS : 0);
+		assert(inodes[f]->num_file_blocks == FILE_BLOCKS);
+
+		/* offset tables must not be mixed up by inode number alone */
+		inodes[f]->base.inode_number = f % 2;
+	}
+
+	image_finish(&img);
+}
+
+static void check_range(sqfs_data_reader_t *rd, size_t f, sqfs_u64 offset,
+			size_t size)
+{
+	static sqfs_u8 buffer[3 * BLOCK_SIZE];
+	size_t expect = 0;
+
+	assert(size <= sizeof(buffer));
+	memset(buffer, 0xAA, sizeof(buffer));
+
+	if (offset < FILE_SIZE)
+		expect = FILE_SIZE - offset < size ? FILE_SIZE - offset : size;
+
+	assert(sqfs_data_reader_read(rd, inodes[f], offset, buffer,
+				     size) == (sqfs_s32)expect);
+
+	if (expect > 0)
+		assert(memcmp(buffer, content[f] + offset, expect) == 0);
+}
+
+static void check_block(sqfs_data_reader_t *rd, size_t f, size_t i)
+{
+	const sqfs_u8 *ptr;
+	sqfs_block_t *blk;
+	size_t size;
+
+	check_range(rd, f, i * BLOCK_SIZE, BLOCK_SIZE);
+
+	if (i >= FILE_BLOCKS) {
+		assert(sqfs_data_reader_get_block(rd, inodes[f], i, &blk) ==
+		       SQFS_ERROR_OUT_OF_BOUNDS);
+		assert(sqfs_data_reader_get_block_ref(rd, inodes[f], i, &ptr,
+						      &size) ==
+		       SQFS_ERROR_OUT_OF_BOUNDS);
+		return;
+	}
+
+	assert(sqfs_data_reader_get_block(rd, inodes[f], i, &blk) == 0);
+	assert(blk->size == BLOCK_SIZE);
+	assert(memcmp(blk->data, content[f] + i * BLOCK_SIZE,
+		      BLOCK_SIZE) == 0);
+	free(blk);
+
+	assert(sqfs_data_reader_get_block_ref(rd, inodes[f], i, &ptr,
+					      &size) == 0);
+	assert(size == BLOCK_SIZE);
+	assert(memcmp(ptr, content[f] + i * BLOCK_SIZE, BLOCK_SIZE) == 0);
+	sqfs_data_reader_release_ref(rd, ptr);
+}
+
+int main(void)
+{
+	/* both sides of the point where offset tables are used */
+	static const size_t blocks[] = {
+		0, 1, 62, 63, 64, 65, 99, 127, 128, FILE_BLOCKS - 1,
+		FILE_BLOCKS,
+	};
+	sqfs_data_reader_t *rd;
+	size_t f, i;
+
+	pack_image();
+	rd = image_open_reader(&img);
+
+	/* alternate between the files, so offset tables get replaced */
+	for (i = 0; i < sizeof(blocks) / sizeof(blocks[0]); ++i) {
+		for (f = 0; f < NUM_FILES; ++f)
+			check_block(rd, f, blocks[i]);
+	}
+
+	for (f = NUM_FILES; f-- > 0; ) {
+		for (i = sizeof(blocks) / sizeof(blocks[0]); i-- > 0; )
+			check_block(rd, f, blocks[i]);
+	}
+
+	/* every block of a file, back to front */
+	for (i = FILE_BLOCKS + 1; i-- > 0; )
+		check_block(rd, NUM_FILES - 1, i);
+
+	/* reads crossing into an indexed block, into the tail and past it */
+	for (f = 0; f < NUM_FILES; ++f) {
+		check_range(rd, f, 63 * BLOCK_SIZE + 100, 2 * BLOCK_SIZE);
+		check_range(rd, f, 62 * BLOCK_SIZE, 3 * BLOCK_SIZE);
+		check_range(rd, f, (FILE_BLOCKS - 1) * BLOCK_SIZE + 10,
+			    2 * BLOCK_SIZE);
+		check_range(rd, f, FILE_SIZE - 1, BLOCK_SIZE);
+		check_range(rd, f, FILE_SIZE, BLOCK_SIZE);
+		check_range(rd, f, FILE_SIZE + 3 * BLOCK_SIZE, BLOCK_SIZE);
+	}
+
+	/* whole files, so every offset table entry is used */
+	for (f = 0; f < NUM_FILES; ++f)
+		check_file(rd, inodes[f], content[f], FILE_SIZE);
+
+	sqfs_data_reader_destroy(rd);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		free(content[f]);
+		free(inodes[f]);
+	}
+
+	image_destroy(&img);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,289 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_reader_readahead.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define MAX_BLOCKS (10)
+
+/* the file that is read ahead as a single run of blocks */
+#define RUN_FILE (5)
+
+/*
+  Blocks are '#' for data and '0' for a sparse block. The tail end is stored
+  in a fragment unless the file is flagged otherwise. The last file has the
+  same content as the first one, so it shares its blocks on disk.
+ */
+static const struct {
+	const char *blocks;
+	size_t tail;
+	sqfs_u32 flags;
+} files[] = {
+	{ "#####", 1000, 0 },
+	{ "##00##", 300, SQFS_BLK_DONT_FRAGMENT },
+	{ "####", 0, SQFS_BLK_DONT_COMPRESS },
+	{ "", 700, 0 },
+	{ "##########", 0, 0 },
+	{ "###0####", 500, 0 },
+	{ "#####", 1000, 0 },
+};
+
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+static sqfs_inode_generic_t *inodes[NUM_FILES];
+static sqfs_u8 *content[NUM_FILES];
+static test_image_t img;
+
+static size_t file_size(size_t f)
+{
+	return strlen(files[f].blocks) * BLOCK_SIZE + files[f].tail;
+}
+
+static void gen_file(size_t f)
+{
+	size_t i, count = strlen(files[f].blocks);
+	unsigned int seed = (f == NUM_FILES - 1 ? 0 : f) * 100;
+
+	content[f] = malloc(file_size(f) + 1);
+	assert(content[f] != NULL);
+
+	for (i = 0; i < count; ++i) {
+		if (files[f].blocks[i] == '0') {
+			memset(content[f] + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+		} else {
+			fill_pattern(content[f] + i * BLOCK_SIZE, BLOCK_SIZE,
+				     seed + i);
+		}
+	}
+
+	fill_pattern(content[f] + i * BLOCK_SIZE, files[f].tail, seed + i);
+}
+
+static void pack_image(void)
+{
+	size_t f;
+
+	image_create(&img, BLOCK_SIZE, 1, 10);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		gen_file(f);
+		inodes[f] = image_add_file(&img, content[f], file_size(f),
+					   files[f].flags);
+	}
+
+	image_finish(&img);
+}
+
+/* the number of blocks of a file that are actually stored */
+static size_t stored_blocks(size_t f)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < inodes[f]->num_file_blocks; ++i) {
+		if (!SQFS_IS_SPARSE_BLOCK(inodes[f]->block_sizes[i]))
+			++count;
+	}
+
+	return count;
+}
+
+static void check_block(sqfs_data_reader_t *rd, size_t f, size_t i)
+{
+	size_t size = file_size(f) - i * BLOCK_SIZE;
+	sqfs_block_t *blk;
+
+	if (size > BLOCK_SIZE)
+		size = BLOCK_SIZE;
+
+	assert(sqfs_data_reader_get_block(rd, inodes[f], i, &blk) == 0);
+	assert(blk->size == size);
+	assert(memcmp(blk->data, content[f] + i * BLOCK_SIZE, size) == 0);
+	free(blk);
+}
+
+static void check_fragment(sqfs_data_reader_t *rd, size_t f)
+{
+	size_t offset = inodes[f]->num_file_blocks * BLOCK_SIZE;
+	sqfs_block_t *blk;
+
+	assert(sqfs_data_reader_get_fragment(rd, inodes[f], &blk) == 0);
+
+	if (offset >= file_size(f)) {
+		assert(blk == NULL);
+		return;
+	}
+
+	assert(blk != NULL);
+	assert(blk->size == file_size(f) - offset);
+	assert(memcmp(blk->data, content[f] + offset, blk->size) == 0);
+	free(blk);
+}
+
+static void queue_all(sqfs_data_reader_t *rd)
+{
+	size_t f;
+
+	for (f = 0; f < NUM_FILES; ++f)
+		assert(sqfs_data_reader_queue_file(rd, inodes[f]) == 0);
+}
+
+/*
+  Extract everything in order. Each stored block is read exactly once, or
+  together with the blocks next to it if they are read ahead.
+ */
+static void read_in_order(sqfs_data_reader_t *rd, unsigned int workers)
+{
+	size_t f, i, reads, expect = 0;
+
+	reads = img.file->num_reads;
+	queue_all(rd);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		for (i = 0; i < inodes[f]->num_file_blocks; ++i)
+			check_block(rd, f, i);
+
+		expect += stored_blocks(f);
+	}
+
+#ifdef WITH_PTHREAD
+	if (workers > 0) {
+		assert(img.file->num_reads - reads <= expect);
+	} else {
+		assert(img.file->num_reads - reads == expect);
+	}
+#else
+	(void)workers;
+	assert(img.file->num_reads - reads == expect);
+#endif
+
+	for (f = 0; f < NUM_FILES; ++f)
+		check_fragment(rd, f);
+}
+
+/*
+  The blocks of a file are stored back to back, so they are read ahead with
+  a single read, across the sparse block. The tail end in the fragment block
+  costs exactly one more.
+ */
+static void read_run(unsigned int workers)
+{
+	sqfs_data_reader_t *rd;
+	size_t i, reads;
+
+	rd = image_open_reader(&img);
+	assert(sqfs_data_reader_set_readahead(rd, workers, MAX_BLOCKS) == 0);
+
+	reads = img.file->num_reads;
+	assert(sqfs_data_reader_queue_file(rd, inodes[RUN_FILE]) == 0);
+
+	for (i = 0; i < inodes[RUN_FILE]->num_file_blocks; ++i)
+		check_block(rd, RUN_FILE, i);
+
+#ifdef WITH_PTHREAD
+	assert(img.file->num_reads - reads == 1);
+#else
+	assert(img.file->num_reads - reads == stored_blocks(RUN_FILE));
+#endif
+
+	reads = img.file->num_reads;
+	check_fragment(rd, RUN_FILE);
+	assert(img.file->num_reads - reads == 1);
+
+	sqfs_data_reader_destroy(rd);
+}
+
+/*
+  Skip files and blocks, go back to blocks that were dropped, read blocks of
+  files that were never queued and interleave fragments.
+ */
+static void read_out_of_order(sqfs_data_reader_t *rd, unsigned int workers)
+{
+	static const struct {
+		size_t file;
+		size_t block;
+	} seq[] = {
+		{ 0, 0 }, { 0, 2 }, { 0, 1 }, { 1, 1 }, { 4, 3 }, { 4, 4 },
+		{ 1, 5 }, { 4, 5 }, { 4, 9 }, { 4, 6 }, { 5, 0 }, { 5, 4 },
+		{ 2, 3 }, { 2, 2 }, { 5, 1 }, { 6, 2 }, { 6, 0 },
+	};
+	size_t i, f;
+
+	queue_all(rd);
+
+	for (i = 0; i < sizeof(seq) / sizeof(seq[0]); ++i) {
+		check_block(rd, seq[i].file, seq[i].block);
+
+		if (i % 4 == 3)
+			check_fragment(rd, seq[i].file);
+	}
+
+	/* reconfiguring drops everything that is still in flight */
+	queue_all(rd);
+	check_block(rd, 0, 0);
+	assert(sqfs_data_reader_set_readahead(rd, workers, 2) == 0);
+
+	for (f = NUM_FILES; f-- > 0; )
+		assert(sqfs_data_reader_queue_file(rd, inodes[f]) == 0);
+
+	for (f = NUM_FILES; f-- > 0; ) {
+		for (i = inodes[f]->num_file_blocks; i-- > 0; )
+			check_block(rd, f, i);
+	}
+
+	/* whatever is left is dropped when the reader is destroyed */
+	queue_all(rd);
+	check_block(rd, 1, 0);
+}
+
+static void run_test(unsigned int workers, size_t max_blocks)
+{
+	sqfs_data_reader_t *rd;
+
+	rd = image_open_reader(&img);
+	assert(sqfs_data_reader_set_readahead(rd, workers, max_blocks) == 0);
+
+	read_in_order(rd, workers);
+	read_in_order(rd, workers);
+	read_out_of_order(rd, workers);
+
+	sqfs_data_reader_destroy(rd);
+}
+
+int main(void)
+{
+	size_t f;
+
+	pack_image();
+
+	/* the blocks of the last file are the ones of the first */
+	assert(file_block_start(inodes[0]) ==
+	       file_block_start(inodes[NUM_FILES - 1]));
+
+	run_test(0, 0);
+	run_test(1, 1);
+	run_test(1, 0);
+	run_test(2, 3);
+	run_test(4, 0);
+	run_test(4, 64);
+
+	read_run(1);
+	read_run(4);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		free(content[f]);
+		free(inodes[f]);
+	}
+
+	image_destroy(&img);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_reader_ref.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define CACHE_BLOCKS (2)
+
+/*
+  The tail ends of the first three files share a fragment block, the last
+  file has no tail end and its second block is sparse.
+ */
+static const size_t file_size[] = {
+	8 * BLOCK_SIZE + 1000,
+	500,
+	700,
+	2 * BLOCK_SIZE,
+};
+
+#define NUM_FILES (sizeof(file_size) / sizeof(file_size[0]))
+
+static sqfs_inode_generic_t *inodes[NUM_FILES];
+static sqfs_u8 *content[NUM_FILES];
+static sqfs_data_reader_stats_t last_stats;
+static test_image_t img;
+
+static void pack_image(void)
+{
+	size_t f;
+
+	image_create(&img, BLOCK_SIZE, 1, 10);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		content[f] = malloc(file_size[f]);
+		assert(content[f] != NULL);
+		fill_pattern(content[f], file_size[f], f);
+
+		if (f == NUM_FILES - 1)
+			memset(content[f] + BLOCK_SIZE, 0, BLOCK_SIZE);
+
+		inodes[f] = image_add_file(&img, content[f], file_size[f], 0);
+	}
+
+	image_finish(&img);
+}
+
+static void check_stats(sqfs_data_reader_t *rd, sqfs_u64 hits,
+			sqfs_u64 misses, size_t cached)
+{
+	check_reader_stats(rd, &last_stats, hits, misses, cached);
+}
+
+static const sqfs_u8 *get_block(sqfs_data_reader_t *rd, size_t f, size_t i)
+{
+	const sqfs_u8 *ptr;
+	size_t size;
+
+	assert(sqfs_data_reader_get_block_ref(rd, inodes[f], i, &ptr,
+					      &size) == 0);
+	assert(size == BLOCK_SIZE);
+	assert(memcmp(ptr, content[f] + i * BLOCK_SIZE, size) == 0);
+	return ptr;
+}
+
+static const sqfs_u8 *get_tail(sqfs_data_reader_t *rd, size_t f)
+{
+	size_t size, tail = file_size[f] % BLOCK_SIZE;
+	const sqfs_u8 *ptr;
+
+	assert(sqfs_data_reader_get_fragment_ref(rd, inodes[f], &ptr,
+						 &size) == 0);
+	assert(size == tail);
+
+	if (tail == 0) {
+		assert(ptr == NULL);
+	} else {
+		assert(memcmp(ptr, content[f] + file_size[f] - tail,
+			      tail) == 0);
+	}
+
+	return ptr;
+}
+
+/* read through the cache, which drops every unreferenced block */
+static void flush_cache(sqfs_data_reader_t *rd)
+{
+	sqfs_u8 buffer[BLOCK_SIZE];
+	size_t i;
+
+	for (i = 5; i < 5 + CACHE_BLOCKS; ++i) {
+		assert(sqfs_data_reader_read(rd, inodes[0], i * BLOCK_SIZE,
+					     buffer, BLOCK_SIZE) == BLOCK_SIZE);
+	}
+}
+
+int main(void)
+{
+	const sqfs_u8 *a, *b, *c, *refs[5];
+	sqfs_data_reader_t *rd;
+	sqfs_u32 idx[3], off[3];
+	size_t i;
+
+	pack_image();
+
+	for (i = 0; i < 3; ++i)
+		sqfs_inode_get_frag_location(inodes[i], idx + i, off + i);
+
+	assert(idx[0] == idx[1] && idx[0] == idx[2]);
+
+	rd = image_open_reader(&img);
+	assert(sqfs_data_reader_set_cache_size(rd, CACHE_BLOCKS *
+					       BLOCK_SIZE) == 0);
+
+	/* the same block is referenced twice */
+	a = get_block(rd, 0, 0);
+	b = get_block(rd, 0, 0);
+	assert(a == b);
+	check_stats(rd, 1, 1, 1);
+
+	/* it stays while any reference is left */
+	flush_cache(rd);
+	check_stats(rd, 0, CACHE_BLOCKS, CACHE_BLOCKS);
+
+	sqfs_data_reader_release_ref(rd, a);
+	flush_cache(rd);
+	check_stats(rd, 0, CACHE_BLOCKS, CACHE_BLOCKS);
+	assert(memcmp(b, content[0], BLOCK_SIZE) == 0);
+
+	c = get_block(rd, 0, 0);
+	assert(c == b);
+	check_stats(rd, 1, 0, CACHE_BLOCKS);
+
+	sqfs_data_reader_release_ref(rd, b);
+	sqfs_data_reader_release_ref(rd, c);
+	flush_cache(rd);
+	check_stats(rd, 0, CACHE_BLOCKS, CACHE_BLOCKS);
+
+	sqfs_data_reader_release_ref(rd, get_block(rd, 0, 0));
+	check_stats(rd, 0, 1, CACHE_BLOCKS);
+
+	/* tail ends point into one fragment block, released through any */
+	for (i = 0; i < 3; ++i)
+		refs[i] = get_tail(rd, i);
+	check_stats(rd, 2, 1, CACHE_BLOCKS);
+
+	for (i = 1; i < 3; ++i)
+		assert(refs[i] - refs[0] == (ptrdiff_t)off[i] - off[0]);
+
+	sqfs_data_reader_release_ref(rd, refs[1]);
+	sqfs_data_reader_release_ref(rd, refs[0]);
+	flush_cache(rd);
+	check_stats(rd, 0, CACHE_BLOCKS, CACHE_BLOCKS);
+
+	sqfs_data_reader_release_ref(rd, get_tail(rd, 1));
+	check_stats(rd, 1, 0, CACHE_BLOCKS);
+
+	sqfs_data_reader_release_ref(rd, refs[2]);
+	flush_cache(rd);
+	check_stats(rd, 0, CACHE_BLOCKS, CACHE_BLOCKS);
+
+	sqfs_data_reader_release_ref(rd, get_tail(rd, 2));
+	check_stats(rd, 0, 1, CACHE_BLOCKS);
+
+	/* no tail end, and sparse blocks do not go through the cache */
+	a = get_tail(rd, 3);
+	sqfs_data_reader_release_ref(rd, a);
+
+	a = get_block(rd, 3, 1);
+	b = get_block(rd, 3, 1);
+	sqfs_data_reader_release_ref(rd, a);
+	sqfs_data_reader_release_ref(rd, b);
+	check_stats(rd, 0, 0, CACHE_BLOCKS);
+
+	/* the cache grows while everything is referenced, then shrinks */
+	for (i = 0; i < 5; ++i)
+		refs[i] = get_block(rd, 0, i);
+	check_stats(rd, 0, 5, 5);
+
+	for (i = 0; i < 5; ++i)
+		assert(memcmp(refs[i], content[0] + i * BLOCK_SIZE,
+			      BLOCK_SIZE) == 0);
+
+	for (i = 0; i < 4; ++i)
+		sqfs_data_reader_release_ref(rd, refs[i]);
+	check_stats(rd, 0, 0, CACHE_BLOCKS);
+
+	sqfs_data_reader_release_ref(rd, refs[4]);
+	check_stats(rd, 0, 0, CACHE_BLOCKS);
+
+	/* the most recently used ones were kept */
+	sqfs_data_reader_release_ref(rd, get_block(rd, 0, 3));
+	sqfs_data_reader_release_ref(rd, get_block(rd, 0, 4));
+	check_stats(rd, 2, 0, CACHE_BLOCKS);
+
+	/* destroying the reader drops references that are still held */
+	a = get_block(rd, 0, 1);
+	(void)a;
+
+	sqfs_data_reader_destroy(rd);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		free(content[i]);
+		free(inodes[i]);
+	}
+
+	image_destroy(&img);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_reader_share.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
+
+#define BLOCK_SIZE (4096)
+#define CACHE_BLOCKS (4)
+#define NUM_FILES (8)
+#define NUM_THREADS (4)
+
+static sqfs_inode_generic_t *inodes[NUM_FILES];
+static sqfs_u8 *content[NUM_FILES];
+static sqfs_data_reader_stats_t last_stats;
+static test_image_t img;
+
+/* a few blocks and a tail end in a fragment block */
+static size_t file_size(size_t f)
+{
+	return (f % 3 + 1) * BLOCK_SIZE + 100 * (f + 1);
+}
+
+static void pack_image(void)
+{
+	size_t f, size;
+
+	image_create(&img, BLOCK_SIZE, 1, 10);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		size = file_size(f);
+
+		content[f] = malloc(size);
+		assert(content[f] != NULL);
+		fill_pattern(content[f], size, f);
+
+		inodes[f] = image_add_file(&img, content[f], size, 0);
+	}
+
+	image_finish(&img);
+}
+
+#ifdef WITH_PTHREAD
+/* the read counter of the memory file is not thread safe */
+static int read_at_nocount(sqfs_file_t *base, sqfs_u64 offset,
+			   void *buffer, size_t size)
+{
+	mem_file_t *mem = (mem_file_t *)base;
+
+	if (offset > mem->size || size > mem->size - offset)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	memcpy(buffer, mem->data + offset, size);
+	return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+	sqfs_data_reader_t *rd = arg;
+	size_t i, f;
+
+	for (i = 0; i < 4 * NUM_FILES; ++i) {
+		f = (i * 5) % NUM_FILES;
+		check_file(rd, inodes[f], content[f], file_size(f));
+	}
+
+	return NULL;
+}
+
+/* readers sharing a cache are used concurrently */
+static void run_threads(sqfs_data_reader_t *rd)
+{
+	sqfs_data_reader_t *readers[NUM_THREADS];
+	pthread_t threads[NUM_THREADS];
+	size_t i;
+
+	img.file->base.read_at = read_at_nocount;
+
+	for (i = 0; i < NUM_THREADS; ++i) {
+		readers[i] = sqfs_data_reader_share(rd);
+		assert(readers[i] != NULL);
+	}
+
+	for (i = 0; i < NUM_THREADS; ++i) {
+		assert(pthread_create(threads + i, NULL, reader_thread,
+				      readers[i]) == 0);
+	}
+
+	for (i = 0; i < NUM_THREADS; ++i) {
+		assert(pthread_join(threads[i], NULL) == 0);
+		sqfs_data_reader_destroy(readers[i]);
+	}
+}
+#endif
+
+int main(void)
+{
+	sqfs_data_reader_t *parent, *child, *grandchild;
+	const sqfs_u8 *ptr;
+	size_t f, size;
+
+	pack_image();
+
+	parent = image_open_reader(&img);
+	assert(sqfs_data_reader_set_cache_size(parent, CACHE_BLOCKS *
+					       BLOCK_SIZE) == 0);
+
+	/* file 0 has one block, its tail end is in the first fragment block */
+	check_file(parent, inodes[0], content[0], file_size(0));
+	check_reader_stats(parent, &last_stats, 0, 2, 2);
+
+	child = sqfs_data_reader_share(parent);
+	assert(child != NULL);
+
+	/* a reference taken through the parent, released after it is gone */
+	assert(sqfs_data_reader_get_block_ref(parent, inodes[1], 1, &ptr,
+					      &size) == 0);
+	assert(size == BLOCK_SIZE);
+	check_reader_stats(child, &last_stats, 0, 1, 3);
+
+	/* the child has its own copy of the compressor */
+	sqfs_data_reader_destroy(parent);
+	img.uncmp->destroy(img.uncmp);
+	img.uncmp = NULL;
+
+	/* the cache, its statistics and the fragment table are still there */
+	check_file(child, inodes[0], content[0], file_size(0));
+	check_reader_stats(child, &last_stats, 2, 0, 3);
+
+	assert(memcmp(ptr, content[1] + BLOCK_SIZE, BLOCK_SIZE) == 0);
+	sqfs_data_reader_release_ref(child, ptr);
+
+	for (f = 0; f < NUM_FILES; ++f)
+		check_file(child, inodes[f], content[f], file_size(f));
+
+	/* shared state is passed on, whoever created it */
+	grandchild = sqfs_data_reader_share(child);
+	assert(grandchild != NULL);
+	sqfs_data_reader_destroy(child);
+
+	assert(sqfs_data_reader_get_fragment_ref(grandchild, inodes[2], &ptr,
+						 &size) == 0);
+	assert(size == file_size(2) % BLOCK_SIZE);
+	assert(memcmp(ptr, content[2] + file_size(2) - size, size) == 0);
+
+	for (f = NUM_FILES; f-- > 0; )
+		check_file(grandchild, inodes[f], content[f], file_size(f));
+
+#ifdef WITH_PTHREAD
+	run_threads(grandchild);
+#endif
+
+	/* the last reader drops the references still held */
+	sqfs_data_reader_destroy(grandchild);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		free(content[f]);
+		free(inodes[f]);
+	}
+
+	image_destroy(&img);
+	return EXIT_SUCCESS;
+}
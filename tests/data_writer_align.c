@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_align.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (8192)
+#define DEVBLK_SIZE (4096)
+#define MAX_FILE_SIZE (4 * BLOCK_SIZE)
+
+/* something in front of the data, so alignment is needed */
+#define HEADER_SIZE (96)
+
+static const struct {
+	size_t size;
+	unsigned int seed;
+	sqfs_u32 flags;
+	size_t duplicate_of;
+} files[] = {
+	{ 3 * BLOCK_SIZE + 100, 1, SQFS_BLK_ALIGN, 0 },
+	{ BLOCK_SIZE + 7, 2, 0, 1 },
+	{ 2 * BLOCK_SIZE, 3, SQFS_BLK_ALIGN, 2 },
+	{ 2 * BLOCK_SIZE + 5, 4, SQFS_BLK_ALIGN | SQFS_BLK_DONT_FRAGMENT, 3 },
+	{ 3 * BLOCK_SIZE + 100, 1, SQFS_BLK_ALIGN, 0 },
+	{ 300, 5, SQFS_BLK_ALIGN, 5 },
+};
+
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+static sqfs_u8 data[MAX_FILE_SIZE];
+
+static void pack_image(test_image_t *img, sqfs_inode_generic_t **inodes,
+		       unsigned int num_workers, size_t dedup_size,
+		       bool with_duplicates)
+{
+	size_t i;
+
+	image_create(img, BLOCK_SIZE, num_workers, 10);
+	assert(img->file->base.truncate((sqfs_file_t *)img->file,
+					HEADER_SIZE) == 0);
+
+	if (dedup_size > 0) {
+		assert(sqfs_data_writer_set_dedup_buffer(img->wr,
+							 dedup_size) == 0);
+	}
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		inodes[i] = NULL;
+		if (files[i].duplicate_of != i && !with_duplicates)
+			continue;
+
+		fill_pattern(data, files[i].size, files[i].seed);
+		inodes[i] = image_add_file(img, data, files[i].size,
+					   files[i].flags);
+	}
+
+	image_finish(img);
+}
+
+static void run_test(unsigned int num_workers, size_t dedup_size)
+{
+	sqfs_inode_generic_t *inodes[NUM_FILES], *ref_inodes[NUM_FILES];
+	sqfs_data_reader_t *rd;
+	test_image_t img, ref;
+	size_t i, dup;
+
+	pack_image(&img, inodes, num_workers, dedup_size, true);
+	pack_image(&ref, ref_inodes, num_workers, dedup_size, false);
+
+	/* aligned files start on a device block and read back correctly */
+	rd = image_open_reader(&img);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		if ((files[i].flags & SQFS_BLK_ALIGN) &&
+		    inodes[i]->num_file_blocks > 0) {
+			assert((file_block_start(inodes[i]) %
+				DEVBLK_SIZE) == 0);
+		}
+
+		fill_pattern(data, files[i].size, files[i].seed);
+		check_file(rd, inodes[i], data, files[i].size);
+	}
+
+	sqfs_data_reader_destroy(rd);
+
+	/* a duplicate points to the blocks of the first one and leaves
+	   neither blocks nor padding behind */
+	for (i = 0; i < NUM_FILES; ++i) {
+		dup = files[i].duplicate_of;
+
+		assert(file_block_start(inodes[i]) ==
+		       file_block_start(inodes[dup]));
+	}
+
+	assert(img.file->size == ref.file->size);
+	assert(memcmp(img.file->data, ref.file->data, ref.file->size) == 0);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		free(inodes[i]);
+		free(ref_inodes[i]);
+	}
+
+	image_destroy(&ref);
+	image_destroy(&img);
+}
+
+int main(void)
+{
+	run_test(1, 0);
+	run_test(4, 0);
+	run_test(1, 1024 * 1024);
+	run_test(4, 1024 * 1024);
+	return EXIT_SUCCESS;
+}
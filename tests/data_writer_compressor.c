@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_compressor.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (8192)
+#define FILE_BLOCKS (3)
+#define TAIL_SIZE (1000)
+#define FILE_SIZE (FILE_BLOCKS * BLOCK_SIZE + TAIL_SIZE)
+
+/* compression levels of the default and the added compressors */
+static const sqfs_u16 levels[] = { 9, 1, 5 };
+
+#define NUM_COMPRESSORS (sizeof(levels) / sizeof(levels[0]))
+
+static sqfs_compressor_t *create_gzip(sqfs_u16 level)
+{
+	sqfs_compressor_config_t cfg;
+	sqfs_compressor_t *cmp;
+
+	assert(sqfs_compressor_config_init(&cfg, SQFS_COMP_GZIP,
+					   BLOCK_SIZE, 0) == 0);
+	cfg.opt.gzip.level = level;
+
+	cmp = sqfs_compressor_create(&cfg);
+	assert(cmp != NULL);
+	return cmp;
+}
+
+/* what a block compressed with the given level looks like on disk */
+static sqfs_u32 block_size(sqfs_compressor_t *cmp, const sqfs_u8 *data)
+{
+	sqfs_u8 buffer[BLOCK_SIZE];
+	sqfs_s32 ret;
+
+	ret = cmp->do_block(cmp, data, BLOCK_SIZE, buffer, sizeof(buffer));
+	assert(ret > 0);
+	return ret;
+}
+
+static void run_test(unsigned int num_workers)
+{
+	sqfs_inode_generic_t *inodes[NUM_COMPRESSORS * 2];
+	sqfs_compressor_t *cmp[NUM_COMPRESSORS];
+	sqfs_u32 expect[NUM_COMPRESSORS][FILE_BLOCKS];
+	sqfs_u8 data[FILE_SIZE];
+	sqfs_data_reader_t *rd;
+	test_image_t img;
+	sqfs_u32 flags;
+	size_t i, j, f;
+	int ret;
+
+	image_create(&img, BLOCK_SIZE, num_workers, 10);
+	fill_pattern(data, sizeof(data), 1);
+
+	for (i = 0; i < NUM_COMPRESSORS; ++i) {
+		cmp[i] = create_gzip(levels[i]);
+
+		for (j = 0; j < FILE_BLOCKS; ++j) {
+			expect[i][j] = block_size(cmp[i],
+						  data + j * BLOCK_SIZE);
+		}
+
+		if (i > 0) {
+			ret = sqfs_data_writer_add_compressor(img.wr, cmp[i]);
+			assert(ret == (int)i);
+		}
+	}
+
+	/* otherwise, the selection could not be told apart */
+	assert(expect[1][0] != expect[0][0]);
+
+	/* the same file through each compressor, once with the tail end in
+	   a fragment block and once with the tail end as a block of its own */
+	for (f = 0; f < NUM_COMPRESSORS * 2; ++f) {
+		flags = SQFS_BLK_COMPRESSOR(f / 2);
+		if (f % 2)
+			flags |= SQFS_BLK_DONT_FRAGMENT;
+
+		inodes[f] = image_add_file(&img, data, FILE_SIZE, flags);
+	}
+
+	image_finish(&img);
+
+	for (f = 0; f < NUM_COMPRESSORS * 2; ++f) {
+		for (j = 0; j < FILE_BLOCKS; ++j)
+			assert(inodes[f]->block_sizes[j] == expect[f / 2][j]);
+	}
+
+	/* any compression level decompresses with the default settings */
+	rd = image_open_reader(&img);
+
+	for (f = 0; f < NUM_COMPRESSORS * 2; ++f) {
+		check_file(rd, inodes[f], data, FILE_SIZE);
+		free(inodes[f]);
+	}
+
+	sqfs_data_reader_destroy(rd);
+	image_destroy(&img);
+
+	for (i = 0; i < NUM_COMPRESSORS; ++i)
+		cmp[i]->destroy(cmp[i]);
+}
+
+static void check_errors(void)
+{
+	sqfs_compressor_t *cmp = create_gzip(1);
+	sqfs_inode_generic_t inode;
+	test_image_t img;
+	int i;
+
+	/* selecting a compressor that was not added */
+	image_create(&img, BLOCK_SIZE, 2, 10);
+	assert(sqfs_data_writer_add_compressor(img.wr, cmp) == 1);
+
+	memset(&inode, 0, sizeof(inode));
+	inode.base.type = SQFS_INODE_FILE;
+	assert(sqfs_data_writer_begin_file(img.wr, &inode,
+					   SQFS_BLK_COMPRESSOR(2)) ==
+	       SQFS_ERROR_UNSUPPORTED);
+	image_destroy(&img);
+
+	/* the default compressor counts towards the limit */
+	image_create(&img, BLOCK_SIZE, 2, 10);
+
+	for (i = 1; i < SQFS_MAX_DATA_COMPRESSORS; ++i)
+		assert(sqfs_data_writer_add_compressor(img.wr, cmp) == i);
+
+	assert(sqfs_data_writer_add_compressor(img.wr, cmp) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+	image_destroy(&img);
+
+	cmp->destroy(cmp);
+}
+
+int main(void)
+{
+	run_test(1);
+	run_test(4);
+	check_errors();
+	return EXIT_SUCCESS;
+}
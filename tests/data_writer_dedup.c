@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_dedup.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define MAX_FILE_BLOCKS (3)
+#define NUM_FILLER (300)
+
+/* stands for NUM_FILLER single block files, each from a different seed */
+#define FILLER (~0U)
+
+/* A and B are replaced by two seeds with colliding bucket indices */
+#define SEED_A (100)
+#define SEED_B (101)
+
+static const struct {
+	unsigned int seed[MAX_FILE_BLOCKS];
+	size_t count;
+} files[] = {
+	{ { 1, 2, 3 }, 3 },
+	{ { 1, 2, 3 }, 3 },
+	{ { 1, 2, 4 }, 3 },
+	{ { 2, 3 }, 2 },
+	{ { SEED_A }, 1 },
+	{ { SEED_B }, 1 },
+	{ { SEED_B }, 1 },
+	{ { SEED_A }, 1 },
+	{ { FILLER }, 1 },
+	{ { 1, 2, 3 }, 3 },
+	{ { SEED_B }, 1 },
+};
+
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+#define NUM_INODES (NUM_FILES + NUM_FILLER - 1)
+
+static unsigned int seed_a, seed_b;
+
+static unsigned int get_seed(size_t file, size_t filler, size_t i)
+{
+	unsigned int seed = files[file].seed[i];
+
+	if (seed == SEED_A)
+		return seed_a;
+	if (seed == SEED_B)
+		return seed_b;
+	if (seed == FILLER)
+		return 10000 + filler;
+	return seed;
+}
+
+static size_t gen_file(sqfs_u8 *data, size_t file, size_t filler)
+{
+	size_t i;
+
+	for (i = 0; i < files[file].count; ++i) {
+		fill_pattern(data + i * BLOCK_SIZE, BLOCK_SIZE,
+			     get_seed(file, filler, i));
+	}
+
+	return files[file].count * BLOCK_SIZE;
+}
+
+/* the image packed without a deduplication buffer */
+static sqfs_u8 *ref_data;
+static size_t ref_size, first_size;
+
+static sqfs_u64 disk_size(const sqfs_inode_generic_t *inode)
+{
+	sqfs_u64 size = 0;
+	size_t i;
+
+	for (i = 0; i < inode->num_file_blocks; ++i)
+		size += SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+
+	return size;
+}
+
+/* where the data of the last file ends, i.e. the size of the data area */
+static sqfs_u64 data_end(sqfs_inode_generic_t **inodes)
+{
+	sqfs_u64 end, max = 0;
+	size_t i;
+
+	for (i = 0; i < NUM_INODES; ++i) {
+		end = file_block_start(inodes[i]) + disk_size(inodes[i]);
+		if (end > max)
+			max = end;
+	}
+
+	return max;
+}
+
+static void run_test(unsigned int num_workers, size_t dedup_size)
+{
+	size_t i, j, k, size, count, file[NUM_INODES], filler[NUM_INODES];
+	sqfs_inode_generic_t *inodes[NUM_INODES];
+	sqfs_u8 data[MAX_FILE_BLOCKS * BLOCK_SIZE];
+	sqfs_data_writer_stats_t stats;
+	sqfs_data_reader_t *rd;
+	test_image_t img;
+
+	image_create(&img, BLOCK_SIZE, num_workers, 10);
+
+	if (dedup_size > 0) {
+		assert(sqfs_data_writer_set_dedup_buffer(img.wr,
+							 dedup_size) == 0);
+	}
+
+	for (i = 0, j = 0; i < NUM_FILES; ++i) {
+		count = files[i].seed[0] == FILLER ? NUM_FILLER : 1;
+
+		/* the filler grows and rehashes the bucket table */
+		for (k = 0; k < count; ++k, ++j) {
+			file[j] = i;
+			filler[j] = k;
+			size = gen_file(data, i, k);
+			inodes[j] = image_add_file(&img, data, size, 0);
+		}
+	}
+
+	image_finish(&img);
+
+	/* identical files share the blocks of the first one */
+	assert(file_block_start(inodes[1]) == file_block_start(inodes[0]));
+
+	/* same first blocks, but a different last block */
+	assert(file_block_start(inodes[2]) != file_block_start(inodes[0]));
+
+	/* a run of blocks in the middle of an earlier file */
+	assert(file_block_start(inodes[3]) == file_block_start(inodes[0]) +
+	       SQFS_ON_DISK_BLOCK_SIZE(inodes[0]->block_sizes[0]));
+
+	/* blocks in the same bucket are told apart by their hash */
+	assert(file_block_start(inodes[5]) != file_block_start(inodes[4]));
+	assert(file_block_start(inodes[6]) == file_block_start(inodes[5]));
+	assert(file_block_start(inodes[7]) == file_block_start(inodes[4]));
+
+	/* still found after the bucket table has been rehashed */
+	assert(file_block_start(inodes[NUM_INODES - 2]) ==
+	       file_block_start(inodes[0]));
+	assert(file_block_start(inodes[NUM_INODES - 1]) ==
+	       file_block_start(inodes[5]));
+
+	image_get_stats(&img, &stats);
+	assert(stats.duplicate_blocks == 3 + 2 + 1 + 1 + 3 + 1);
+	assert(stats.blocks_written == 3 + 3 + 1 + 1 + NUM_FILLER);
+
+	/* nothing of the dropped duplicates is left behind in the image */
+	assert(img.super.directory_table_start == data_end(inodes));
+	assert(img.super.directory_table_start == stats.bytes_written);
+
+	/* holding files back does not change the image */
+	if (ref_data == NULL) {
+		ref_size = img.file->size;
+		ref_data = malloc(ref_size);
+		assert(ref_data != NULL);
+		memcpy(ref_data, img.file->data, ref_size);
+		first_size = disk_size(inodes[0]);
+	} else {
+		assert(img.file->size == ref_size);
+		assert(memcmp(img.file->data, ref_data, ref_size) == 0);
+	}
+
+	/* everything reads back to the original data */
+	rd = image_open_reader(&img);
+
+	for (i = 0; i < NUM_INODES; ++i) {
+		size = gen_file(data, file[i], filler[i]);
+		check_file(rd, inodes[i], data, size);
+		free(inodes[i]);
+	}
+
+	sqfs_data_reader_destroy(rd);
+	image_destroy(&img);
+}
+
+int main(void)
+{
+	size_t i, sizes[3] = { 0, 0, 0 };
+
+	find_colliding_seeds(BLOCK_SIZE, 5000, &seed_a, &seed_b);
+
+	/* Without a buffer, with one that is one byte short of holding the
+	   first file, and with one that holds any of the files. The single
+	   block files still fit into the second one. */
+	run_test(1, 0);
+	sizes[1] = first_size - 1;
+	sizes[2] = 1024 * 1024;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		run_test(1, sizes[i]);
+		run_test(4, sizes[i]);
+	}
+
+	free(ref_data);
+	return EXIT_SUCCESS;
+}
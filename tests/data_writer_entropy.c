@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_entropy.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (8192)
+#define MAX_BLOCKS (3)
+
+#define EST SQFS_BLK_ESTIMATE_ENTROPY
+
+/* R is a block of random bytes, P a block of compressible text */
+static const struct {
+	const char *blocks;
+	size_t tail;
+	sqfs_u32 flags;
+	size_t incompressible;
+} files[] = {
+	{ "RRR", 100, EST, 3 },
+	{ "PP", 0, EST, 0 },
+	{ "RR", 0, 0, 0 },
+	{ "RR", 0, EST | SQFS_BLK_DONT_COMPRESS, 0 },
+	{ "RP", 0, EST, 1 },
+	{ "", 3000, EST | SQFS_BLK_DONT_FRAGMENT, 0 },
+};
+
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+static sqfs_u8 data[MAX_BLOCKS * BLOCK_SIZE + BLOCK_SIZE];
+
+static void fill_random(sqfs_u8 *ptr, size_t size, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		seed = seed * 1103515245 + 12345;
+		ptr[i] = seed >> 16;
+	}
+}
+
+static size_t gen_file(size_t f)
+{
+	size_t i, count = strlen(files[f].blocks);
+
+	for (i = 0; i < count; ++i) {
+		if (files[f].blocks[i] == 'R') {
+			fill_random(data + i * BLOCK_SIZE, BLOCK_SIZE, f + i);
+		} else {
+			fill_pattern(data + i * BLOCK_SIZE, BLOCK_SIZE, f + i);
+		}
+	}
+
+	fill_random(data + i * BLOCK_SIZE, files[f].tail, 100 + f);
+	return count * BLOCK_SIZE + files[f].tail;
+}
+
+static void run_test(unsigned int num_workers)
+{
+	sqfs_inode_generic_t *inodes[NUM_FILES];
+	size_t i, j, size, count, incompressible = 0;
+	sqfs_data_writer_stats_t stats;
+	sqfs_data_reader_t *rd;
+	test_image_t img;
+	sqfs_u32 out;
+
+	image_create(&img, BLOCK_SIZE, num_workers, 10);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		size = gen_file(i);
+		inodes[i] = image_add_file(&img, data, size, files[i].flags);
+		incompressible += files[i].incompressible;
+	}
+
+	image_finish(&img);
+
+	image_get_stats(&img, &stats);
+	assert(stats.incompressible_blocks == incompressible);
+
+	/* random data ends up uncompressed either way, text is compressed */
+	for (i = 0; i < NUM_FILES; ++i) {
+		count = strlen(files[i].blocks);
+		if (files[i].flags & SQFS_BLK_DONT_FRAGMENT)
+			assert(inodes[i]->num_file_blocks == count + 1);
+		else
+			assert(inodes[i]->num_file_blocks == count);
+
+		for (j = 0; j < count; ++j) {
+			out = inodes[i]->block_sizes[j];
+
+			if (files[i].blocks[j] == 'R') {
+				assert(out == (BLOCK_SIZE | (1 << 24)));
+			} else {
+				assert(out < BLOCK_SIZE);
+			}
+		}
+	}
+
+	rd = image_open_reader(&img);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		size = gen_file(i);
+		check_file(rd, inodes[i], data, size);
+		free(inodes[i]);
+	}
+
+	sqfs_data_reader_destroy(rd);
+	image_destroy(&img);
+}
+
+int main(void)
+{
+	run_test(1);
+	run_test(4);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_fragment.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define TAIL_SIZE (1000)
+#define MAX_FILE_BLOCKS (2)
+#define NUM_FILLER (300)
+
+/*
+  Each file has a number of full blocks followed by a tail end that ends up
+  in a fragment block. Tails are generated from a seed, blocks from the seed
+  plus one. FILLER stands for NUM_FILLER files with different tails.
+ */
+#define FILLER (~0U)
+#define SEED_A (100)
+#define SEED_B (101)
+
+static const struct {
+	unsigned int seed;
+	size_t blocks;
+} files[] = {
+	{ 1, 0 },
+	{ 2, 0 },
+	{ 1, 0 },
+	{ 1, 2 },
+	{ SEED_A, 0 },
+	{ SEED_B, 0 },
+	{ SEED_B, 1 },
+	{ SEED_A, 0 },
+	{ FILLER, 0 },
+	{ 1, 0 },
+	{ SEED_B, 0 },
+	{ 2, 1 },
+};
+
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+#define NUM_INODES (NUM_FILES + NUM_FILLER - 1)
+
+static unsigned int seed_a, seed_b;
+
+static unsigned int get_seed(size_t file, size_t filler)
+{
+	if (files[file].seed == SEED_A)
+		return seed_a;
+	if (files[file].seed == SEED_B)
+		return seed_b;
+	if (files[file].seed == FILLER)
+		return 10000 + filler;
+	return files[file].seed;
+}
+
+static size_t gen_file(sqfs_u8 *data, size_t file, size_t filler)
+{
+	unsigned int seed = get_seed(file, filler);
+	size_t i, size;
+
+	/* vary the filler tail sizes so the fragment blocks fill unevenly */
+	if (files[file].seed == FILLER) {
+		size = 100 + (filler * 37) % 900;
+	} else {
+		size = files[file].blocks * BLOCK_SIZE + TAIL_SIZE;
+	}
+
+	for (i = 0; i < files[file].blocks; ++i)
+		fill_pattern(data + i * BLOCK_SIZE, BLOCK_SIZE, seed + 1);
+
+	fill_pattern(data + i * BLOCK_SIZE, size - i * BLOCK_SIZE, seed);
+	return size;
+}
+
+static int same_fragment(sqfs_inode_generic_t *a, sqfs_inode_generic_t *b)
+{
+	sqfs_u32 a_idx, a_off, b_idx, b_off;
+
+	assert(sqfs_inode_get_frag_location(a, &a_idx, &a_off) == 0);
+	assert(sqfs_inode_get_frag_location(b, &b_idx, &b_off) == 0);
+
+	assert(a_idx != 0xFFFFFFFF && b_idx != 0xFFFFFFFF);
+	return a_idx == b_idx && a_off == b_off;
+}
+
+static void run_test(unsigned int num_workers)
+{
+	size_t i, j, k, size, count, file[NUM_INODES], filler[NUM_INODES];
+	sqfs_u8 data[MAX_FILE_BLOCKS * BLOCK_SIZE + TAIL_SIZE];
+	sqfs_inode_generic_t *inodes[NUM_INODES];
+	sqfs_data_writer_stats_t stats;
+	sqfs_data_reader_t *rd;
+	test_image_t img;
+
+	image_create(&img, BLOCK_SIZE, num_workers, 10);
+
+	for (i = 0, j = 0; i < NUM_FILES; ++i) {
+		count = files[i].seed == FILLER ? NUM_FILLER : 1;
+
+		/* the filler grows and rehashes the bucket table */
+		for (k = 0; k < count; ++k, ++j) {
+			file[j] = i;
+			filler[j] = k;
+			size = gen_file(data, i, k);
+			inodes[j] = image_add_file(&img, data, size, 0);
+		}
+	}
+
+	image_finish(&img);
+
+	/* identical tails are only stored once */
+	assert(!same_fragment(inodes[0], inodes[1]));
+	assert(same_fragment(inodes[0], inodes[2]));
+	assert(same_fragment(inodes[0], inodes[3]));
+
+	/* tails in the same hash bucket are told apart */
+	assert(!same_fragment(inodes[4], inodes[5]));
+	assert(same_fragment(inodes[5], inodes[6]));
+	assert(same_fragment(inodes[4], inodes[7]));
+
+	/* still found after the bucket table has been rehashed */
+	assert(same_fragment(inodes[NUM_INODES - 3], inodes[0]));
+	assert(same_fragment(inodes[NUM_INODES - 2], inodes[5]));
+	assert(same_fragment(inodes[NUM_INODES - 1], inodes[1]));
+
+	image_get_stats(&img, &stats);
+	assert(stats.fragments_discarded == 7);
+	assert(stats.fragments_stored == 4 + NUM_FILLER);
+	assert(stats.frag_blocks_written > 1);
+
+	/* everything reads back to the original data */
+	rd = image_open_reader(&img);
+
+	for (i = 0; i < NUM_INODES; ++i) {
+		size = gen_file(data, file[i], filler[i]);
+		check_file(rd, inodes[i], data, size);
+		free(inodes[i]);
+	}
+
+	sqfs_data_reader_destroy(rd);
+	image_destroy(&img);
+}
+
+int main(void)
+{
+	find_colliding_seeds(TAIL_SIZE, 5000, &seed_a, &seed_b);
+
+	run_test(1);
+	run_test(4);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_hooks.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (8192)
+
+static size_t num_writes = 0;
+static size_t num_events = 0;
+
+static void pre_block_write(void *user, sqfs_block_t *block,
+			    sqfs_file_t *file)
+{
+	assert(user == &num_writes);
+	(void)block; (void)file;
+	num_writes += 1;
+}
+
+static void trace_event(void *user, int event, unsigned int thread,
+			sqfs_u64 timestamp, sqfs_u64 arg)
+{
+	assert(user == &num_writes);
+	(void)event; (void)thread; (void)timestamp; (void)arg;
+	num_events += 1;
+}
+
+static void pack_file(const sqfs_block_hooks_t *hooks, int expect)
+{
+	sqfs_inode_generic_t *inode;
+	test_image_t img;
+	sqfs_u8 *data;
+
+	image_create(&img, BLOCK_SIZE, 1, 10);
+
+	if (sqfs_data_writer_set_hooks(img.wr, &num_writes, hooks) != 0) {
+		assert(expect != 0);
+		image_destroy(&img);
+		return;
+	}
+
+	assert(expect == 0);
+
+	data = malloc(3 * BLOCK_SIZE);
+	assert(data != NULL);
+	fill_pattern(data, 3 * BLOCK_SIZE, 1);
+
+	inode = image_add_file(&img, data, 3 * BLOCK_SIZE, 0);
+	image_finish(&img);
+
+	free(data);
+	free(inode);
+	image_destroy(&img);
+}
+
+int main(void)
+{
+	sqfs_block_hooks_t hooks;
+	size_t old_size = offsetof(sqfs_block_hooks_t, trace_event);
+	size_t expected_writes;
+
+	/* current struct layout */
+	memset(&hooks, 0, sizeof(hooks));
+	hooks.size = sizeof(hooks);
+	hooks.pre_block_write = pre_block_write;
+	hooks.trace_event = trace_event;
+
+	pack_file(&hooks, 0);
+	assert(num_writes > 0);
+	assert(num_events > 0);
+	expected_writes = num_writes;
+
+	/* old struct without trace_event, whatever follows is ignored */
+	num_writes = 0;
+	num_events = 0;
+	hooks.size = old_size;
+
+	pack_file(&hooks, 0);
+	assert(num_writes == expected_writes);
+	assert(num_events == 0);
+
+	/* anything smaller than the oldest known layout is rejected */
+	hooks.size = old_size - 1;
+	pack_file(&hooks, SQFS_ERROR_UNSUPPORTED);
+
+	return EXIT_SUCCESS;
+}
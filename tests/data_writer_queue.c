@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_queue.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define NUM_FILES (64)
+#define MAX_FILE_SIZE (20 * BLOCK_SIZE)
+
+static sqfs_u8 data[MAX_FILE_SIZE];
+
+static size_t file_size(size_t i)
+{
+	return (i * 7919 + (i % 3) * BLOCK_SIZE * 5) % MAX_FILE_SIZE;
+}
+
+static sqfs_u32 file_flags(size_t i)
+{
+	if ((i % 5) == 0)
+		return SQFS_BLK_DONT_COMPRESS;
+	if ((i % 7) == 0)
+		return SQFS_BLK_DONT_FRAGMENT;
+	return 0;
+}
+
+/*
+  Pack all files with the given number of workers, queue backlog and memory
+  limit, and check that the number of block buffers stays bounded by the
+  backlog, or the memory used for them by the limit that replaces it.
+ */
+static void pack_image(test_image_t *img, sqfs_inode_generic_t **inodes,
+		       unsigned int num_workers, size_t backlog, size_t limit)
+{
+	sqfs_data_writer_stats_t stats;
+	size_t i;
+
+	image_create(img, BLOCK_SIZE, num_workers, backlog);
+
+	if (limit > 0)
+		assert(sqfs_data_writer_set_memory_limit(img->wr, limit) == 0);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		fill_pattern(data, file_size(i), i);
+		inodes[i] = image_add_file(img, data, file_size(i),
+					   file_flags(i));
+	}
+
+	image_finish(img);
+
+	/* Up to backlog + 1 blocks are in flight. On top of that, every
+	   worker has a scratch block and there is the block currently being
+	   filled, the fragment block, a fragment block being flushed and the
+	   tail end that was just moved into it. */
+	image_get_stats(img, &stats);
+
+	if (limit > 0) {
+		assert(stats.peak_memory <= limit);
+	} else {
+		assert(stats.max_block_buffers <=
+		       backlog + 1 + num_workers + 4);
+	}
+}
+
+static void check_limit_errors(void)
+{
+	sqfs_u8 buffer[BLOCK_SIZE];
+	sqfs_inode_generic_t *inode;
+	test_image_t img;
+
+	/* not even room for a block per worker */
+	image_create(&img, BLOCK_SIZE, 4, 10);
+	assert(sqfs_data_writer_set_memory_limit(img.wr, 8 * BLOCK_SIZE) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+
+	/* the backlog cannot be changed once blocks are in flight */
+	fill_pattern(buffer, sizeof(buffer), 1);
+	inode = image_add_file(&img, buffer, sizeof(buffer), 0);
+	assert(sqfs_data_writer_set_memory_limit(img.wr, 1024 * 1024) ==
+	       SQFS_ERROR_INTERNAL);
+
+	image_finish(&img);
+	free(inode);
+	image_destroy(&img);
+}
+
+static void check_image(test_image_t *img, sqfs_inode_generic_t **inodes)
+{
+	sqfs_data_reader_t *rd;
+	size_t i;
+
+	rd = image_open_reader(img);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		fill_pattern(data, file_size(i), i);
+		check_file(rd, inodes[i], data, file_size(i));
+	}
+
+	sqfs_data_reader_destroy(rd);
+}
+
+static void free_inodes(sqfs_inode_generic_t **inodes)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_FILES; ++i)
+		free(inodes[i]);
+}
+
+/* the image and the inodes must be identical to the reference */
+static void compare_image(test_image_t *img, sqfs_inode_generic_t **inodes,
+			  test_image_t *ref, sqfs_inode_generic_t **ref_inodes)
+{
+	sqfs_u32 a_idx, a_off, b_idx, b_off;
+	size_t i;
+
+	assert(img->file->size == ref->file->size);
+	assert(memcmp(img->file->data, ref->file->data,
+		      ref->file->size) == 0);
+	assert(memcmp(&img->super, &ref->super, sizeof(img->super)) == 0);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		assert(file_block_start(inodes[i]) ==
+		       file_block_start(ref_inodes[i]));
+
+		sqfs_inode_get_frag_location(inodes[i], &a_idx, &a_off);
+		sqfs_inode_get_frag_location(ref_inodes[i], &b_idx, &b_off);
+		assert(a_idx == b_idx && a_off == b_off);
+
+		assert(inodes[i]->num_file_blocks ==
+		       ref_inodes[i]->num_file_blocks);
+		assert(memcmp(inodes[i]->block_sizes,
+			      ref_inodes[i]->block_sizes,
+			      inodes[i]->num_file_blocks *
+			      sizeof(sqfs_u32)) == 0);
+	}
+
+	free_inodes(inodes);
+	image_destroy(img);
+}
+
+int main(void)
+{
+	static const unsigned int workers[] = { 1, 2, 4, 8 };
+	static const size_t backlog[] = { 1, 2, 3, 16 };
+	static const size_t limit[] = { 256 * 1024, 1024 * 1024,
+					8 * 1024 * 1024 };
+	sqfs_inode_generic_t *ref_inodes[NUM_FILES], *inodes[NUM_FILES];
+	test_image_t ref, img;
+	size_t i, j;
+
+	pack_image(&ref, ref_inodes, 1, 10, 0);
+	check_image(&ref, ref_inodes);
+
+	/* blocks are written in submission order, whoever compresses them */
+	for (i = 0; i < sizeof(workers) / sizeof(workers[0]); ++i) {
+		for (j = 0; j < sizeof(backlog) / sizeof(backlog[0]); ++j) {
+			pack_image(&img, inodes, workers[i], backlog[j], 0);
+			compare_image(&img, inodes, &ref, ref_inodes);
+		}
+	}
+
+	/* the memory limit holds with any number of workers, also when the
+	   backlog grows beyond the initial one */
+	for (i = 0; i < sizeof(workers) / sizeof(workers[0]); ++i) {
+		for (j = 0; j < sizeof(limit) / sizeof(limit[0]); ++j) {
+			pack_image(&img, inodes, workers[i], 16, limit[j]);
+			compare_image(&img, inodes, &ref, ref_inodes);
+		}
+	}
+
+	check_limit_errors();
+
+	free_inodes(ref_inodes);
+	image_destroy(&ref);
+	return EXIT_SUCCESS;
+}
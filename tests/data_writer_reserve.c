@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_reserve.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define MAX_FILE_SIZE (4 * BLOCK_SIZE)
+
+static const struct {
+	size_t size;
+	sqfs_u32 flags;
+} files[] = {
+	{ 0, 0 },
+	{ 100, 0 },
+	{ BLOCK_SIZE, 0 },
+	{ 3 * BLOCK_SIZE + 700, 0 },
+	{ 2 * BLOCK_SIZE, SQFS_BLK_DONT_FRAGMENT },
+	{ BLOCK_SIZE + 1, SQFS_BLK_DONT_FRAGMENT },
+	{ 500, SQFS_BLK_DONT_COMPRESS },
+};
+
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+static sqfs_u8 data[MAX_FILE_SIZE];
+
+/*
+  Write a file in uneven pieces straight into the reserved space. The
+  writer must always offer the rest of the current block, and reserving
+  space without committing anything to it does not add any data.
+ */
+static sqfs_inode_generic_t *write_file(test_image_t *img, size_t i)
+{
+	sqfs_inode_generic_t *inode;
+	size_t size, avail, diff, step = 1;
+	sqfs_u8 *ptr;
+
+	inode = calloc(1, sizeof(*inode) +
+		       (files[i].size / BLOCK_SIZE + 1) * sizeof(sqfs_u32));
+	assert(inode != NULL);
+
+	inode->base.type = SQFS_INODE_FILE;
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	sqfs_inode_set_file_size(inode, files[i].size);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+
+	assert(sqfs_data_writer_begin_file(img->wr, inode,
+					   files[i].flags) == 0);
+
+	for (size = 0; size < files[i].size; size += diff) {
+		assert(sqfs_data_writer_reserve(img->wr, (void **)&ptr,
+						&avail) == 0);
+		assert(avail == BLOCK_SIZE - size % BLOCK_SIZE);
+		assert(sqfs_data_writer_commit(img->wr, 0) == 0);
+
+		diff = files[i].size - size;
+		if (diff > avail)
+			diff = avail;
+		if (diff > step)
+			diff = step;
+
+		memcpy(ptr, data + size, diff);
+		assert(sqfs_data_writer_commit(img->wr, diff) == 0);
+		step = step * 7 + 3;
+	}
+
+	assert(sqfs_data_writer_reserve(img->wr, (void **)&ptr,
+					&avail) == 0);
+	assert(avail > 0);
+	memset(ptr, 0xFF, avail);
+
+	assert(sqfs_data_writer_end_file(img->wr) == 0);
+	return inode;
+}
+
+static void check_errors(void)
+{
+	sqfs_inode_generic_t *inode;
+	test_image_t img;
+	size_t avail;
+	void *ptr;
+
+	/* there is no file to reserve space for */
+	image_create(&img, BLOCK_SIZE, 1, 10);
+	assert(sqfs_data_writer_reserve(img.wr, &ptr, &avail) ==
+	       SQFS_ERROR_INTERNAL);
+	image_destroy(&img);
+
+	/* committing more than was reserved */
+	image_create(&img, BLOCK_SIZE, 1, 10);
+
+	inode = calloc(1, sizeof(*inode) + 2 * sizeof(sqfs_u32));
+	assert(inode != NULL);
+	inode->base.type = SQFS_INODE_FILE;
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+
+	assert(sqfs_data_writer_begin_file(img.wr, inode, 0) == 0);
+	assert(sqfs_data_writer_reserve(img.wr, &ptr, &avail) == 0);
+	assert(sqfs_data_writer_commit(img.wr, 100) == 0);
+	assert(sqfs_data_writer_commit(img.wr, BLOCK_SIZE) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+
+	image_destroy(&img);
+	free(inode);
+}
+
+int main(void)
+{
+	sqfs_inode_generic_t *ref_inodes[NUM_FILES], *inodes[NUM_FILES];
+	sqfs_data_reader_t *rd;
+	test_image_t ref, img;
+	size_t i;
+
+	fill_pattern(data, sizeof(data), 1);
+
+	image_create(&ref, BLOCK_SIZE, 1, 10);
+	image_create(&img, BLOCK_SIZE, 1, 10);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		ref_inodes[i] = image_add_file(&ref, data, files[i].size,
+					       files[i].flags);
+		inodes[i] = write_file(&img, i);
+	}
+
+	image_finish(&ref);
+	image_finish(&img);
+
+	/* the result is the same as appending each file in one go */
+	assert(img.file->size == ref.file->size);
+	assert(memcmp(img.file->data, ref.file->data, ref.file->size) == 0);
+
+	rd = image_open_reader(&img);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		assert(inodes[i]->num_file_blocks ==
+		       ref_inodes[i]->num_file_blocks);
+		assert(memcmp(&inodes[i]->data, &ref_inodes[i]->data,
+			      sizeof(inodes[i]->data)) == 0);
+
+		check_file(rd, inodes[i], data, files[i].size);
+		free(ref_inodes[i]);
+		free(inodes[i]);
+	}
+
+	sqfs_data_reader_destroy(rd);
+	image_destroy(&img);
+	image_destroy(&ref);
+
+	check_errors();
+	return EXIT_SUCCESS;
+}
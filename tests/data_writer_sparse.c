@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_sparse.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/block.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define MAX_FILE_SIZE (6 * BLOCK_SIZE)
+#define MAX_EXTENTS (3)
+
+/* an extent with seed zero is a hole */
+typedef struct {
+	size_t size;
+	unsigned int seed;
+} extent_t;
+
+static const struct {
+	extent_t ext[MAX_EXTENTS];
+	sqfs_u32 flags;
+	size_t sparse_blocks;
+} files[] = {
+	{ { { 3 * BLOCK_SIZE, 0 } }, 0, 3 },
+	{ { { 100, 1 }, { 2 * BLOCK_SIZE + 50, 0 }, { 700, 2 } }, 0, 1 },
+	{ { { BLOCK_SIZE, 3 }, { 2 * BLOCK_SIZE, 0 },
+	    { BLOCK_SIZE + 300, 4 } }, 0, 2 },
+	{ { { 2 * BLOCK_SIZE + 10, 5 }, { BLOCK_SIZE - 10, 0 } }, 0, 0 },
+	{ { { BLOCK_SIZE, 6 }, { 500, 0 } }, 0, 1 },
+	{ { { 700, 0 } }, 0, 1 },
+	{ { { BLOCK_SIZE, 7 }, { 500, 0 } }, SQFS_BLK_DONT_FRAGMENT, 1 },
+	{ { { 2 * BLOCK_SIZE, 8 }, { 3 * BLOCK_SIZE + 1, 0 } },
+	  SQFS_BLK_DONT_COMPRESS, 4 },
+};
+
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+static sqfs_u8 data[MAX_FILE_SIZE];
+
+static size_t gen_file(size_t f)
+{
+	const extent_t *ext = files[f].ext;
+	size_t i, size = 0;
+
+	for (i = 0; i < MAX_EXTENTS && ext[i].size > 0; ++i) {
+		if (ext[i].seed == 0) {
+			memset(data + size, 0, ext[i].size);
+		} else {
+			fill_pattern(data + size, ext[i].size, ext[i].seed);
+		}
+		size += ext[i].size;
+	}
+
+	return size;
+}
+
+/* write the data extents and skip over the holes */
+static sqfs_inode_generic_t *write_sparse(test_image_t *img, size_t f)
+{
+	const extent_t *ext = files[f].ext;
+	sqfs_inode_generic_t *inode;
+	size_t i, size = gen_file(f);
+
+	inode = calloc(1, sizeof(*inode) +
+		       (size / BLOCK_SIZE + 1) * sizeof(sqfs_u32));
+	assert(inode != NULL);
+
+	inode->base.type = SQFS_INODE_FILE;
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	sqfs_inode_set_file_size(inode, size);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+
+	assert(sqfs_data_writer_begin_file(img->wr, inode,
+					   files[f].flags) == 0);
+
+	for (i = 0, size = 0; i < MAX_EXTENTS && ext[i].size > 0; ++i) {
+		if (ext[i].seed == 0) {
+			assert(sqfs_data_writer_append_sparse(
+				       img->wr, ext[i].size) == 0);
+		} else {
+			assert(sqfs_data_writer_append(img->wr, data + size,
+						       ext[i].size) == 0);
+		}
+		size += ext[i].size;
+	}
+
+	assert(sqfs_data_writer_end_file(img->wr) == 0);
+	return inode;
+}
+
+int main(void)
+{
+	sqfs_inode_generic_t *ref_inodes[NUM_FILES], *inodes[NUM_FILES];
+	sqfs_data_writer_stats_t stats, ref_stats;
+	size_t i, size, sparse_blocks = 0;
+	sqfs_u32 frag_idx, frag_offset;
+	sqfs_data_reader_t *rd;
+	test_image_t ref, img;
+
+	image_create(&ref, BLOCK_SIZE, 1, 10);
+	image_create(&img, BLOCK_SIZE, 1, 10);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		size = gen_file(i);
+		ref_inodes[i] = image_add_file(&ref, data, size,
+					       files[i].flags);
+		inodes[i] = write_sparse(&img, i);
+		sparse_blocks += files[i].sparse_blocks;
+	}
+
+	image_finish(&ref);
+	image_finish(&img);
+
+	/* the result is the same as packing the zero bytes */
+	assert(img.file->size == ref.file->size);
+	assert(memcmp(img.file->data, ref.file->data, ref.file->size) == 0);
+
+	image_get_stats(&ref, &ref_stats);
+	image_get_stats(&img, &stats);
+	assert(ref_stats.sparse_blocks == sparse_blocks);
+	assert(stats.sparse_blocks == sparse_blocks);
+
+	rd = image_open_reader(&img);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		assert(inodes[i]->num_file_blocks ==
+		       ref_inodes[i]->num_file_blocks);
+		assert(memcmp(inodes[i]->block_sizes,
+			      ref_inodes[i]->block_sizes,
+			      inodes[i]->num_file_blocks *
+			      sizeof(sqfs_u32)) == 0);
+		assert(memcmp(&inodes[i]->data, &ref_inodes[i]->data,
+			      sizeof(inodes[i]->data)) == 0);
+
+		size = gen_file(i);
+		check_file(rd, inodes[i], data, size);
+	}
+
+	/* a tail end of zeros is a sparse block, not a fragment */
+	for (i = 4; i < NUM_FILES; ++i) {
+		sqfs_inode_get_frag_location(inodes[i], &frag_idx,
+					     &frag_offset);
+		assert(frag_idx == 0xFFFFFFFF);
+		assert(inodes[i]->block_sizes[inodes[i]->num_file_blocks -
+					      1] == 0);
+	}
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		free(ref_inodes[i]);
+		free(inodes[i]);
+	}
+
+	sqfs_data_reader_destroy(rd);
+	image_destroy(&img);
+	image_destroy(&ref);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,253 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * file_dedup.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "common.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define MAX_FILES (300)
+
+/* bigger than the chunks a file is hashed and compared in */
+#define BIG_SIZE (300 * 1024 + 17)
+
+#define HASH_MUL (0x9E3779B97F4A7C15ULL)
+#define HASH_MUL2 (0xC2B2AE3D27D4EB4FULL)
+
+typedef struct {
+	char name[32];
+	int fd;
+	sqfs_inode_generic_t *inode;
+} test_file_t;
+
+static test_file_t files[MAX_FILES];
+static size_t num_files;
+static sqfs_writer_t sqfs;
+
+static void fill_pattern(sqfs_u8 *data, size_t size, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+}
+
+static test_file_t *create_file(const void *data, size_t size)
+{
+	test_file_t *f = files + num_files++;
+
+	assert(num_files <= MAX_FILES);
+
+	strcpy(f->name, "file_dedup.XXXXXX");
+	f->fd = mkstemp(f->name);
+	assert(f->fd >= 0);
+	assert(write(f->fd, data, size) == (ssize_t)size);
+
+	f->inode = calloc(1, sizeof(*f->inode) +
+			  (size / 4096 + 1) * sizeof(sqfs_u32));
+	assert(f->inode != NULL);
+
+	f->inode->base.type = SQFS_INODE_FILE;
+	f->inode->block_sizes = (sqfs_u32 *)f->inode->extra;
+	sqfs_inode_set_file_size(f->inode, size);
+	sqfs_inode_set_frag_location(f->inode, 0xFFFFFFFF, 0xFFFFFFFF);
+	return f;
+}
+
+static int check(test_file_t *f, int flags)
+{
+	sqfs_u64 size;
+
+	sqfs_inode_get_file_size(f->inode, &size);
+
+	return file_dedup_check(&sqfs, f->name, f->fd, size, flags, f->inode);
+}
+
+/* what the data writer would have filled in for a file that was packed */
+static void fake_pack(test_file_t *f, sqfs_u64 start)
+{
+	sqfs_u64 size;
+	size_t i;
+
+	sqfs_inode_get_file_size(f->inode, &size);
+
+	f->inode->num_file_blocks = size / 4096;
+	for (i = 0; i < f->inode->num_file_blocks; ++i)
+		f->inode->block_sizes[i] = 1000 + start + i;
+
+	sqfs_inode_set_file_block_start(f->inode, start);
+	sqfs_inode_set_frag_location(f->inode, start, 10 * start);
+}
+
+static void check_resolved(const test_file_t *dup, const test_file_t *orig)
+{
+	const sqfs_inode_generic_t *a = dup->inode, *b = orig->inode;
+
+	assert(a->block_sizes == (sqfs_u32 *)a->extra);
+	assert(a->num_file_blocks == b->num_file_blocks);
+	assert(memcmp(a->block_sizes, b->block_sizes,
+		      a->num_file_blocks * sizeof(sqfs_u32)) == 0);
+	assert(memcmp(&a->data, &b->data, sizeof(a->data)) == 0);
+}
+
+static sqfs_u64 mix_word(sqfs_u64 hash, sqfs_u64 word)
+{
+	hash ^= word * HASH_MUL;
+	return ((hash << 31) | (hash >> 33)) * HASH_MUL2;
+}
+
+static sqfs_u64 mul_inverse(sqfs_u64 x)
+{
+	sqfs_u64 inv = x;
+	int i;
+
+	for (i = 0; i < 5; ++i)
+		inv *= 2 - x * inv;
+
+	return inv;
+}
+
+/*
+  Two files of two 64 bit words each, with different contents but the same
+  hash. The second word of the other file undoes the difference in the first.
+ */
+static void make_collision(sqfs_u64 a[2], sqfs_u64 b[2])
+{
+	sqfs_u64 sa, sb;
+
+	a[0] = 1;
+	a[1] = 2;
+	b[0] = 3;
+
+	sa = mix_word(2 * sizeof(sqfs_u64), a[0]);
+	sb = mix_word(2 * sizeof(sqfs_u64), b[0]);
+	b[1] = (sa ^ sb ^ (a[1] * HASH_MUL)) * mul_inverse(HASH_MUL);
+
+	assert(mix_word(sa, a[1]) == mix_word(sb, b[1]));
+}
+
+static const file_hash_t *find_entry(const test_file_t *f)
+{
+	const file_hash_t *it;
+	size_t i;
+
+	for (i = 0; i < sqfs.dedup.num_buckets; ++i) {
+		for (it = sqfs.dedup.buckets[i]; it != NULL; it = it->next) {
+			if (it->inode == f->inode)
+				return it;
+		}
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	test_file_t *a, *b, *c, *d, *e, *x, *y, *z, *f, *first;
+	sqfs_u64 col_a[2], col_b[2];
+	sqfs_u8 *data;
+	size_t i;
+
+	data = malloc(BIG_SIZE);
+	assert(data != NULL);
+
+	/* identical contents are found, a difference in the last byte not */
+	fill_pattern(data, BIG_SIZE, 1);
+	a = create_file(data, BIG_SIZE);
+	b = create_file(data, BIG_SIZE);
+	d = create_file(data, BIG_SIZE);
+	data[BIG_SIZE - 1] ^= 0xFF;
+	c = create_file(data, BIG_SIZE);
+
+	assert(check(a, 0) == 0);
+	assert(check(b, 0) == 1);
+	assert(check(c, 0) == 0);
+	assert(sqfs.stats.duplicate_files == 1);
+
+	/* files with other data writer flags are packed differently */
+	assert(check(d, SQFS_BLK_DONT_COMPRESS) == 0);
+	assert(sqfs.stats.duplicate_files == 1);
+
+	/* empty files have no data to share */
+	e = create_file(data, 0);
+	assert(check(e, 0) == 0);
+	e = create_file(data, 0);
+	assert(check(e, 0) == 0);
+	assert(sqfs.stats.duplicate_files == 1);
+
+	/* a hash match alone is not enough */
+	make_collision(col_a, col_b);
+	x = create_file(col_a, sizeof(col_a));
+	y = create_file(col_b, sizeof(col_b));
+	z = create_file(col_b, sizeof(col_b));
+
+	assert(check(x, 0) == 0);
+	assert(check(y, 0) == 0);
+	assert(find_entry(x)->hash == find_entry(y)->hash);
+
+	assert(check(z, 0) == 1);
+	assert(sqfs.stats.duplicate_files == 2);
+
+	/* enough files to grow and rehash the table */
+	for (i = 0; i < 200; ++i) {
+		fill_pattern(data, 5000 + i, 1000 + i);
+		f = create_file(data, 5000 + i);
+		assert(check(f, 0) == 0);
+	}
+
+	first = f - 199;
+
+	assert(sqfs.dedup.num_buckets > 128);
+
+	fill_pattern(data, BIG_SIZE, 1);
+	e = create_file(data, BIG_SIZE);
+	assert(check(e, 0) == 1);
+
+	fill_pattern(data, 5000, 1000);
+	c = create_file(data, 5000);
+	assert(check(c, 0) == 1);
+	assert(sqfs.stats.duplicate_files == 4);
+
+	/* duplicates get the block list of the file that was packed */
+	fake_pack(a, 100);
+	fake_pack(y, 200);
+	fake_pack(first, 300);
+
+	file_dedup_resolve(&sqfs);
+
+	check_resolved(b, a);
+	check_resolved(e, a);
+	check_resolved(z, y);
+	check_resolved(c, first);
+
+	/* a file that changed in the meantime is an error, not a mismatch */
+	fill_pattern(data, 5000, 999);
+	f = create_file(data, 5000);
+	assert(check(f, 0) == 0);
+	assert(ftruncate(f->fd, 100) == 0);
+	f = create_file(data, 5000);
+	assert(check(f, 0) == -1);
+
+	file_dedup_cleanup(&sqfs);
+	assert(sqfs.dedup.num_buckets == 0);
+	assert(sqfs.dedup.duplicates == NULL);
+
+	for (i = 0; i < num_files; ++i) {
+		close(files[i].fd);
+		unlink(files[i].name);
+		free(files[i].inode);
+	}
+
+	free(data);
+	return EXIT_SUCCESS;
+}
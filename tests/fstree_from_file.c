@@ -22,8 +22,20 @@ static const char *testdesc =
 "pipe /pipe 0644 10 11\n"
 "dir \"/foo bar\" 0755 0 0\n"
 "dir \"/foo bar/ test \\\"/\" 0755 0 0\n"
+"policy \"*.j pg\" dont-compress,level=1\n"
 "  sock  /sock  0555  12  13  ";
 
+static int policy_count = 0;
+
+static int policy_cb(void *user, const char *pattern, const char *options)
+{
+	assert(user == &policy_count);
+	assert(strcmp(pattern, "*.j pg") == 0);
+	assert(strcmp(options, "dont-compress,level=1") == 0);
+	policy_count += 1;
+	return 0;
+}
+
 int main(void)
 {
 	tree_node_t *n;
@@ -38,7 +50,9 @@ int main(void)
 	assert(fp != NULL);
 
 	assert(fstree_init(&fs, NULL) == 0);
-	assert(fstree_from_file(&fs, "testfile", fp) == 0);
+	assert(fstree_from_file(&fs, "testfile", fp,
+				policy_cb, &policy_count) == 0);
+	assert(policy_count == 1);
 
 	tree_node_sort_recursive(fs.root);
 	n = fs.root->data.dir.children;
@@ -31,7 +31,7 @@ int main(int argc, char **argv)
 	if (fstree_init(&fs, NULL))
 		goto out_fp;
 
-	if (fstree_from_file(&fs, argv[1], fp))
+	if (fstree_from_file(&fs, argv[1], fp, NULL, NULL))
 		goto out_fs;
 
 	ret = EXIT_SUCCESS;
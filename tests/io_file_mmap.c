@@ -0,0 +1,335 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * io_file_mmap.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "data_common.h"
+#include "sqfs/meta_writer.h"
+#include "sqfs/meta_reader.h"
+#include "sqfs/block.h"
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (8192)
+#define MAX_BLOCKS (4)
+#define META_SIZE (6 * SQFS_META_BLOCK_SIZE + 500)
+#define META_CHUNK (1000)
+
+/*
+  Blocks are 'P' for compressible data, 'R' for random bytes that end up
+  stored uncompressed and '0' for a sparse block.
+ */
+static const struct {
+	const char *blocks;
+	size_t tail;
+	sqfs_u32 flags;
+} files[] = {
+	{ "PPP", 1000, 0 },
+	{ "RR", 700, 0 },
+	{ "P0P", 0, 0 },
+	{ "PP", 300, SQFS_BLK_DONT_COMPRESS },
+	{ "", 2000, 0 },
+};
+
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+static sqfs_inode_generic_t *inodes[NUM_FILES];
+static sqfs_u8 content[NUM_FILES][MAX_BLOCKS * BLOCK_SIZE];
+static size_t sizes[NUM_FILES];
+
+/* meta data, the locations of its blocks and the corrupted block at the end */
+static sqfs_u8 meta[META_SIZE];
+static sqfs_u64 meta_start, meta_block[META_SIZE / META_CHUNK + 1];
+static sqfs_u32 meta_offset[META_SIZE / META_CHUNK + 1];
+static sqfs_u64 bad_meta_start;
+
+static sqfs_super_t super;
+static char filename[] = "io_file_mmap.XXXXXX";
+static sqfs_u64 file_size;
+
+static void fill_random(sqfs_u8 *ptr, size_t size, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		seed = seed * 1103515245 + 12345;
+		ptr[i] = seed >> 16;
+	}
+}
+
+static void gen_file(size_t f)
+{
+	size_t i, count = strlen(files[f].blocks);
+	sqfs_u8 *ptr = content[f];
+
+	for (i = 0; i < count; ++i, ptr += BLOCK_SIZE) {
+		if (files[f].blocks[i] == 'R') {
+			fill_random(ptr, BLOCK_SIZE, f * 10 + i);
+		} else if (files[f].blocks[i] == '0') {
+			memset(ptr, 0, BLOCK_SIZE);
+		} else {
+			fill_pattern(ptr, BLOCK_SIZE, f * 10 + i);
+		}
+	}
+
+	fill_pattern(ptr, files[f].tail, f * 10 + i);
+	sizes[f] = count * BLOCK_SIZE + files[f].tail;
+}
+
+/* compressible meta data blocks, followed by incompressible ones */
+static void write_meta(test_image_t *img)
+{
+	sqfs_meta_writer_t *mw;
+	sqfs_u8 header[2];
+	size_t i;
+
+	fill_pattern(meta, META_SIZE / 2, 1);
+	fill_random(meta + META_SIZE / 2, META_SIZE - META_SIZE / 2, 2);
+
+	meta_start = img->file->size;
+	mw = sqfs_meta_writer_create((sqfs_file_t *)img->file, img->cmp, 0);
+	assert(mw != NULL);
+
+	for (i = 0; i * META_CHUNK < META_SIZE; ++i) {
+		sqfs_meta_writer_get_position(mw, meta_block + i,
+					      meta_offset + i);
+		meta_block[i] += meta_start;
+
+		assert(sqfs_meta_writer_append(mw, meta + i * META_CHUNK,
+					       META_SIZE - i * META_CHUNK <
+					       META_CHUNK ?
+					       META_SIZE - i * META_CHUNK :
+					       META_CHUNK) == 0);
+	}
+
+	assert(sqfs_meta_writer_flush(mw) == 0);
+	sqfs_meta_writer_destroy(mw);
+
+	/* an uncompressed block that claims to be larger than what is left */
+	bad_meta_start = img->file->size;
+	header[0] = 100;
+	header[1] = 0x80;
+	assert(img->file->base.write_at((sqfs_file_t *)img->file,
+					bad_meta_start, header, 2) == 0);
+}
+
+static void create_image(void)
+{
+	test_image_t img;
+	size_t f;
+	int fd;
+
+	image_create(&img, BLOCK_SIZE, 1, 10);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		gen_file(f);
+		inodes[f] = image_add_file(&img, content[f], sizes[f],
+					   files[f].flags);
+	}
+
+	image_finish(&img);
+	super = img.super;
+
+	write_meta(&img);
+	file_size = img.file->size;
+
+	fd = mkstemp(filename);
+	assert(fd >= 0);
+	assert(write(fd, img.file->data, img.file->size) ==
+	       (ssize_t)img.file->size);
+	assert(close(fd) == 0);
+
+	image_destroy(&img);
+}
+
+/*
+  Everything read back through one file object, so it can be compared
+  with what was read through the other.
+ */
+typedef struct {
+	sqfs_u8 meta[META_SIZE];
+	sqfs_u8 blocks[NUM_FILES][MAX_BLOCKS * BLOCK_SIZE];
+	sqfs_u8 refs[NUM_FILES][MAX_BLOCKS * BLOCK_SIZE];
+	sqfs_u8 data[NUM_FILES][MAX_BLOCKS * BLOCK_SIZE];
+	int errors[6];
+} result_t;
+
+static void read_meta(sqfs_file_t *file, sqfs_compressor_t *uncmp,
+		      result_t *out)
+{
+	sqfs_meta_reader_t *mr;
+	size_t i, size;
+
+	mr = sqfs_meta_reader_create(file, uncmp, meta_start, file_size);
+	assert(mr != NULL);
+
+	/* sequentially, then back to front from the recorded positions */
+	assert(sqfs_meta_reader_seek(mr, meta_start, 0) == 0);
+	assert(sqfs_meta_reader_read(mr, out->meta, META_SIZE) == 0);
+	assert(memcmp(out->meta, meta, META_SIZE) == 0);
+
+	memset(out->meta, 0, META_SIZE);
+
+	for (i = META_SIZE / META_CHUNK + 1; i-- > 0; ) {
+		size = META_SIZE - i * META_CHUNK;
+		if (size > META_CHUNK)
+			size = META_CHUNK;
+
+		assert(sqfs_meta_reader_seek(mr, meta_block[i],
+					     meta_offset[i]) == 0);
+		assert(sqfs_meta_reader_read(mr, out->meta + i * META_CHUNK,
+					     size) == 0);
+	}
+
+	assert(memcmp(out->meta, meta, META_SIZE) == 0);
+
+	/* past the end of the mapping */
+	out->errors[0] = sqfs_meta_reader_seek(mr, bad_meta_start, 0);
+	sqfs_meta_reader_destroy(mr);
+
+	mr = sqfs_meta_reader_create(file, uncmp, meta_start,
+				     file_size + SQFS_META_BLOCK_SIZE);
+	assert(mr != NULL);
+	out->errors[1] = sqfs_meta_reader_seek(mr, bad_meta_start, 0);
+	out->errors[2] = sqfs_meta_reader_seek(mr, file_size + 10, 0);
+	sqfs_meta_reader_destroy(mr);
+}
+
+static void read_data(sqfs_file_t *file, sqfs_compressor_t *uncmp,
+		      result_t *out)
+{
+	sqfs_data_reader_t *rd;
+	const sqfs_u8 *ptr;
+	sqfs_block_t *blk;
+	size_t f, i, size;
+
+	rd = sqfs_data_reader_create(file, BLOCK_SIZE, uncmp);
+	assert(rd != NULL);
+	assert(sqfs_data_reader_load_fragment_table(rd, &super) == 0);
+
+	for (f = 0; f < NUM_FILES; ++f) {
+		for (i = 0; i < inodes[f]->num_file_blocks; ++i) {
+			assert(sqfs_data_reader_get_block(rd, inodes[f], i,
+							  &blk) == 0);
+			memcpy(out->blocks[f] + i * BLOCK_SIZE, blk->data,
+			       blk->size);
+			free(blk);
+
+			assert(sqfs_data_reader_get_block_ref(rd, inodes[f],
+							      i, &ptr,
+							      &size) == 0);
+			memcpy(out->refs[f] + i * BLOCK_SIZE, ptr, size);
+			sqfs_data_reader_release_ref(rd, ptr);
+		}
+
+		assert(sqfs_data_reader_get_fragment(rd, inodes[f],
+						     &blk) == 0);
+		if (blk != NULL) {
+			memcpy(out->blocks[f] + i * BLOCK_SIZE, blk->data,
+			       blk->size);
+			free(blk);
+		}
+
+		assert(sqfs_data_reader_get_fragment_ref(rd, inodes[f], &ptr,
+							 &size) == 0);
+		if (ptr != NULL) {
+			memcpy(out->refs[f] + i * BLOCK_SIZE, ptr, size);
+			sqfs_data_reader_release_ref(rd, ptr);
+		}
+
+		assert(sqfs_data_reader_read(rd, inodes[f], 0, out->data[f],
+					     sizes[f]) == (sqfs_s32)sizes[f]);
+
+		assert(memcmp(out->blocks[f], content[f], sizes[f]) == 0);
+		assert(memcmp(out->refs[f], content[f], sizes[f]) == 0);
+		assert(memcmp(out->data[f], content[f], sizes[f]) == 0);
+	}
+
+	sqfs_data_reader_destroy(rd);
+}
+
+/* blocks that reach past the end of the file, compressed and not */
+static void read_bad_blocks(sqfs_file_t *file, sqfs_compressor_t *uncmp,
+			    result_t *out)
+{
+	sqfs_inode_generic_t *inode;
+	sqfs_data_reader_t *rd;
+	sqfs_block_t *blk;
+	sqfs_u8 buffer[64];
+
+	inode = calloc(1, sizeof(*inode) + 2 * sizeof(sqfs_u32));
+	assert(inode != NULL);
+
+	inode->base.type = SQFS_INODE_FILE;
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->num_file_blocks = 2;
+	inode->block_sizes[0] = 4000;
+	inode->block_sizes[1] = 4000 | (1 << 24);
+	sqfs_inode_set_file_size(inode, 2 * BLOCK_SIZE);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+	sqfs_inode_set_file_block_start(inode, file_size - 4100);
+
+	rd = sqfs_data_reader_create(file, BLOCK_SIZE, uncmp);
+	assert(rd != NULL);
+	assert(sqfs_data_reader_load_fragment_table(rd, &super) == 0);
+
+	out->errors[3] = sqfs_data_reader_get_block(rd, inode, 1, &blk);
+	out->errors[4] = sqfs_data_reader_read(rd, inode, BLOCK_SIZE, buffer,
+					       sizeof(buffer));
+	sqfs_data_reader_destroy(rd);
+	free(inode);
+
+	out->errors[5] = file->read_at(file, file_size - 10, buffer, 20);
+}
+
+static void read_image(sqfs_u32 flags, result_t *out)
+{
+	sqfs_compressor_config_t cfg;
+	sqfs_compressor_t *uncmp;
+	sqfs_file_t *file;
+
+	assert(sqfs_compressor_config_init(&cfg, SQFS_COMP_GZIP, BLOCK_SIZE,
+					   SQFS_COMP_FLAG_UNCOMPRESS) == 0);
+	uncmp = sqfs_compressor_create(&cfg);
+	assert(uncmp != NULL);
+
+	file = sqfs_open_file(filename, flags);
+	assert(file != NULL);
+	assert(file->get_size(file) == file_size);
+
+	memset(out, 0, sizeof(*out));
+	read_meta(file, uncmp, out);
+	read_data(file, uncmp, out);
+	read_bad_blocks(file, uncmp, out);
+
+	file->destroy(file);
+	uncmp->destroy(uncmp);
+}
+
+int main(void)
+{
+	static result_t plain, mapped;
+	size_t i;
+
+	create_image();
+
+	read_image(SQFS_FILE_OPEN_READ_ONLY, &plain);
+	read_image(SQFS_FILE_OPEN_READ_ONLY | SQFS_FILE_OPEN_MMAP, &mapped);
+
+	assert(memcmp(&plain, &mapped, sizeof(plain)) == 0);
+
+	for (i = 0; i < sizeof(plain.errors) / sizeof(plain.errors[0]); ++i)
+		assert(plain.errors[i] < 0);
+
+	assert(plain.errors[5] == SQFS_ERROR_OUT_OF_BOUNDS);
+
+	unlink(filename);
+	return EXIT_SUCCESS;
+}
@@ -133,11 +133,30 @@ static int gen_file_list_dfs(const sqfs_tree_node_t *n)
 	return 0;
 }
 
+static int queue_files(sqfs_data_reader_t *data)
+{
+	size_t i;
+	int ret;
+
+	for (i = 0; i < num_files; ++i) {
+		ret = sqfs_data_reader_queue_file(data, files[i].inode);
+		if (ret) {
+			sqfs_perror(files[i].path, "queueing file", ret);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int fill_files(sqfs_data_reader_t *data, int flags)
 {
 	size_t i;
 	FILE *fp;
 
+	if (queue_files(data))
+		return -1;
+
 	for (i = 0; i < num_files; ++i) {
 		fp = fopen(files[i].path, "wb");
 		if (fp == NULL) {
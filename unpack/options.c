@@ -26,6 +26,7 @@ static struct option long_opts[] = {
 	{ "chmod", no_argument, NULL, 'C' },
 	{ "chown", no_argument, NULL, 'O' },
 	{ "quiet", no_argument, NULL, 'q' },
+	{ "num-jobs", required_argument, NULL, 'j' },
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
 };
@@ -79,6 +80,11 @@ static const char *help_string =
 "                            UID/GID set in the squashfs image.\n"
 "  --quiet, -q               Do not print out progress while unpacking.\n"
 "\n"
+"  --num-jobs, -j <count>    Number of threads to use for decompressing\n"
+"                            file data. If more than one, the upcoming\n"
+"                            blocks are decompressed ahead of time.\n"
+"                            Defaults to 1.\n"
+"\n"
 "  --help, -h                Print help text and exit.\n"
 "  --version, -V             Print version information and exit.\n"
 "\n";
@@ -106,6 +112,7 @@ static char *get_path(char *old, const char *arg)
 
 void process_command_line(options_t *opt, int argc, char **argv)
 {
+	size_t num_jobs;
 	int i;
 
 	opt->op = OP_NONE;
@@ -114,6 +121,7 @@ void process_command_line(options_t *opt, int argc, char **argv)
 	opt->cmdpath = NULL;
 	opt->unpack_root = NULL;
 	opt->image_name = NULL;
+	opt->num_jobs = 1;
 
 	for (;;) {
 		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
@@ -180,6 +188,13 @@ void process_command_line(options_t *opt, int argc, char **argv)
 		case 'q':
 			opt->flags |= UNPACK_QUIET;
 			break;
+		case 'j':
+			if (parse_size("Number of jobs", &num_jobs, optarg,
+				       1, MAX_NUM_JOBS)) {
+				goto fail_arg;
+			}
+			opt->num_jobs = num_jobs;
+			break;
 		case 'h':
 			fputs(help_string, stdout);
 			free(opt->cmdpath);
@@ -23,7 +23,8 @@ int main(int argc, char **argv)
 
 	process_command_line(&opt, argc, argv);
 
-	file = sqfs_open_file(opt.image_name, SQFS_FILE_OPEN_READ_ONLY);
+	file = sqfs_open_file(opt.image_name, SQFS_FILE_OPEN_READ_ONLY |
+			      SQFS_FILE_OPEN_MMAP);
 	if (file == NULL) {
 		perror(opt.image_name);
 		goto out_cmd;
@@ -109,6 +110,15 @@ int main(int argc, char **argv)
 		goto out_data;
 	}
 
+	if (opt.num_jobs > 1) {
+		ret = sqfs_data_reader_set_readahead(data, opt.num_jobs, 0);
+		if (ret) {
+			sqfs_perror(opt.image_name, "setting up read-ahead",
+				    ret);
+			goto out_data;
+		}
+	}
+
 	ret = sqfs_dir_reader_get_full_hierarchy(dirrd, idtbl, opt.cmdpath,
 						 opt.rdtree_flags, &n);
 	if (ret) {
@@ -127,6 +137,12 @@ int main(int argc, char **argv)
 			goto out;
 		}
 
+		ret = sqfs_data_reader_queue_file(data, n->inode);
+		if (ret) {
+			sqfs_perror(opt.cmdpath, "queueing file", ret);
+			goto out;
+		}
+
 		if (sqfs_data_reader_dump(opt.cmdpath, data, n->inode,
 					  stdout, super.block_size, false)) {
 			goto out;
@@ -50,6 +50,7 @@ typedef struct {
 	char *cmdpath;
 	const char *unpack_root;
 	const char *image_name;
+	unsigned int num_jobs;
 } options_t;
 
 void list_files(const sqfs_tree_node_t *node);